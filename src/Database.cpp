@@ -32,8 +32,11 @@
 #include "Globals.h"
 #include "Utils.h"
 
+#include <QDateTime>
 #include <QDebug>
 #include <QDir>
+#include <QFileInfo>
+#include <QMap>
 #include <QSqlDatabase>
 #include <QSqlDriver>
 #include <QSqlError>
@@ -43,21 +46,49 @@
 #include <QStandardPaths>
 #include <QString>
 #include <QStringList>
+#include <QThread>
+#include <QTimer>
 
-#include "Kaidan.h"
+#include <algorithm>
+#include <limits>
 
 #define DATABASE_CONVERT_TO_VERSION(n) \
 	if (m_version < n) { \
 		convertDatabaseToV##n(); \
+		finishConversionStep(); \
 	}
 
 // Both need to be updated on version bump:
-#define DATABASE_LATEST_VERSION 12
-#define DATABASE_CONVERT_TO_LATEST_VERSION() DATABASE_CONVERT_TO_VERSION(12)
+#define DATABASE_LATEST_VERSION 18
+#define DATABASE_CONVERT_TO_LATEST_VERSION() DATABASE_CONVERT_TO_VERSION(18)
+
+// time in ms to wait for a lock held by another connection
+#define BUSY_TIMEOUT "5000"
+
+// maximum time in ms until a batch of writes is committed
+constexpr int WRITE_BATCH_INTERVAL = 100;
+// maximum number of writes in a batch
+constexpr int WRITE_BATCH_SIZE = 500;
+
+// number of rows converted in one transaction by convertInChunks()
+constexpr int CONVERSION_CHUNK_SIZE = 10000;
+
+// time in ms without writes after which the maintenance is started
+constexpr int MAINTENANCE_IDLE_INTERVAL = 60 * 1000;
+// time in ms between two steps of the maintenance for other writes in between
+constexpr int MAINTENANCE_STEP_INTERVAL = 50;
+// number of pages returned to the file system in one step of the maintenance
+constexpr int VACUUM_STEP_PAGES = 32;
+// number of rowids checked for old messages in one step of the maintenance
+constexpr int ARCHIVE_STEP_ROWS = 200;
+
+// approximate number of rows read per index by ANALYZE
+#define ANALYSIS_LIMIT "400"
 
 #define SQL_BOOL "BOOL"
 #define SQL_INTEGER "INTEGER"
 #define SQL_INTEGER_NOT_NULL "INTEGER NOT NULL"
+#define SQL_INTEGER_PRIMARY_KEY "INTEGER PRIMARY KEY"
 #define SQL_TEXT "TEXT"
 #define SQL_TEXT_NOT_NULL "TEXT NOT NULL"
 #define SQL_BLOB "BLOB"
@@ -71,14 +102,44 @@
 #define SQL_ATTRIBUTE(name, dataType) \
 	SQL_LAST_ATTRIBUTE(name, dataType) ","
 
+#define SQL_CREATE_INDEX(indexName, tableName, columns) \
+	"CREATE INDEX '" indexName "' ON '" tableName "' (" columns ")"
+
+// Messages are unique per sender, recipient and ID. Messages without IDs are
+// stored with a space as their ID and can occur multiple times.
+#define SQL_CREATE_MESSAGES_UNIQUE_INDEX \
+	"CREATE UNIQUE INDEX 'idx_messages_unique' ON '" DB_TABLE_MESSAGES "' " \
+	"(author, recipient, id) WHERE id != ' '"
+
 Database::Database(QObject *parent)
-	: QObject(parent)
+	: QObject(parent),
+	  m_batchTimer(new QTimer(this)),
+	  m_maintenanceTimer(new QTimer(this)),
+	  m_readThread(new QThread()),
+	  m_readContext(new QObject())
 {
+	m_batchTimer->setSingleShot(true);
+	m_batchTimer->setInterval(WRITE_BATCH_INTERVAL);
+	connect(m_batchTimer, &QTimer::timeout, this, &Database::commitBatch);
+
+	m_maintenanceTimer->setSingleShot(true);
+	connect(m_maintenanceTimer, &QTimer::timeout, this, &Database::runMaintenanceStep);
+
+	m_readThread->setObjectName("SqlDatabaseReader");
+	m_readContext->moveToThread(m_readThread);
+
+	// Both signals are emitted by the read thread itself.
+	connect(m_readThread, &QThread::started, m_readContext, [this]() {
+		openReadConnection(m_database.databaseName());
+	}, Qt::DirectConnection);
+	connect(m_readThread, &QThread::finished, m_readContext, &Database::closeReadConnection, Qt::DirectConnection);
 }
 
 Database::~Database()
 {
-	m_database.close();
+	closeDatabase();
+	delete m_readContext;
+	delete m_readThread;
 }
 
 void Database::openDatabase()
@@ -96,24 +157,82 @@ void Database::openDatabase()
 	const QString fileName = writeDir.absoluteFilePath(DB_FILENAME);
 	// open() will create the SQLite database if it doesn't exist.
 	m_database.setDatabaseName(fileName);
+	// Wait for other connections (e.g., of other instances of Kaidan) instead of
+	// failing immediately if they lock the database.
+	m_database.setConnectOptions(QStringLiteral("QSQLITE_BUSY_TIMEOUT=" BUSY_TIMEOUT));
 	if (!m_database.open()) {
 		qFatal("Cannot open database: %s", qPrintable(m_database.lastError().text()));
 	}
 
+	// Free pages are returned to the file system by the maintenance. This only
+	// has an effect before the first table is created, existing databases are
+	// switched by enableIncrementalVacuum().
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, "PRAGMA auto_vacuum = INCREMENTAL");
+	// With write-ahead logging, reads are not blocked by writes of other
+	// connections and committing needs fewer syncs to the disk.
+	Utils::execQuery(query, "PRAGMA journal_mode = WAL");
+	Utils::execQuery(query, "PRAGMA synchronous = NORMAL");
+	// The statistics for the query planner are only created from a sample of
+	// each index, so that updating them is fast.
+	Utils::execQuery(query, "PRAGMA analysis_limit = " ANALYSIS_LIMIT);
+
 	loadDatabaseInfo();
 
 	if (needToConvert())
 		convertDatabase();
+	else
+		enableIncrementalVacuum();
+
+	attachArchive(m_database);
+	Utils::execQuery(query, "PRAGMA " DB_ARCHIVE ".journal_mode = WAL");
+	Utils::execQuery(query, "PRAGMA " DB_ARCHIVE ".synchronous = NORMAL");
+	createArchiveTables();
+	finishMessageArchival();
+
+	m_readThread->start();
+
+	m_maintenanceTimer->start(MAINTENANCE_IDLE_INTERVAL);
+}
+
+void Database::stopReading()
+{
+	m_readThread->quit();
+	m_readThread->wait();
+}
+
+void Database::closeDatabase()
+{
+	if (!m_database.isOpen())
+		return;
+
+	stopReading();
+
+	commitBatch();
+	m_maintenanceTimer->stop();
+
+	const auto statistics = Utils::preparedQueryCacheStatistics();
+	qDebug() << "[database] Prepared query cache hits:" << statistics.hits
+	         << "misses:" << statistics.misses;
+
+	Utils::clearPreparedQueryCache(m_database.driver());
+	m_database.close();
+}
+
+QObject *Database::readContext() const
+{
+	return m_readContext;
 }
 
 void Database::transaction()
 {
 	if (!m_transactions) {
-		// currently no transactions running
-		if (!m_database.transaction()) {
-			qWarning() << "Could not begin transaction on database:"
-			           << m_database.lastError().text();
-		}
+		// Currently no transactions running.
+		// The write lock is acquired immediately. Otherwise, the transaction could
+		// fail without waiting if another connection writes between a read and a
+		// write of this transaction.
+		QSqlQuery query(m_database);
+		Utils::execQuery(query, "BEGIN IMMEDIATE");
 	}
 	// increase counter
 	m_transactions++;
@@ -134,6 +253,84 @@ void Database::commit()
 	}
 }
 
+void Database::batchWrite()
+{
+	if (m_batchedWrites >= WRITE_BATCH_SIZE)
+		commitBatch();
+
+	if (!m_batchedWrites++) {
+		transaction();
+		m_batchTimer->start();
+	}
+
+	// The maintenance is postponed until there have not been writes for a while.
+	m_maintenanceTimer->start(MAINTENANCE_IDLE_INTERVAL);
+}
+
+void Database::commitBatch()
+{
+	if (m_batchedWrites) {
+		m_batchTimer->stop();
+		m_batchedWrites = 0;
+		commit();
+	}
+}
+
+void Database::readAfterBatch(const std::function<void()> &read)
+{
+	Q_ASSERT(QThread::currentThread() == m_readThread);
+
+	// Reads are also deferred while earlier reads are waiting, so that they keep
+	// their order.
+	if (!m_batchedWrites && !m_deferredReads) {
+		read();
+		return;
+	}
+
+	m_deferredReads++;
+	QMetaObject::invokeMethod(this, [this, read]() {
+		commitBatch();
+		QMetaObject::invokeMethod(m_readContext, [this, read]() {
+			m_deferredReads--;
+			read();
+		});
+	});
+}
+
+void Database::setMessageArchiveAge(int days)
+{
+	m_messageArchiveAge = days;
+}
+
+void Database::attachArchive(const QSqlDatabase &database)
+{
+	const QString fileName = QFileInfo(database.databaseName()).absoluteDir().absoluteFilePath(DB_ARCHIVE_FILENAME);
+
+	QSqlQuery query(database);
+	Utils::execQuery(query, "ATTACH DATABASE ? AS " DB_ARCHIVE, QVector<QVariant>() << fileName);
+}
+
+void Database::openReadConnection(const QString &fileName)
+{
+	auto database = QSqlDatabase::addDatabase("QSQLITE", DB_CONNECTION_READ);
+	database.setDatabaseName(fileName);
+	database.setConnectOptions(QStringLiteral("QSQLITE_OPEN_READONLY;QSQLITE_BUSY_TIMEOUT=" BUSY_TIMEOUT));
+	if (!database.open())
+		qFatal("Cannot open read-only database connection: %s", qPrintable(database.lastError().text()));
+
+	attachArchive(database);
+}
+
+void Database::closeReadConnection()
+{
+	{
+		auto database = QSqlDatabase::database(DB_CONNECTION_READ, false);
+		Utils::clearPreparedQueryCache(database.driver());
+		database.close();
+	}
+	QSqlDatabase::removeDatabase(DB_CONNECTION_READ);
+}
+
 void Database::loadDatabaseInfo()
 {
 	QStringList tables = m_database.tables();
@@ -187,15 +384,364 @@ bool Database::needToConvert()
 void Database::convertDatabase()
 {
 	qDebug() << "[database] Converting database to latest version from version" << m_version;
+	m_conversionStartVersion = m_version;
+	emit conversionProgressChanged(0);
+
 	transaction();
 
-	if (m_version == 0)
+	if (m_version == 0) {
 		createNewDatabase();
-	else
+		saveDatabaseInfo();
+	} else {
+		// The progress of an interrupted conversion is kept in this table until
+		// the database is up-to-date.
+		QSqlQuery query(m_database);
+		Utils::execQuery(
+			query,
+			"CREATE TABLE IF NOT EXISTS '" DB_TABLE_CONVERSION "' ("
+				SQL_ATTRIBUTE(version, SQL_INTEGER_NOT_NULL)
+				SQL_ATTRIBUTE(lastRowId, SQL_INTEGER_NOT_NULL)
+				"PRIMARY KEY(version)"
+			")"
+		);
+
 		DATABASE_CONVERT_TO_LATEST_VERSION();
 
+		Utils::execQuery(query, "DROP TABLE " DB_TABLE_CONVERSION);
+	}
+
+	commit();
+
+	// This is done while the progress is still shown because it rewrites the
+	// whole database.
+	enableIncrementalVacuum();
+
+	emit conversionProgressChanged(1);
+}
+
+void Database::finishConversionStep()
+{
 	saveDatabaseInfo();
+
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, "DELETE FROM " DB_TABLE_CONVERSION);
+
+	// Each step is committed on its own, so that an interrupted conversion can be
+	// continued after the last finished step.
 	commit();
+	transaction();
+
+	reportConversionProgress(0);
+}
+
+bool Database::isConversionStepStarted()
+{
+	return loadConversionStepProgress() >= 0;
+}
+
+qint64 Database::loadConversionStepProgress()
+{
+	QSqlQuery query(m_database);
+	Utils::execQuery(
+		query,
+		"SELECT lastRowId FROM " DB_TABLE_CONVERSION " WHERE version = ?",
+		QVector<QVariant>() << m_version + 1
+	);
+
+	qint64 lastRowId = -1;
+	if (query.next())
+		lastRowId = query.value(0).toLongLong();
+	query.finish();
+	return lastRowId;
+}
+
+void Database::convertInChunks(const QString &tableName, const QStringList &statements)
+{
+	Q_ASSERT(m_transactions == 1);
+
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, QStringLiteral("SELECT count(*) FROM ") + tableName);
+	query.next();
+	const qint64 rowCount = query.value(0).toLongLong();
+	// Single-row reads are finished explicitly because the cached statements
+	// would otherwise stay active and prevent dropping the converted tables.
+	query.finish();
+
+	qint64 lastRowId = std::max(loadConversionStepProgress(), qint64(0));
+
+	Utils::execQuery(
+		query,
+		QStringLiteral("SELECT count(*) FROM ") + tableName + QStringLiteral(" WHERE rowid <= ?"),
+		QVector<QVariant>() << lastRowId
+	);
+	query.next();
+	qint64 convertedRowCount = query.value(0).toLongLong();
+	query.finish();
+
+	while (convertedRowCount < rowCount) {
+		// The chunks are determined by the rowids of their last rows, so that rows
+		// with missing rowids in between are not counted.
+		Utils::execQuery(
+			query,
+			QStringLiteral("SELECT rowid FROM ") + tableName +
+			QStringLiteral(" WHERE rowid > ? ORDER BY rowid LIMIT 1 OFFSET ?"),
+			QVector<QVariant>() << lastRowId << CONVERSION_CHUNK_SIZE - 1
+		);
+		const qint64 chunkLastRowId = query.next() ? query.value(0).toLongLong()
+		                                           : std::numeric_limits<qint64>::max();
+		query.finish();
+
+		const QMap<QString, QVariant> bindValues = {
+			{ QStringLiteral(":firstRowId"), lastRowId },
+			{ QStringLiteral(":lastRowId"), chunkLastRowId },
+		};
+		for (const auto &statement : statements)
+			Utils::execQuery(query, statement, bindValues);
+
+		lastRowId = chunkLastRowId;
+		convertedRowCount = std::min(convertedRowCount + CONVERSION_CHUNK_SIZE, rowCount);
+
+		Utils::execQuery(
+			query,
+			"INSERT OR REPLACE INTO " DB_TABLE_CONVERSION " (version, lastRowId) VALUES (?, ?)",
+			QVector<QVariant>() << m_version + 1 << lastRowId
+		);
+
+		// The chunk is committed together with its progress, so that the step can
+		// be continued after it.
+		commit();
+		transaction();
+
+		reportConversionProgress(qreal(convertedRowCount) / rowCount);
+	}
+}
+
+void Database::enableIncrementalVacuum()
+{
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, "PRAGMA auto_vacuum");
+	query.next();
+	const int autoVacuum = query.value(0).toInt();
+	query.finish();
+
+	// 2 stands for INCREMENTAL
+	if (autoVacuum == 2)
+		return;
+
+	qDebug() << "[database] Enabling incremental vacuum";
+
+	// VACUUM fails as long as any statement is still active.
+	query.finish();
+	Utils::clearPreparedQueryCache(m_database.driver());
+	Utils::execQuery(query, "VACUUM");
+}
+
+void Database::createArchiveTables()
+{
+	// Archived messages keep the rowid of the original message in sourceRowId
+	// until they are removed from the main database. The full-text index does
+	// not refer to the bodies, which are compressed, but only stores the index.
+	QSqlQuery query(m_database);
+	Utils::execQuery(
+		query,
+		"CREATE TABLE IF NOT EXISTS " DB_ARCHIVE "." DB_TABLE_MESSAGES " ("
+			SQL_ATTRIBUTE(rowid, SQL_INTEGER_PRIMARY_KEY)
+			SQL_ATTRIBUTE(sourceRowId, SQL_INTEGER)
+			SQL_ATTRIBUTE(author, SQL_TEXT_NOT_NULL)
+			SQL_ATTRIBUTE(recipient, SQL_TEXT_NOT_NULL)
+			SQL_ATTRIBUTE(timestamp, SQL_INTEGER)
+			SQL_ATTRIBUTE(message, SQL_BLOB)
+			SQL_ATTRIBUTE(id, SQL_TEXT_NOT_NULL)
+			SQL_ATTRIBUTE(deliveryState, SQL_INTEGER)
+			SQL_ATTRIBUTE(type, SQL_INTEGER)
+			SQL_ATTRIBUTE(edited, SQL_BOOL)
+			SQL_ATTRIBUTE(spoilerHint, SQL_TEXT)
+			SQL_ATTRIBUTE(isSpoiler, SQL_BOOL)
+			SQL_ATTRIBUTE(errorText, SQL_TEXT)
+			SQL_ATTRIBUTE(replaceId, SQL_TEXT)
+			SQL_ATTRIBUTE(mediaUrl, SQL_TEXT)
+			SQL_ATTRIBUTE(mediaSize, SQL_INTEGER)
+			SQL_ATTRIBUTE(mediaContentType, SQL_TEXT)
+			SQL_ATTRIBUTE(mediaLastModified, SQL_INTEGER)
+			SQL_LAST_ATTRIBUTE(mediaLocation, SQL_TEXT)
+		")"
+	);
+	Utils::execQuery(
+		query,
+		"CREATE INDEX IF NOT EXISTS " DB_ARCHIVE ".idx_messages_source "
+		"ON " DB_TABLE_MESSAGES " (sourceRowId) WHERE sourceRowId IS NOT NULL"
+	);
+	Utils::execQuery(
+		query,
+		"CREATE VIRTUAL TABLE IF NOT EXISTS " DB_ARCHIVE "." DB_TABLE_MESSAGES_FTS " "
+		"USING fts5(message, content='')"
+	);
+}
+
+void Database::runMaintenanceStep()
+{
+	// The maintenance must not become part of a batch of writes.
+	if (m_batchedWrites) {
+		m_maintenanceTimer->start(MAINTENANCE_IDLE_INTERVAL);
+		return;
+	}
+
+	switch (m_maintenanceTask) {
+	case MaintenanceTask::ArchiveMessages:
+		if (!m_messageArchiveAge || !archiveMessages()) {
+			m_archivedRowId = 0;
+			m_maintenanceTask = MaintenanceTask::Vacuum;
+		}
+		break;
+	case MaintenanceTask::Vacuum:
+		if (!vacuumIncrementally())
+			m_maintenanceTask = MaintenanceTask::Optimize;
+		break;
+	case MaintenanceTask::Optimize: {
+		// This only analyzes the tables whose statistics are outdated.
+		QSqlQuery query(m_database);
+		Utils::execQuery(query, "PRAGMA optimize");
+
+		// The next maintenance is started after the next writes.
+		m_maintenanceTask = MaintenanceTask::ArchiveMessages;
+		return;
+	}
+	}
+
+	m_maintenanceTimer->start(MAINTENANCE_STEP_INTERVAL);
+}
+
+bool Database::archiveMessages()
+{
+	const qint64 maxStamp = QDateTime::currentDateTimeUtc().addDays(-m_messageArchiveAge).toMSecsSinceEpoch();
+	const qint64 firstRowId = m_archivedRowId;
+	const qint64 lastRowId = firstRowId + ARCHIVE_STEP_ROWS;
+
+	transaction();
+
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, "SELECT max(rowid) FROM " DB_TABLE_MESSAGES);
+	query.next();
+	const qint64 maxRowId = query.value(0).toLongLong();
+	query.finish();
+
+	Utils::execQuery(
+		query,
+		"SELECT m.rowid, m.author, m.recipient, m.timestamp, m.message, m.id, "
+		"m.deliveryState, m.type, m.edited, m.spoilerHint, m.isSpoiler, m.errorText, "
+		"m.replaceId, mm.mediaUrl, mm.mediaSize, mm.mediaContentType, "
+		"mm.mediaLastModified, mm.mediaLocation "
+		"FROM " DB_TABLE_MESSAGES " m "
+		"LEFT JOIN " DB_TABLE_MESSAGE_MEDIA " mm ON mm.messageRowId = m.rowid "
+		"WHERE m.rowid > ? AND m.rowid <= ? AND m.timestamp < ?",
+		QVector<QVariant>() << firstRowId << lastRowId << maxStamp
+	);
+
+	QVector<QVector<QVariant>> messages;
+	while (query.next()) {
+		QVector<QVariant> values;
+		for (int i = 0; i < query.record().count(); i++)
+			values << query.value(i);
+		messages << values;
+	}
+
+	for (auto &values : messages) {
+		const QString body = values.at(4).toString();
+		values[4] = Utils::compressText(body);
+
+		Utils::execQuery(
+			query,
+			"INSERT INTO " DB_ARCHIVE "." DB_TABLE_MESSAGES " (sourceRowId, author, "
+			"recipient, timestamp, message, id, deliveryState, type, edited, spoilerHint, "
+			"isSpoiler, errorText, replaceId, mediaUrl, mediaSize, mediaContentType, "
+			"mediaLastModified, mediaLocation) "
+			"VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?)",
+			values
+		);
+
+		if (!body.isEmpty()) {
+			Utils::execQuery(
+				query,
+				"INSERT INTO " DB_ARCHIVE "." DB_TABLE_MESSAGES_FTS " (rowid, message) VALUES (?, ?)",
+				QVector<QVariant>() << query.lastInsertId() << body
+			);
+		}
+	}
+
+	commit();
+
+	m_archivedRowId = lastRowId;
+	if (!messages.isEmpty())
+		finishMessageArchival();
+
+	return lastRowId < maxRowId;
+}
+
+void Database::finishMessageArchival()
+{
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, "SELECT sourceRowId FROM " DB_ARCHIVE "." DB_TABLE_MESSAGES " WHERE sourceRowId IS NOT NULL");
+
+	QVector<qint64> rowIds;
+	while (query.next())
+		rowIds << query.value(0).toLongLong();
+
+	if (rowIds.isEmpty())
+		return;
+
+	transaction();
+	for (const auto rowId : qAsConst(rowIds)) {
+		Utils::execQuery(
+			query,
+			"INSERT INTO " DB_TABLE_MESSAGES_FTS " (" DB_TABLE_MESSAGES_FTS ", rowid, message) "
+			"SELECT 'delete', rowid, message FROM " DB_TABLE_MESSAGES " WHERE rowid = ?",
+			QVector<QVariant>() << rowId
+		);
+		Utils::execQuery(
+			query,
+			"DELETE FROM " DB_TABLE_MESSAGE_MEDIA " WHERE messageRowId = ?",
+			QVector<QVariant>() << rowId
+		);
+		Utils::execQuery(
+			query,
+			"DELETE FROM " DB_TABLE_MESSAGES " WHERE rowid = ?",
+			QVector<QVariant>() << rowId
+		);
+	}
+	commit();
+
+	transaction();
+	Utils::execQuery(query, "UPDATE " DB_ARCHIVE "." DB_TABLE_MESSAGES " SET sourceRowId = NULL WHERE sourceRowId IS NOT NULL");
+	commit();
+}
+
+bool Database::vacuumIncrementally()
+{
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, "PRAGMA freelist_count");
+	query.next();
+	const int freePageCount = query.value(0).toInt();
+	query.finish();
+
+	if (!freePageCount)
+		return false;
+
+	// Each execution returns only one page because the statement is only
+	// stepped once.
+	const int pageCount = std::min(freePageCount, VACUUM_STEP_PAGES);
+	transaction();
+	for (int i = 0; i < pageCount; i++)
+		Utils::execQuery(query, "PRAGMA incremental_vacuum");
+	query.finish();
+	commit();
+
+	return freePageCount > pageCount;
+}
+
+void Database::reportConversionProgress(qreal stepProgress)
+{
+	const int stepCount = DATABASE_LATEST_VERSION - m_conversionStartVersion;
+	emit conversionProgressChanged((m_version - m_conversionStartVersion + stepProgress) / stepCount);
 }
 
 void Database::createNewDatabase()
@@ -203,6 +749,8 @@ void Database::createNewDatabase()
 	createDbInfoTable();
 	createRosterTable();
 	createMessagesTable();
+	createMessageMediaTable();
+	createMessagesFtsTable();
 
 	m_version = DATABASE_LATEST_VERSION;
 }
@@ -214,7 +762,8 @@ void Database::createDbInfoTable()
 		query,
 		SQL_CREATE_TABLE(
 			DB_TABLE_INFO,
-			SQL_LAST_ATTRIBUTE(version, SQL_INTEGER_NOT_NULL)
+			SQL_ATTRIBUTE(version, SQL_INTEGER_NOT_NULL)
+			SQL_LAST_ATTRIBUTE(rosterVersion, SQL_TEXT)
 		)
 	);
 
@@ -244,7 +793,9 @@ void Database::createRosterTable()
 			SQL_ATTRIBUTE(name, SQL_TEXT)
 			SQL_ATTRIBUTE(lastExchanged, SQL_TEXT_NOT_NULL)
 			SQL_ATTRIBUTE(unreadMessages, SQL_INTEGER)
-			SQL_LAST_ATTRIBUTE(lastMessage, SQL_TEXT)
+			SQL_ATTRIBUTE(lastMessage, SQL_TEXT)
+			SQL_ATTRIBUTE(subscription, SQL_INTEGER)
+			"PRIMARY KEY(jid)"
 		)
 	);
 }
@@ -253,33 +804,23 @@ void Database::createMessagesTable()
 {
 	// TODO: the next time we change the messages table, we need to do:
 	//  * rename author to sender, edited to isEdited
-	//  * delete author_resource, recipient_resource
 	//  * remove 'NOT NULL' from id
-	//  * remove columns isSent, isDelivered
 
+	// The rowid is declared explicitly so that it is not changed by a VACUUM,
+	// because the full-text index and the media table refer to it.
 	QSqlQuery query(m_database);
 	Utils::execQuery(
 		query,
 		SQL_CREATE_TABLE(
 			DB_TABLE_MESSAGES,
+			SQL_ATTRIBUTE(rowid, SQL_INTEGER_PRIMARY_KEY)
 			SQL_ATTRIBUTE(author, SQL_TEXT_NOT_NULL)
-			SQL_ATTRIBUTE(author_resource, SQL_TEXT)
 			SQL_ATTRIBUTE(recipient, SQL_TEXT_NOT_NULL)
-			SQL_ATTRIBUTE(recipient_resource, SQL_TEXT)
-			SQL_ATTRIBUTE(timestamp, SQL_TEXT)
+			SQL_ATTRIBUTE(timestamp, SQL_INTEGER)
 			SQL_ATTRIBUTE(message, SQL_TEXT)
 			SQL_ATTRIBUTE(id, SQL_TEXT_NOT_NULL)
-			SQL_ATTRIBUTE(isSent, SQL_BOOL)
-			SQL_ATTRIBUTE(isDelivered, SQL_BOOL)
 			SQL_ATTRIBUTE(deliveryState, SQL_INTEGER)
 			SQL_ATTRIBUTE(type, SQL_INTEGER)
-			SQL_ATTRIBUTE(mediaUrl, SQL_TEXT)
-			SQL_ATTRIBUTE(mediaSize, SQL_INTEGER)
-			SQL_ATTRIBUTE(mediaContentType, SQL_TEXT)
-			SQL_ATTRIBUTE(mediaLastModified, SQL_INTEGER)
-			SQL_ATTRIBUTE(mediaLocation, SQL_TEXT)
-			SQL_ATTRIBUTE(mediaThumb, SQL_BLOB)
-			SQL_ATTRIBUTE(mediaHashes, SQL_TEXT)
 			SQL_ATTRIBUTE(edited, SQL_BOOL)
 			SQL_ATTRIBUTE(spoilerHint, SQL_TEXT)
 			SQL_ATTRIBUTE(isSpoiler, SQL_BOOL)
@@ -289,12 +830,76 @@ void Database::createMessagesTable()
 			"FOREIGN KEY(recipient) REFERENCES " DB_TABLE_ROSTER " (jid)"
 		)
 	);
+
+	// messages of a chat ordered by their timestamps
+	Utils::execQuery(
+		query,
+		SQL_CREATE_INDEX("idx_messages_chat", DB_TABLE_MESSAGES, "author, recipient, timestamp")
+	);
+	// updates and removals by message ID
+	Utils::execQuery(
+		query,
+		SQL_CREATE_INDEX("idx_messages_id", DB_TABLE_MESSAGES, "id")
+	);
+	// pending messages of the user ordered by their timestamps
+	Utils::execQuery(
+		query,
+		SQL_CREATE_INDEX("idx_messages_pending", DB_TABLE_MESSAGES, "author, deliveryState, timestamp")
+	);
+	// duplicates of messages received again
+	Utils::execQuery(query, SQL_CREATE_MESSAGES_UNIQUE_INDEX);
+}
+
+void Database::createMessageMediaTable()
+{
+	// Attributes of shared files. They are stored separately from the messages,
+	// so that pages of text messages stay small. Only messages with media have
+	// a row, which has the same rowid as the message.
+	QSqlQuery query(m_database);
+	Utils::execQuery(
+		query,
+		SQL_CREATE_TABLE(
+			DB_TABLE_MESSAGE_MEDIA,
+			SQL_ATTRIBUTE(messageRowId, SQL_INTEGER_PRIMARY_KEY)
+			SQL_ATTRIBUTE(mediaUrl, SQL_TEXT)
+			SQL_ATTRIBUTE(mediaSize, SQL_INTEGER)
+			SQL_ATTRIBUTE(mediaContentType, SQL_TEXT)
+			SQL_ATTRIBUTE(mediaLastModified, SQL_INTEGER)
+			SQL_ATTRIBUTE(mediaLocation, SQL_TEXT)
+			SQL_ATTRIBUTE(mediaThumb, SQL_BLOB)
+			SQL_LAST_ATTRIBUTE(mediaHashes, SQL_TEXT)
+		)
+	);
+}
+
+void Database::createMessagesFtsTable()
+{
+	// Full-text index of the message bodies. It does not store the bodies itself
+	// but refers to the rows of the messages table by their rowids. MessageDb has
+	// to keep it up to date on each change of a message body.
+	QSqlQuery query(m_database);
+	Utils::execQuery(
+		query,
+		"CREATE VIRTUAL TABLE '" DB_TABLE_MESSAGES_FTS "' USING fts5("
+			"message, content='" DB_TABLE_MESSAGES "', content_rowid='rowid'"
+		")"
+	);
 }
 
 void Database::convertDatabaseToV2()
 {
 	// create a new dbinfo table
-	createDbInfoTable();
+	// Its columns are those of v2 because later columns are added by their
+	// own conversion steps.
+	QSqlQuery query(m_database);
+	Utils::execQuery(
+		query,
+		SQL_CREATE_TABLE(
+			DB_TABLE_INFO,
+			SQL_LAST_ATTRIBUTE(version, SQL_INTEGER_NOT_NULL)
+		)
+	);
+	Utils::execQuery(query, "INSERT INTO " DB_TABLE_INFO " (version) VALUES (2)");
 	m_version = 2;
 }
 
@@ -331,9 +936,14 @@ void Database::convertDatabaseToV5()
 {
 	DATABASE_CONVERT_TO_VERSION(4);
 	QSqlQuery query(m_database);
-	Utils::execQuery(query, "ALTER TABLE Messages ADD type " SQL_INTEGER);
-	Utils::execQuery(query, "UPDATE Messages SET type = 0 WHERE type IS NULL");
-	Utils::execQuery(query, "ALTER TABLE Messages ADD mediaUrl " SQL_TEXT);
+	if (!isConversionStepStarted()) {
+		Utils::execQuery(query, "ALTER TABLE Messages ADD type " SQL_INTEGER);
+		Utils::execQuery(query, "ALTER TABLE Messages ADD mediaUrl " SQL_TEXT);
+	}
+	convertInChunks("Messages", {
+		"UPDATE Messages SET type = 0 "
+		"WHERE type IS NULL AND rowid > :firstRowId AND rowid <= :lastRowId"
+	});
 	m_version = 5;
 }
 
@@ -404,10 +1014,14 @@ void Database::convertDatabaseToV11()
 {
 	DATABASE_CONVERT_TO_VERSION(10);
 	QSqlQuery query(m_database);
-	Utils::execQuery(query, "ALTER TABLE Messages ADD deliveryState " SQL_INTEGER);
-	Utils::execQuery(query, "UPDATE Messages SET deliveryState = 2 WHERE isDelivered = 1");
-	Utils::execQuery(query, "UPDATE Messages SET deliveryState = 1 WHERE deliveryState IS NULL");
-	Utils::execQuery(query, "ALTER TABLE Messages ADD errorText " SQL_TEXT);
+	if (!isConversionStepStarted()) {
+		Utils::execQuery(query, "ALTER TABLE Messages ADD deliveryState " SQL_INTEGER);
+		Utils::execQuery(query, "ALTER TABLE Messages ADD errorText " SQL_TEXT);
+	}
+	convertInChunks("Messages", {
+		"UPDATE Messages SET deliveryState = CASE WHEN isDelivered = 1 THEN 2 ELSE 1 END "
+		"WHERE rowid > :firstRowId AND rowid <= :lastRowId"
+	});
 	m_version = 11;
 }
 
@@ -418,3 +1032,201 @@ void Database::convertDatabaseToV12()
 	Utils::execQuery(query, "ALTER TABLE Messages ADD replaceId " SQL_TEXT);
 	m_version = 12;
 }
+
+void Database::convertDatabaseToV13()
+{
+	DATABASE_CONVERT_TO_VERSION(12);
+	QSqlQuery query(m_database);
+
+	// SQLite cannot add a primary key to an existing table, so the roster is copied
+	// into a new table. Duplicate JIDs, which were possible before, are dropped.
+	Utils::execQuery(query, "CREATE TEMPORARY TABLE roster_backup(jid, name, lastExchanged, unreadMessages, lastMessage)");
+	Utils::execQuery(query, "INSERT INTO roster_backup SELECT jid, name, lastExchanged, unreadMessages, lastMessage FROM Roster");
+	Utils::execQuery(query, "DROP TABLE Roster");
+	Utils::execQuery(
+		query,
+		SQL_CREATE_TABLE(
+			"Roster",
+			SQL_ATTRIBUTE(jid, SQL_TEXT_NOT_NULL)
+			SQL_ATTRIBUTE(name, SQL_TEXT)
+			SQL_ATTRIBUTE(lastExchanged, SQL_TEXT_NOT_NULL)
+			SQL_ATTRIBUTE(unreadMessages, SQL_INTEGER)
+			SQL_ATTRIBUTE(lastMessage, SQL_TEXT)
+			"PRIMARY KEY(jid)"
+		)
+	);
+	Utils::execQuery(query, "INSERT OR IGNORE INTO Roster SELECT jid, name, lastExchanged, unreadMessages, lastMessage FROM roster_backup");
+	Utils::execQuery(query, "DROP TABLE roster_backup");
+
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_chat", "Messages", "author, recipient, timestamp"));
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_id", "Messages", "id"));
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_pending", "Messages", "author, deliveryState, timestamp"));
+	m_version = 13;
+}
+
+void Database::convertDatabaseToV14()
+{
+	DATABASE_CONVERT_TO_VERSION(13);
+	QSqlQuery query(m_database);
+
+	// The timestamps are converted from ISO 8601 strings to milliseconds since the
+	// epoch. SQLite cannot change the type of a column, so the messages are copied
+	// into a new table.
+	if (!isConversionStepStarted()) {
+		Utils::execQuery(
+			query,
+			SQL_CREATE_TABLE(
+				"Messages_new",
+				SQL_ATTRIBUTE(author, SQL_TEXT_NOT_NULL)
+				SQL_ATTRIBUTE(author_resource, SQL_TEXT)
+				SQL_ATTRIBUTE(recipient, SQL_TEXT_NOT_NULL)
+				SQL_ATTRIBUTE(recipient_resource, SQL_TEXT)
+				SQL_ATTRIBUTE(timestamp, SQL_INTEGER)
+				SQL_ATTRIBUTE(message, SQL_TEXT)
+				SQL_ATTRIBUTE(id, SQL_TEXT_NOT_NULL)
+				SQL_ATTRIBUTE(isSent, SQL_BOOL)
+				SQL_ATTRIBUTE(isDelivered, SQL_BOOL)
+				SQL_ATTRIBUTE(deliveryState, SQL_INTEGER)
+				SQL_ATTRIBUTE(type, SQL_INTEGER)
+				SQL_ATTRIBUTE(mediaUrl, SQL_TEXT)
+				SQL_ATTRIBUTE(mediaSize, SQL_INTEGER)
+				SQL_ATTRIBUTE(mediaContentType, SQL_TEXT)
+				SQL_ATTRIBUTE(mediaLastModified, SQL_INTEGER)
+				SQL_ATTRIBUTE(mediaLocation, SQL_TEXT)
+				SQL_ATTRIBUTE(mediaThumb, SQL_BLOB)
+				SQL_ATTRIBUTE(mediaHashes, SQL_TEXT)
+				SQL_ATTRIBUTE(edited, SQL_BOOL)
+				SQL_ATTRIBUTE(spoilerHint, SQL_TEXT)
+				SQL_ATTRIBUTE(isSpoiler, SQL_BOOL)
+				SQL_ATTRIBUTE(errorText, SQL_TEXT)
+				SQL_ATTRIBUTE(replaceId, SQL_TEXT)
+				"FOREIGN KEY(author) REFERENCES " DB_TABLE_ROSTER " (jid),"
+				"FOREIGN KEY(recipient) REFERENCES " DB_TABLE_ROSTER " (jid)"
+			)
+		);
+	}
+	convertInChunks("Messages", {
+		"INSERT INTO Messages_new (rowid, author, author_resource, recipient, recipient_resource, "
+		"timestamp, message, id, isSent, isDelivered, deliveryState, type, mediaUrl, mediaSize, "
+		"mediaContentType, mediaLastModified, mediaLocation, mediaThumb, mediaHashes, edited, "
+		"spoilerHint, isSpoiler, errorText, replaceId) "
+		"SELECT rowid, author, author_resource, recipient, recipient_resource, "
+		"CAST(ROUND((julianday(timestamp) - 2440587.5) * 86400000) AS INTEGER), "
+		"message, id, isSent, isDelivered, deliveryState, type, mediaUrl, mediaSize, "
+		"mediaContentType, mediaLastModified, mediaLocation, mediaThumb, mediaHashes, edited, "
+		"spoilerHint, isSpoiler, errorText, replaceId FROM Messages "
+		"WHERE rowid > :firstRowId AND rowid <= :lastRowId"
+	});
+	Utils::execQuery(query, "DROP TABLE Messages");
+	Utils::execQuery(query, "ALTER TABLE Messages_new RENAME TO Messages");
+
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_chat", "Messages", "author, recipient, timestamp"));
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_id", "Messages", "id"));
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_pending", "Messages", "author, deliveryState, timestamp"));
+	m_version = 14;
+}
+
+void Database::convertDatabaseToV15()
+{
+	DATABASE_CONVERT_TO_VERSION(14);
+	if (!isConversionStepStarted())
+		createMessagesFtsTable();
+	// same as a 'rebuild' of the index, but in chunks
+	convertInChunks("Messages", {
+		"INSERT INTO " DB_TABLE_MESSAGES_FTS " (rowid, message) "
+		"SELECT rowid, message FROM Messages WHERE rowid > :firstRowId AND rowid <= :lastRowId"
+	});
+	m_version = 15;
+}
+
+void Database::convertDatabaseToV16()
+{
+	DATABASE_CONVERT_TO_VERSION(15);
+	QSqlQuery query(m_database);
+
+	// The media attributes are moved into their own table and the unused columns
+	// are dropped. The rowids are kept, so the full-text index stays valid.
+	if (!isConversionStepStarted()) {
+		createMessageMediaTable();
+		Utils::execQuery(
+			query,
+			SQL_CREATE_TABLE(
+				"Messages_new",
+				SQL_ATTRIBUTE(rowid, SQL_INTEGER_PRIMARY_KEY)
+				SQL_ATTRIBUTE(author, SQL_TEXT_NOT_NULL)
+				SQL_ATTRIBUTE(recipient, SQL_TEXT_NOT_NULL)
+				SQL_ATTRIBUTE(timestamp, SQL_INTEGER)
+				SQL_ATTRIBUTE(message, SQL_TEXT)
+				SQL_ATTRIBUTE(id, SQL_TEXT_NOT_NULL)
+				SQL_ATTRIBUTE(deliveryState, SQL_INTEGER)
+				SQL_ATTRIBUTE(type, SQL_INTEGER)
+				SQL_ATTRIBUTE(edited, SQL_BOOL)
+				SQL_ATTRIBUTE(spoilerHint, SQL_TEXT)
+				SQL_ATTRIBUTE(isSpoiler, SQL_BOOL)
+				SQL_ATTRIBUTE(errorText, SQL_TEXT)
+				SQL_ATTRIBUTE(replaceId, SQL_TEXT)
+				"FOREIGN KEY(author) REFERENCES " DB_TABLE_ROSTER " (jid),"
+				"FOREIGN KEY(recipient) REFERENCES " DB_TABLE_ROSTER " (jid)"
+			)
+		);
+	}
+	convertInChunks("Messages", {
+		"INSERT INTO " DB_TABLE_MESSAGE_MEDIA " (messageRowId, mediaUrl, mediaSize, "
+		"mediaContentType, mediaLastModified, mediaLocation, mediaThumb, mediaHashes) "
+		"SELECT rowid, mediaUrl, mediaSize, mediaContentType, mediaLastModified, "
+		"mediaLocation, mediaThumb, mediaHashes FROM Messages "
+		"WHERE rowid > :firstRowId AND rowid <= :lastRowId AND "
+		"(ifnull(type, 0) != 0 OR ifnull(mediaUrl, '') != '' OR ifnull(mediaLocation, '') != '')",
+		"INSERT INTO Messages_new (rowid, author, recipient, timestamp, message, id, "
+		"deliveryState, type, edited, spoilerHint, isSpoiler, errorText, replaceId) "
+		"SELECT rowid, author, recipient, timestamp, message, id, "
+		"deliveryState, type, edited, spoilerHint, isSpoiler, errorText, replaceId "
+		"FROM Messages WHERE rowid > :firstRowId AND rowid <= :lastRowId"
+	});
+	Utils::execQuery(query, "DROP TABLE Messages");
+	Utils::execQuery(query, "ALTER TABLE Messages_new RENAME TO Messages");
+
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_chat", "Messages", "author, recipient, timestamp"));
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_id", "Messages", "id"));
+	Utils::execQuery(query, SQL_CREATE_INDEX("idx_messages_pending", "Messages", "author, deliveryState, timestamp"));
+	m_version = 16;
+}
+
+void Database::convertDatabaseToV17()
+{
+	DATABASE_CONVERT_TO_VERSION(16);
+
+	// Only the first of the messages with the same sender, recipient and ID is
+	// kept.
+#define DUPLICATE_MESSAGE_CONDITION \
+	"m.rowid > :firstRowId AND m.rowid <= :lastRowId AND m.id != ' ' AND EXISTS (" \
+		"SELECT 1 FROM Messages o WHERE o.id = m.id AND o.author = m.author AND " \
+		"o.recipient = m.recipient AND o.rowid < m.rowid" \
+	")"
+	convertInChunks("Messages", {
+		"INSERT INTO " DB_TABLE_MESSAGES_FTS " (" DB_TABLE_MESSAGES_FTS ", rowid, message) "
+		"SELECT 'delete', m.rowid, m.message FROM Messages m WHERE " DUPLICATE_MESSAGE_CONDITION,
+		"DELETE FROM " DB_TABLE_MESSAGE_MEDIA " WHERE messageRowId IN ("
+			"SELECT m.rowid FROM Messages m WHERE " DUPLICATE_MESSAGE_CONDITION
+		")",
+		"DELETE FROM Messages WHERE rowid IN ("
+			"SELECT m.rowid FROM Messages m WHERE " DUPLICATE_MESSAGE_CONDITION
+		")"
+	});
+#undef DUPLICATE_MESSAGE_CONDITION
+
+	QSqlQuery query(m_database);
+	Utils::execQuery(query, SQL_CREATE_MESSAGES_UNIQUE_INDEX);
+	m_version = 17;
+}
+
+void Database::convertDatabaseToV18()
+{
+	DATABASE_CONVERT_TO_VERSION(17);
+	QSqlQuery query(m_database);
+	// Without a roster version, the whole roster is requested once more and
+	// the subscriptions of the items are stored then.
+	Utils::execQuery(query, "ALTER TABLE " DB_TABLE_INFO " ADD rosterVersion " SQL_TEXT);
+	Utils::execQuery(query, "ALTER TABLE Roster ADD subscription " SQL_INTEGER);
+	m_version = 18;
+}
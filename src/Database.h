@@ -30,10 +30,16 @@
 
 #pragma once
 
+#include <atomic>
+#include <functional>
+
 #include <QObject>
 #include <QSqlDatabase>
+#include <QStringList>
 
 class QSqlQuery;
+class QThread;
+class QTimer;
 
 /**
  * The Database class manages the SQL database. It opens the database and converts old
@@ -50,9 +56,37 @@ public:
 	/**
 	 * Opens the database for reading and writing and guarantees the database to be
 	 * up-to-date.
+	 *
+	 * Afterwards, the read-only connection is opened on its own thread.
 	 */
 	void openDatabase();
 
+	/**
+	 * Stops the thread of the read-only connection and closes the connection.
+	 *
+	 * Reads that are still waiting for a batch to be committed are not run
+	 * anymore.
+	 */
+	void stopReading();
+
+	/**
+	 * Commits the pending writes and closes the database after the reads have
+	 * been stopped.
+	 *
+	 * This must be called on the thread of the database. It is called by the
+	 * destructor if the database is still open.
+	 */
+	void closeDatabase();
+
+	/**
+	 * Returns an object that lives in the thread of the read-only connection.
+	 *
+	 * It can be used as the context of signal connections to run reads on that
+	 * thread. The read-only connection is opened before any events of the thread
+	 * are processed.
+	 */
+	QObject *readContext() const;
+
 	/**
 	 * Begins a transaction if none has been started.
 	 */
@@ -63,7 +97,83 @@ public:
 	 */
 	void commit();
 
+	/**
+	 * Adds the following write to the current batch of writes or starts a new
+	 * batch.
+	 *
+	 * All writes of a batch are done in one transaction. It is committed after a
+	 * short delay or as soon as the batch is full, so that a burst of writes
+	 * costs only one sync to the disk. The writes are visible to all reads on
+	 * this connection before they are committed.
+	 */
+	void batchWrite();
+
+	/**
+	 * Commits the current batch of writes, if there is one.
+	 */
+	void commitBatch();
+
+	/**
+	 * Runs a read as soon as the current batch of writes is visible to the
+	 * read-only connection.
+	 *
+	 * If there is no batch, the read is run immediately. Otherwise, the batch is
+	 * committed on the thread of the database and the read is run afterwards,
+	 * without blocking the thread of the read-only connection in the meantime.
+	 * The reads are run in the order of the calls.
+	 *
+	 * This must be called on the thread of the read-only connection.
+	 *
+	 * @param read function reading from the read-only connection
+	 */
+	void readAfterBatch(const std::function<void()> &read);
+
+	/**
+	 * Sets the age after which messages are moved into the archive database by
+	 * the maintenance.
+	 *
+	 * Archived messages are not loaded into chats anymore but can still be found
+	 * by the full-text search. Their bodies are stored compressed.
+	 *
+	 * @param days age in days or 0 for keeping all messages in the main database
+	 */
+	void setMessageArchiveAge(int days);
+
+signals:
+	/**
+	 * Emitted while the database is converted to the latest version by
+	 * openDatabase().
+	 *
+	 * @param progress fraction of the conversion that is done, 1 when the
+	 * database is up-to-date
+	 */
+	void conversionProgressChanged(qreal progress);
+
 private:
+	/**
+	 * Tasks of the maintenance in the order they are run
+	 */
+	enum class MaintenanceTask {
+		ArchiveMessages,
+		Vacuum,
+		Optimize,
+	};
+
+	/**
+	 * Attaches the archive database to a connection as the schema @c archive.
+	 */
+	static void attachArchive(const QSqlDatabase &database);
+
+	/**
+	 * Opens the read-only connection on the current thread.
+	 */
+	static void openReadConnection(const QString &fileName);
+
+	/**
+	 * Closes the read-only connection on the current thread.
+	 */
+	static void closeReadConnection();
+
 	/**
 	 * @return true if the database has to be converted using @c convertDatabase()
 	 * because the database is not up-to-date.
@@ -75,6 +185,94 @@ private:
 	 */
 	void convertDatabase();
 
+	/**
+	 * Saves the new version after a step of the conversion and commits the step.
+	 */
+	void finishConversionStep();
+
+	/**
+	 * Returns whether the current step of the conversion has been interrupted
+	 * after its first chunk was converted by convertInChunks().
+	 *
+	 * In that case, the preparations of the step (e.g., creating new tables) are
+	 * already done and must not be repeated.
+	 */
+	bool isConversionStepStarted();
+
+	/**
+	 * Returns the rowid of the last row converted by convertInChunks() in the
+	 * current step or -1 if the step has not been started.
+	 */
+	qint64 loadConversionStepProgress();
+
+	/**
+	 * Runs statements for all rows of a table in chunks of rows, each of them in
+	 * its own transaction, and continues after the last converted chunk if the
+	 * step has been interrupted.
+	 *
+	 * This must only be called once per step.
+	 *
+	 * @param tableName table whose rows are converted
+	 * @param statements statements converting the rows with rowids in the range
+	 * from :firstRowId (exclusive) to :lastRowId (inclusive)
+	 */
+	void convertInChunks(const QString &tableName, const QStringList &statements);
+
+	/**
+	 * Switches an existing database to incremental vacuuming if it is not used
+	 * yet.
+	 *
+	 * That needs a full VACUUM and is only done once.
+	 */
+	void enableIncrementalVacuum();
+
+	/**
+	 * Creates the tables of the archive database if they do not exist.
+	 */
+	void createArchiveTables();
+
+	/**
+	 * Runs one short step of the current maintenance task and schedules the next
+	 * one.
+	 *
+	 * Each step holds the write lock only for a few milliseconds, so that the
+	 * maintenance does not delay other writes noticeably.
+	 */
+	void runMaintenanceStep();
+
+	/**
+	 * Copies the messages of the next range of rowids that are older than the
+	 * archive age into the archive database and removes them from the main
+	 * database.
+	 *
+	 * @return whether there are more messages to check
+	 */
+	bool archiveMessages();
+
+	/**
+	 * Removes the messages that have been copied into the archive database from
+	 * the main database.
+	 *
+	 * This is done in its own transaction after copying them because
+	 * transactions are not atomic across attached databases in WAL mode.
+	 * Therefore, it is also done on start in case the removal was interrupted.
+	 */
+	void finishMessageArchival();
+
+	/**
+	 * Returns a few free pages to the file system.
+	 *
+	 * @return whether there are more free pages
+	 */
+	bool vacuumIncrementally();
+
+	/**
+	 * Emits the progress of the whole conversion.
+	 *
+	 * @param stepProgress fraction of the current step that is done
+	 */
+	void reportConversionProgress(qreal stepProgress);
+
 	/**
 	 * Loads the database information and detects the database version.
 	 */
@@ -91,6 +289,8 @@ private:
 	void createDbInfoTable();
 	void createRosterTable();
 	void createMessagesTable();
+	void createMessageMediaTable();
+	void createMessagesFtsTable();
 
 	/**
 	 * Creates a new database without content.
@@ -111,6 +311,12 @@ private:
 	void convertDatabaseToV10();
 	void convertDatabaseToV11();
 	void convertDatabaseToV12();
+	void convertDatabaseToV13();
+	void convertDatabaseToV14();
+	void convertDatabaseToV15();
+	void convertDatabaseToV16();
+	void convertDatabaseToV17();
+	void convertDatabaseToV18();
 
 	QSqlDatabase m_database;
 
@@ -122,5 +328,23 @@ private:
 	 */
 	int m_version = -1;
 
+	// version of the database before the conversion
+	int m_conversionStartVersion = -1;
+
 	int m_transactions = 0;
+
+	QTimer *m_batchTimer;
+	std::atomic_int m_batchedWrites { 0 };
+
+	QTimer *m_maintenanceTimer;
+	MaintenanceTask m_maintenanceTask = MaintenanceTask::ArchiveMessages;
+	int m_messageArchiveAge = 0;
+	// last rowid checked by archiveMessages()
+	qint64 m_archivedRowId = 0;
+
+	QThread *m_readThread;
+	QObject *m_readContext;
+	// number of reads waiting for a batch to be committed, only used by the
+	// thread of the read-only connection
+	int m_deferredReads = 0;
 };
@@ -76,9 +76,9 @@ void DownloadManager::startDownload(const QString &msgId, const QString &url)
 
 	connect(dl, &DownloadJob::finished, this, [=]() {
 		const QString &mediaLocation = dl->downloadLocation();
-		emit m_model->updateMessageRequested(msgId, [=] (Message &msg) {
-			msg.setMediaLocation(mediaLocation);
-		});
+		MessagePatch patch;
+		patch.mediaLocation = mediaLocation;
+		emit m_model->patchMessageRequested(msgId, patch);
 
 		abortDownload(msgId);
 	});
@@ -44,6 +44,7 @@
 #define KAIDAN_SETTINGS_NOTIFICATIONS_MUTED "muted/"
 #define KAIDAN_SETTINGS_FAVORITE_EMOJIS "emojis/favorites"
 #define KAIDAN_SETTINGS_WINDOW_SIZE "window/size"
+#define KAIDAN_SETTINGS_HISTORY_ARCHIVE_AGE "history/archiveAge"
 
 #define KAIDAN_JID_RESOURCE_DEFAULT_PREFIX APPLICATION_DISPLAY_NAME
 
@@ -58,11 +59,18 @@ constexpr auto MESSAGE_MAX_CHARS = 1e4;
 
 // SQL
 #define DB_CONNECTION "kaidan-messages"
+#define DB_CONNECTION_READ "kaidan-messages-read"
 #define DB_FILENAME "messages.sqlite3"
+#define DB_ARCHIVE "archive"
+#define DB_ARCHIVE_FILENAME "messages-archive.sqlite3"
 #define DB_MSG_QUERY_LIMIT 20
+#define DB_SEARCH_RESULTS_LIMIT 200
 #define DB_TABLE_INFO "dbinfo"
+#define DB_TABLE_CONVERSION "dbconversion"
 #define DB_TABLE_ROSTER "Roster"
 #define DB_TABLE_MESSAGES "Messages"
+#define DB_TABLE_MESSAGES_FTS "MessagesFts"
+#define DB_TABLE_MESSAGE_MEDIA "MessageMedia"
 
 //
 // Credential generation
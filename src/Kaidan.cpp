@@ -38,6 +38,7 @@
 // QXmpp
 #include "qxmpp-exts/QXmppUri.h"
 // Kaidan
+#include "AccountManager.h"
 #include "AvatarFileStorage.h"
 #include "CredentialsValidator.h"
 #include "Database.h"
@@ -69,7 +70,15 @@ Kaidan::Kaidan(QGuiApplication *app, bool enableLogging, QObject *parent)
 Kaidan::~Kaidan()
 {
 	delete m_caches;
+
+	// The reads are stopped first, then the database is closed on its own
+	// thread, which has to be stopped before the database can be deleted.
+	m_database->stopReading();
+	QMetaObject::invokeMethod(m_database, &Database::closeDatabase, Qt::BlockingQueuedConnection);
+	m_dbThrd->quit();
+	m_dbThrd->wait();
 	delete m_database;
+	delete m_dbThrd;
 	s_instance = nullptr;
 }
 
@@ -207,12 +216,30 @@ void Kaidan::initializeDatabase()
 	m_database = new Database();
 	m_database->moveToThread(m_dbThrd);
 
-	m_msgDb = new MessageDb();
+	m_msgDb = new MessageDb(m_database);
 	m_msgDb->moveToThread(m_dbThrd);
 
 	m_rosterDb = new RosterDb(m_database);
 	m_rosterDb->moveToThread(m_dbThrd);
 
+	connect(m_database, &Database::conversionProgressChanged, this, [this](qreal progress) {
+		m_databaseConversionProgress = progress;
+		emit databaseConversionProgressChanged();
+	});
+
+	connect(m_msgDb, &MessageDb::messagesExported, this, [this](const QString &, int count) {
+		if (count < 0)
+			emit passiveNotificationRequested(tr("The messages could not be exported."));
+		else
+			emit passiveNotificationRequested(tr("%n message(s) exported.", nullptr, count));
+	});
+	connect(m_msgDb, &MessageDb::messagesImported, this, [this](const QString &, int count) {
+		if (count < 0)
+			emit passiveNotificationRequested(tr("The messages could not be imported."));
+		else
+			emit passiveNotificationRequested(tr("%n message(s) imported.", nullptr, count));
+	});
+
 	connect(m_dbThrd, &QThread::started, m_database, &Database::openDatabase);
 	m_dbThrd->start();
 }
@@ -224,6 +251,13 @@ void Kaidan::initializeCaches()
 	// Connect the avatar changed signal of the avatarStorage with the NOTIFY signal
 	// of the Q_PROPERTY for the avatar storage (so all avatars are updated in QML)
 	connect(m_caches->avatarStorage, &AvatarFileStorage::avatarIdsChanged, this, &Kaidan::avatarStorageChanged);
+
+	// Messages older than the configured number of days are moved to the
+	// archive by the database maintenance. 0 disables the archival.
+	const int archiveAge = m_caches->settings->value(KAIDAN_SETTINGS_HISTORY_ARCHIVE_AGE, 0).toInt();
+	QMetaObject::invokeMethod(m_database, [this, archiveAge]() {
+		m_database->setMessageArchiveAge(archiveAge);
+	});
 }
 
 void Kaidan::initializeClientWorker(bool enableLogging)
@@ -252,6 +286,21 @@ ClientWorker *Kaidan::client() const
 	return m_client;
 }
 
+void Kaidan::exportMessageHistory(const QUrl &fileUrl, const QString &chatJid)
+{
+	const QString fileName = fileUrl.toLocalFile();
+	const auto format = fileName.endsWith(QStringLiteral(".xml"), Qt::CaseInsensitive)
+		? MessageDb::HistoryFormat::Xml
+		: MessageDb::HistoryFormat::Json;
+
+	emit m_msgDb->exportMessagesRequested(fileName, AccountManager::instance()->jid(), chatJid, format);
+}
+
+void Kaidan::importMessageHistory(const QUrl &fileUrl)
+{
+	emit m_msgDb->importMessagesRequested(fileUrl.toLocalFile());
+}
+
 RosterDb *Kaidan::rosterDb() const
 {
 	return m_rosterDb;
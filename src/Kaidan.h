@@ -66,6 +66,7 @@ class Kaidan : public QObject
 	Q_PROPERTY(quint8 connectionState READ connectionState NOTIFY connectionStateChanged)
 	Q_PROPERTY(quint8 connectionError READ connectionError NOTIFY connectionErrorChanged)
 	Q_PROPERTY(PasswordVisibility passwordVisibility READ passwordVisibility WRITE setPasswordVisibility NOTIFY passwordVisibilityChanged)
+	Q_PROPERTY(qreal databaseConversionProgress READ databaseConversionProgress NOTIFY databaseConversionProgressChanged)
 
 public:
 	/**
@@ -148,6 +149,17 @@ public:
 	 */
 	PasswordVisibility passwordVisibility() const;
 
+	/**
+	 * Returns the fraction of the conversion of an old database that is done.
+	 *
+	 * It is 1 if the database does not need to be converted or if the conversion
+	 * is finished.
+	 */
+	qreal databaseConversionProgress() const
+	{
+		return m_databaseConversionProgress;
+	}
+
 	RosterModel* rosterModel() const
 	{
 		return m_caches->rosterModel;
@@ -218,6 +230,24 @@ public:
 	 */
 	Q_INVOKABLE quint8 logInByUri(const QString &uri);
 
+	/**
+	 * Exports the messages of one chat or of all chats into a file.
+	 *
+	 * Files ending with ".xml" are written in the format of XEP-0227: Portable
+	 * Import/Export Format, all other files with one JSON object per message.
+	 *
+	 * @param fileUrl URL of the file to be created
+	 * @param chatJid JID of the chat partner or an empty string for all chats
+	 */
+	Q_INVOKABLE void exportMessageHistory(const QUrl &fileUrl, const QString &chatJid = {});
+
+	/**
+	 * Imports the messages of a file created by exportMessageHistory().
+	 *
+	 * @param fileUrl URL of the file to be imported
+	 */
+	Q_INVOKABLE void importMessageHistory(const QUrl &fileUrl);
+
 signals:
 	/**
 	 * Emitted when the application window becomes active or inactive.
@@ -268,6 +298,11 @@ signals:
 
 	void avatarStorageChanged();
 
+	/**
+	 * Emitted when the progress of the database conversion has changed.
+	 */
+	void databaseConversionProgressChanged();
+
 	/**
 	 * Emitted, when the client's connection state has changed (e.g. when
 	 * successfully connected or when disconnected)
@@ -512,6 +547,7 @@ private:
 	QString m_openUriCache;
 	ConnectionState m_connectionState = ConnectionState::StateDisconnected;
 	ClientWorker::ConnectionError m_connectionError = ClientWorker::NoError;
+	qreal m_databaseConversionProgress = 1;
 
 	static Kaidan *s_instance;
 };
@@ -113,6 +113,16 @@ bool Message::operator!=(const Message &m) const
 	return !operator==(m);
 }
 
+qint64 Message::rowId() const
+{
+	return m_rowId;
+}
+
+void Message::setRowId(qint64 rowId)
+{
+	m_rowId = rowId;
+}
+
 MessageType Message::mediaType() const
 {
 	return m_mediaType;
@@ -58,6 +58,9 @@ public:
 	bool operator==(const Message &m) const;
 	bool operator!=(const Message &m) const;
 
+	qint64 rowId() const;
+	void setRowId(qint64 rowId);
+
 	MessageType mediaType() const;
 	void setMediaType(MessageType mediaType);
 
@@ -92,6 +95,15 @@ public:
 	QString previewText() const;
 
 private:
+	/**
+	 * SQLite rowid of the message or 0 if the message has not been loaded from
+	 * the database.
+	 *
+	 * It is only used as a tie-breaker for messages with equal timestamps when
+	 * paging through the history and is therefore not compared.
+	 */
+	qint64 m_rowId = 0;
+
 	/**
 	 * Media type of the message, e.g. a text or image.
 	 */
@@ -30,29 +30,274 @@
 
 #include "MessageDb.h"
 
+// std
+#include <algorithm>
+#include <limits>
 // Qt
+#include <QFile>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QSqlDatabase>
 #include <QSqlDriver>
 #include <QSqlField>
 #include <QSqlQuery>
 #include <QSqlRecord>
+#include <QUrl>
+#include <QRegularExpression>
+#include <QXmlStreamReader>
+#include <QXmlStreamWriter>
+// QXmpp
+#include <QXmppUtils.h>
 // Kaidan
+#include "Database.h"
 #include "Globals.h"
+#include "MediaUtils.h"
 #include "Utils.h"
 
+// Columns of a message including its media attributes, except for the thumbnail
+// and the hashes, which are not used yet
+#define MESSAGE_COLUMNS \
+	"m.rowid, m.author, m.recipient, m.timestamp, m.message, m.id, m.deliveryState, " \
+	"m.type, m.edited, m.spoilerHint, m.isSpoiler, m.errorText, m.replaceId, " \
+	"mm.mediaUrl, mm.mediaSize, mm.mediaContentType, mm.mediaLastModified, mm.mediaLocation"
+
+// Messages joined with their media attributes. Only messages with media have an
+// entry in the media table, so the join does not read any pages of it for text
+// messages except for the lookup in its primary key.
+#define MESSAGES_WITH_MEDIA \
+	DB_TABLE_MESSAGES " m LEFT JOIN " DB_TABLE_MESSAGE_MEDIA " mm ON mm.messageRowId = m.rowid"
+
+// number of characters of the body used as the snippet of archived messages
+constexpr int ARCHIVE_SNIPPET_LENGTH = 80;
+
+// number of imported messages written in one transaction
+constexpr int IMPORT_BATCH_SIZE = 1000;
+
+// number of search results emitted at once
+constexpr int SEARCH_RESULT_BATCH_SIZE = 20;
+
+#define NS_PIE "urn:xmpp:pie:0"
+#define NS_PIE_MAM "urn:xmpp:pie:0#mam"
+#define NS_MAM "urn:xmpp:mam:2"
+#define NS_FORWARD "urn:xmpp:forward:0"
+#define NS_DELAY "urn:xmpp:delay"
+#define NS_CLIENT "jabber:client"
+#define NS_SPOILER "urn:xmpp:spoiler:0"
+#define NS_MESSAGE_CORRECT "urn:xmpp:message-correct:0"
+#define NS_OOB "jabber:x:oob"
+
+/**
+ * Creates a JSON object with the stored attributes of a message. Attributes
+ * with default values are left out.
+ */
+static QJsonObject messageToJson(const Message &msg)
+{
+	QJsonObject object = {
+		{ QStringLiteral("id"), msg.id() },
+		{ QStringLiteral("from"), msg.from() },
+		{ QStringLiteral("to"), msg.to() },
+		{ QStringLiteral("stamp"), msg.stamp().toUTC().toString(Qt::ISODateWithMs) },
+		{ QStringLiteral("deliveryState"), int(msg.deliveryState()) },
+		{ QStringLiteral("mediaType"), int(msg.mediaType()) },
+	};
+
+	const auto insertIfSet = [&object](const QString &key, const QString &value) {
+		if (!value.isEmpty())
+			object.insert(key, value);
+	};
+	insertIfSet(QStringLiteral("body"), msg.body());
+	insertIfSet(QStringLiteral("spoilerHint"), msg.spoilerHint());
+	insertIfSet(QStringLiteral("errorText"), msg.errorText());
+	insertIfSet(QStringLiteral("replaceId"), msg.replaceId());
+	insertIfSet(QStringLiteral("outOfBandUrl"), msg.outOfBandUrl());
+	insertIfSet(QStringLiteral("mediaContentType"), msg.mediaContentType());
+	insertIfSet(QStringLiteral("mediaLocation"), msg.mediaLocation());
+
+	if (msg.isEdited())
+		object.insert(QStringLiteral("edited"), true);
+	if (msg.isSpoiler())
+		object.insert(QStringLiteral("isSpoiler"), true);
+	if (msg.mediaSize())
+		object.insert(QStringLiteral("mediaSize"), msg.mediaSize());
+	if (msg.mediaLastModified().isValid() && msg.mediaLastModified().toMSecsSinceEpoch())
+		object.insert(QStringLiteral("mediaLastModified"), msg.mediaLastModified().toUTC().toString(Qt::ISODateWithMs));
+
+	return object;
+}
+
+/**
+ * Creates a message from a JSON object created by messageToJson().
+ */
+static Message messageFromJson(const QJsonObject &object)
+{
+	Message msg;
+	msg.setId(object.value(QStringLiteral("id")).toString());
+	msg.setFrom(object.value(QStringLiteral("from")).toString());
+	msg.setTo(object.value(QStringLiteral("to")).toString());
+	msg.setStamp(QDateTime::fromString(object.value(QStringLiteral("stamp")).toString(), Qt::ISODateWithMs));
+	msg.setDeliveryState(Enums::DeliveryState(object.value(QStringLiteral("deliveryState")).toInt(int(Enums::DeliveryState::Delivered))));
+	msg.setMediaType(MessageType(object.value(QStringLiteral("mediaType")).toInt(int(MessageType::MessageText))));
+	msg.setBody(object.value(QStringLiteral("body")).toString());
+	msg.setSpoilerHint(object.value(QStringLiteral("spoilerHint")).toString());
+	msg.setErrorText(object.value(QStringLiteral("errorText")).toString());
+	msg.setReplaceId(object.value(QStringLiteral("replaceId")).toString());
+	msg.setOutOfBandUrl(object.value(QStringLiteral("outOfBandUrl")).toString());
+	msg.setMediaContentType(object.value(QStringLiteral("mediaContentType")).toString());
+	msg.setMediaLocation(object.value(QStringLiteral("mediaLocation")).toString());
+	msg.setIsEdited(object.value(QStringLiteral("edited")).toBool());
+	msg.setIsSpoiler(object.value(QStringLiteral("isSpoiler")).toBool());
+	msg.setMediaSize(qint64(object.value(QStringLiteral("mediaSize")).toDouble()));
+	if (object.contains(QStringLiteral("mediaLastModified")))
+		msg.setMediaLastModified(QDateTime::fromString(object.value(QStringLiteral("mediaLastModified")).toString(), Qt::ISODateWithMs));
+	return msg;
+}
+
+/**
+ * Writes a message as a result of the message archive of XEP-0227.
+ *
+ * Only the attributes that are part of the stanza are written.
+ */
+static void writeMessageXml(QXmlStreamWriter &writer, const Message &msg)
+{
+	writer.writeStartElement(QStringLiteral("result"));
+	writer.writeDefaultNamespace(QStringLiteral(NS_MAM));
+	writer.writeAttribute(QStringLiteral("id"), QString::number(msg.rowId()));
+
+	writer.writeStartElement(QStringLiteral("forwarded"));
+	writer.writeDefaultNamespace(QStringLiteral(NS_FORWARD));
+
+	writer.writeStartElement(QStringLiteral("delay"));
+	writer.writeDefaultNamespace(QStringLiteral(NS_DELAY));
+	writer.writeAttribute(QStringLiteral("stamp"), msg.stamp().toUTC().toString(Qt::ISODateWithMs));
+	writer.writeEndElement();
+
+	writer.writeStartElement(QStringLiteral("message"));
+	writer.writeDefaultNamespace(QStringLiteral(NS_CLIENT));
+	writer.writeAttribute(QStringLiteral("from"), msg.from());
+	writer.writeAttribute(QStringLiteral("to"), msg.to());
+	writer.writeAttribute(QStringLiteral("id"), msg.id());
+	writer.writeAttribute(QStringLiteral("type"), QStringLiteral("chat"));
+
+	if (!msg.body().isEmpty())
+		writer.writeTextElement(QStringLiteral("body"), msg.body());
+
+	if (msg.isSpoiler()) {
+		writer.writeStartElement(QStringLiteral("spoiler"));
+		writer.writeDefaultNamespace(QStringLiteral(NS_SPOILER));
+		writer.writeCharacters(msg.spoilerHint());
+		writer.writeEndElement();
+	}
+
+	if (!msg.replaceId().isEmpty()) {
+		writer.writeStartElement(QStringLiteral("replace"));
+		writer.writeDefaultNamespace(QStringLiteral(NS_MESSAGE_CORRECT));
+		writer.writeAttribute(QStringLiteral("id"), msg.replaceId());
+		writer.writeEndElement();
+	}
+
+	if (!msg.outOfBandUrl().isEmpty()) {
+		writer.writeStartElement(QStringLiteral("x"));
+		writer.writeDefaultNamespace(QStringLiteral(NS_OOB));
+		writer.writeTextElement(QStringLiteral("url"), msg.outOfBandUrl());
+		writer.writeEndElement();
+	}
+
+	writer.writeEndElement(); // message
+	writer.writeEndElement(); // forwarded
+	writer.writeEndElement(); // result
+}
+
+/**
+ * Reads a message element whose start element is the current token of the
+ * reader.
+ *
+ * @param stamp time of the delay element of the enclosing forwarded element
+ */
+static Message readMessageXml(QXmlStreamReader &reader, const QDateTime &stamp)
+{
+	Message msg;
+	const auto attributes = reader.attributes();
+	msg.setFrom(QXmppUtils::jidToBareJid(attributes.value(QStringLiteral("from")).toString()));
+	msg.setTo(QXmppUtils::jidToBareJid(attributes.value(QStringLiteral("to")).toString()));
+	msg.setId(attributes.value(QStringLiteral("id")).toString());
+	msg.setStamp(stamp);
+
+	while (reader.readNextStartElement()) {
+		const auto name = reader.name();
+		const auto namespaceUri = reader.namespaceUri();
+
+		if (name == QStringLiteral("body") && namespaceUri == QStringLiteral(NS_CLIENT)) {
+			msg.setBody(reader.readElementText());
+		} else if (name == QStringLiteral("spoiler") && namespaceUri == QStringLiteral(NS_SPOILER)) {
+			msg.setIsSpoiler(true);
+			msg.setSpoilerHint(reader.readElementText());
+		} else if (name == QStringLiteral("replace") && namespaceUri == QStringLiteral(NS_MESSAGE_CORRECT)) {
+			msg.setReplaceId(reader.attributes().value(QStringLiteral("id")).toString());
+			msg.setIsEdited(true);
+			reader.skipCurrentElement();
+		} else if (name == QStringLiteral("delay") && namespaceUri == QStringLiteral(NS_DELAY)) {
+			msg.setStamp(QDateTime::fromString(reader.attributes().value(QStringLiteral("stamp")).toString(), Qt::ISODateWithMs));
+			reader.skipCurrentElement();
+		} else if (name == QStringLiteral("x") && namespaceUri == QStringLiteral(NS_OOB)) {
+			while (reader.readNextStartElement()) {
+				if (reader.name() == QStringLiteral("url"))
+					msg.setOutOfBandUrl(reader.readElementText());
+				else
+					reader.skipCurrentElement();
+			}
+		} else {
+			reader.skipCurrentElement();
+		}
+	}
+
+	// The media type is not part of the stanza and detected like for received
+	// messages.
+	if (!msg.outOfBandUrl().isEmpty()) {
+		const QMimeType mimeType = MediaUtils::mimeType(QUrl(msg.outOfBandUrl()));
+		msg.setMediaType(MediaUtils::messageType(mimeType));
+		msg.setMediaContentType(mimeType.name());
+	}
+
+	return msg;
+}
+
 MessageDb *MessageDb::s_instance = nullptr;
 
-MessageDb::MessageDb(QObject *parent)
-        : QObject(parent)
+MessageDb::MessageDb(Database *db, QObject *parent)
+        : QObject(parent),
+          m_db(db)
 {
 	Q_ASSERT(!MessageDb::s_instance);
 	s_instance = this;
 
-	connect(this, &MessageDb::fetchMessagesRequested,
-	        this, &MessageDb::fetchMessages);
+	// Messages for the user interface are fetched by the read-only connection, so
+	// that they do not have to wait for writes.
+	connect(this, &MessageDb::fetchMessagesRequested, db->readContext(),
+	        [this](int requestId, const QString &user1, const QString &user2, const QDateTime &stamp, qint64 rowId, MessageDb::FetchDirection direction, int limit) {
+		m_db->readAfterBatch([=]() {
+			fetchMessages(requestId, user1, user2, stamp, rowId, direction, limit);
+		});
+	});
 
 	connect(this, &MessageDb::fetchPendingMessagesRequested,
 	        this, &MessageDb::fetchPendingMessages);
+
+	connect(this, &MessageDb::searchMessagesRequested, db->readContext(),
+	        [this](int requestId, const QString &accountJid, const QString &chatJid, const QString &searchText) {
+		m_db->readAfterBatch([=]() {
+			searchMessages(requestId, accountJid, chatJid, searchText);
+		});
+	});
+
+	connect(this, &MessageDb::exportMessagesRequested, db->readContext(),
+	        [this](const QString &fileName, const QString &accountJid, const QString &chatJid, MessageDb::HistoryFormat format) {
+		m_db->readAfterBatch([=]() {
+			exportMessages(fileName, accountJid, chatJid, format);
+		});
+	});
+
+	connect(this, &MessageDb::importMessagesRequested,
+	        this, &MessageDb::importMessages);
 }
 
 MessageDb::~MessageDb()
@@ -66,9 +311,18 @@ MessageDb *MessageDb::instance()
 }
 
 void MessageDb::parseMessagesFromQuery(QSqlQuery &query, QVector<Message> &msgs)
+{
+	parseMessagesFromQuery(query, [&msgs](Message &&msg) {
+		msgs << msg;
+	});
+}
+
+void MessageDb::parseMessagesFromQuery(QSqlQuery &query,
+                                       const std::function<void (Message &&)> &handleMessage)
 {
 	// get indexes of attributes
 	QSqlRecord rec = query.record();
+	int idxRowId = rec.indexOf("rowid");
 	int idxFrom = rec.indexOf("author");
 	int idxTo = rec.indexOf("recipient");
 	int idxStamp = rec.indexOf("timestamp");
@@ -89,30 +343,38 @@ void MessageDb::parseMessagesFromQuery(QSqlQuery &query, QVector<Message> &msgs)
 
 	while (query.next()) {
 		Message msg;
+		if (idxRowId != -1)
+			msg.setRowId(query.value(idxRowId).toLongLong());
 		msg.setFrom(query.value(idxFrom).toString());
 		msg.setTo(query.value(idxTo).toString());
-		msg.setStamp(QDateTime::fromString(
-			query.value(idxStamp).toString(),
-			Qt::ISODate
+		msg.setStamp(QDateTime::fromMSecsSinceEpoch(
+			query.value(idxStamp).toLongLong(),
+			Qt::UTC
 		));
 		msg.setId(query.value(idxId).toString());
 		msg.setBody(query.value(idxBody).toString());
 		msg.setDeliveryState(static_cast<Enums::DeliveryState>(query.value(idxDeliveryState).toInt()));
 		msg.setMediaType(static_cast<MessageType>(query.value(idxMediaType).toInt()));
-		msg.setOutOfBandUrl(query.value(idxOutOfBandUrl).toString());
-		msg.setMediaContentType(query.value(idxMediaContentType).toString());
-		msg.setMediaLocation(query.value(idxMediaLocation).toString());
-		msg.setMediaSize(query.value(idxMediaSize).toLongLong());
-		msg.setMediaLastModified(QDateTime::fromMSecsSinceEpoch(
-			query.value(idxMediaLastModified).toLongLong()
-		));
+		// the media attributes are only selected by queries that need them
+		if (idxOutOfBandUrl != -1)
+			msg.setOutOfBandUrl(query.value(idxOutOfBandUrl).toString());
+		if (idxMediaContentType != -1)
+			msg.setMediaContentType(query.value(idxMediaContentType).toString());
+		if (idxMediaLocation != -1)
+			msg.setMediaLocation(query.value(idxMediaLocation).toString());
+		if (idxMediaSize != -1)
+			msg.setMediaSize(query.value(idxMediaSize).toLongLong());
+		if (idxMediaLastModified != -1)
+			msg.setMediaLastModified(QDateTime::fromMSecsSinceEpoch(
+				query.value(idxMediaLastModified).toLongLong()
+			));
 		msg.setIsEdited(query.value(idxIsEdited).toBool());
 		msg.setSpoilerHint(query.value(idxSpoilerHint).toString());
 		msg.setErrorText(query.value(idxErrorText).toString());
 		msg.setIsSpoiler(query.value(idxIsSpoiler).toBool());
 		msg.setReplaceId(query.value(idxReplaceId).toString());
 		msg.setReceiptRequested(true);	//this is useful with resending pending messages
-		msgs << msg;
+		handleMessage(std::move(msg));
 	}
 }
 
@@ -127,7 +389,7 @@ QSqlRecord MessageDb::createUpdateRecord(const Message &oldMsg, const Message &n
 	if (oldMsg.stamp() != newMsg.stamp())
 		rec.append(Utils::createSqlField(
 		        "timestamp",
-		        newMsg.stamp().toString(Qt::ISODate)
+		        newMsg.stamp().toMSecsSinceEpoch()
 		));
 	if (oldMsg.id() != newMsg.id()) {
 		// TODO: remove as soon as 'NOT NULL' was removed from id column
@@ -175,69 +437,299 @@ QSqlRecord MessageDb::createUpdateRecord(const Message &oldMsg, const Message &n
 	return rec;
 }
 
-void MessageDb::fetchMessages(const QString &user1, const QString &user2, int index)
+QSqlRecord MessageDb::createUpdateRecord(const MessagePatch &patch)
 {
-	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
-	query.setForwardOnly(true);
+	QSqlRecord rec;
 
-	QMap<QString, QVariant> bindValues;
-	bindValues[":user1"] = user1;
-	bindValues[":user2"] = user2;
-	bindValues[":index"] = index;
-	bindValues[":limit"] = DB_MSG_QUERY_LIMIT;
+	if (patch.deliveryState)
+		rec.append(Utils::createSqlField("deliveryState", int(*patch.deliveryState)));
+	if (patch.errorText)
+		rec.append(Utils::createSqlField("errorText", *patch.errorText));
+	if (patch.outOfBandUrl)
+		rec.append(Utils::createSqlField("mediaUrl", *patch.outOfBandUrl));
+	if (patch.mediaLocation)
+		rec.append(Utils::createSqlField("mediaLocation", *patch.mediaLocation));
 
-	Utils::execQuery(
-		query,
-		"SELECT * FROM " DB_TABLE_MESSAGES " "
-		"WHERE (author = :user1 AND recipient = :user2) OR "
-			"(author = :user2 AND recipient = :user1) "
-		"ORDER BY timestamp DESC "
-		"LIMIT :index, :limit",
-		bindValues
-	);
+	return rec;
+}
+
+QString MessageDb::createFullTextQuery(const QString &searchText)
+{
+	QStringList terms;
+	const auto words = searchText.split(QRegularExpression(QStringLiteral("\\s+")), Qt::SkipEmptyParts);
+	for (auto word : words) {
+		// Each word is quoted so that characters with a special meaning in the
+		// FTS5 query syntax are matched literally.
+		word.replace(QLatin1Char('"'), QStringLiteral("\"\""));
+		terms << QLatin1Char('"') + word + QStringLiteral("\"*");
+	}
+	return terms.join(QLatin1Char(' '));
+}
+
+void MessageDb::cancelMessageFetches(int lastRequestId)
+{
+	m_cancelledFetchRequestId = lastRequestId;
+}
+
+void MessageDb::fetchMessages(int requestId,
+                              const QString &user1,
+                              const QString &user2,
+                              const QDateTime &stamp,
+                              qint64 rowId,
+                              MessageDb::FetchDirection direction,
+                              int limit)
+{
+	// The results would be ignored, e.g., because another chat has been opened.
+	if (requestId <= m_cancelledFetchRequestId)
+		return;
+
+	// Messages that have not been loaded from the database do not have a rowid.
+	// In that case, only the timestamps are compared, i.e., other messages with
+	// exactly the same timestamp as the anchor are neither older nor newer.
+	const qint64 maxRowId = std::numeric_limits<qint64>::max();
 
 	QVector<Message> messages;
-	parseMessagesFromQuery(query, messages);
+	switch (direction) {
+	case FetchDirection::Older:
+		messages = fetchMessagesPage(user1, user2, stamp, rowId, false, limit);
+		break;
+	case FetchDirection::Newer:
+		messages = fetchMessagesPage(user1, user2, stamp, rowId ? rowId : maxRowId, true, limit);
+		break;
+	case FetchDirection::Around: {
+		// the anchor itself is part of the older half
+		const int newerLimit = limit / 2;
+		messages = fetchMessagesPage(user1, user2, stamp, rowId ? rowId : maxRowId, true, newerLimit);
+		messages += fetchMessagesPage(user1, user2, stamp, rowId ? rowId + 1 : maxRowId, false, limit - newerLimit);
+		break;
+	}
+	}
+
+	QVector<MessageRow> rows;
+	rows.reserve(messages.size());
+	for (const auto &message : qAsConst(messages))
+		rows << MessageRow(message);
 
-	emit messagesFetched(messages);
+	emit messagesFetched(requestId, rows, direction);
 }
 
-Message MessageDb::fetchLastMessage(const QString &user1, const QString &user2)
+QVector<Message> MessageDb::fetchMessagesPage(const QString &user1,
+                                              const QString &user2,
+                                              const QDateTime &stamp,
+                                              qint64 rowId,
+                                              bool newer,
+                                              int limit)
 {
-	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION_READ));
 	query.setForwardOnly(true);
 
 	QMap<QString, QVariant> bindValues = {
 		{ QStringLiteral(":user1"), user1 },
 		{ QStringLiteral(":user2"), user2 },
+		{ QStringLiteral(":limit"), limit },
 	};
 
+	QString keysetCondition;
+	if (stamp.isValid()) {
+		keysetCondition = newer ? QStringLiteral("AND (m.timestamp, m.rowid) > (:stamp, :rowId) ")
+		                        : QStringLiteral("AND (m.timestamp, m.rowid) < (:stamp, :rowId) ");
+		bindValues[QStringLiteral(":stamp")] = stamp.toMSecsSinceEpoch();
+		bindValues[QStringLiteral(":rowId")] = rowId;
+	}
+	const QString order = newer ? QStringLiteral("ASC") : QStringLiteral("DESC");
+
+	// Both directions of the chat are queried separately so that each part is a
+	// range scan on idx_messages_chat that stops after the limit.
 	Utils::execQuery(
 		query,
-		"SELECT * FROM " DB_TABLE_MESSAGES " "
-		"WHERE (author = :user1 AND recipient = :user2) OR "
-		      "(author = :user2 AND recipient = :user1) "
-		"ORDER BY timestamp DESC "
-		"LIMIT 1",
+		QStringLiteral(
+			"SELECT * FROM ("
+				"SELECT " MESSAGE_COLUMNS " FROM " MESSAGES_WITH_MEDIA " "
+				"WHERE m.author = :user1 AND m.recipient = :user2 %1"
+				"ORDER BY m.timestamp %2, m.rowid %2 LIMIT :limit"
+			") UNION ALL SELECT * FROM ("
+				"SELECT " MESSAGE_COLUMNS " FROM " MESSAGES_WITH_MEDIA " "
+				"WHERE m.author = :user2 AND m.recipient = :user1 %1"
+				"ORDER BY m.timestamp %2, m.rowid %2 LIMIT :limit"
+			") "
+			"ORDER BY timestamp %2, rowid %2 "
+			"LIMIT :limit"
+		).arg(keysetCondition, order),
 		bindValues
 	);
 
 	QVector<Message> messages;
 	parseMessagesFromQuery(query, messages);
 
-	if (!messages.isEmpty())
-		return messages.first();
-	return {};
+	if (newer)
+		std::reverse(messages.begin(), messages.end());
+
+	return messages;
+}
+
+void MessageDb::exportMessages(const QString &fileName,
+                               const QString &accountJid,
+                               const QString &chatJid,
+                               MessageDb::HistoryFormat format)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+		qWarning() << "[MessageDb] Could not open file for exporting messages:" << file.errorString();
+		emit messagesExported(fileName, -1);
+		return;
+	}
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION_READ));
+	query.setForwardOnly(true);
+
+	if (chatJid.isEmpty()) {
+		Utils::execQuery(
+			query,
+			"SELECT " MESSAGE_COLUMNS " FROM " MESSAGES_WITH_MEDIA " ORDER BY m.rowid"
+		);
+	} else {
+		Utils::execQuery(
+			query,
+			"SELECT " MESSAGE_COLUMNS " FROM " MESSAGES_WITH_MEDIA " "
+			"WHERE (m.author = :user1 AND m.recipient = :user2) OR "
+			      "(m.author = :user2 AND m.recipient = :user1) "
+			"ORDER BY m.rowid",
+			QMap<QString, QVariant> {
+				{ QStringLiteral(":user1"), accountJid },
+				{ QStringLiteral(":user2"), chatJid },
+			}
+		);
+	}
+
+	int count = 0;
+
+	if (format == HistoryFormat::Json) {
+		parseMessagesFromQuery(query, [&file, &count](Message &&msg) {
+			file.write(QJsonDocument(messageToJson(msg)).toJson(QJsonDocument::Compact));
+			file.write("\n");
+			count++;
+		});
+	} else {
+		QXmlStreamWriter writer(&file);
+		writer.setAutoFormatting(true);
+		writer.writeStartDocument();
+		writer.writeStartElement(QStringLiteral("server-data"));
+		writer.writeDefaultNamespace(QStringLiteral(NS_PIE));
+		writer.writeStartElement(QStringLiteral("host"));
+		writer.writeAttribute(QStringLiteral("jid"), QXmppUtils::jidToDomain(accountJid));
+		writer.writeStartElement(QStringLiteral("user"));
+		writer.writeAttribute(QStringLiteral("name"), QXmppUtils::jidToUser(accountJid));
+		writer.writeStartElement(QStringLiteral("archive"));
+		writer.writeDefaultNamespace(QStringLiteral(NS_PIE_MAM));
+
+		parseMessagesFromQuery(query, [&writer, &count](Message &&msg) {
+			writeMessageXml(writer, msg);
+			count++;
+		});
+
+		writer.writeEndDocument();
+	}
+
+	if (!file.flush() || file.error() != QFileDevice::NoError) {
+		qWarning() << "[MessageDb] Could not write exported messages:" << file.errorString();
+		emit messagesExported(fileName, -1);
+		return;
+	}
+
+	emit messagesExported(fileName, count);
+}
+
+void MessageDb::importMessages(const QString &fileName)
+{
+	QFile file(fileName);
+	if (!file.open(QIODevice::ReadOnly)) {
+		qWarning() << "[MessageDb] Could not open file for importing messages:" << file.errorString();
+		emit messagesImported(fileName, -1);
+		return;
+	}
+
+	// The imported messages are written in their own transactions instead of
+	// the current batch.
+	m_db->commitBatch();
+
+	int count = 0;
+	int batchCount = 0;
+	const auto importMessage = [this, &count, &batchCount](const Message &msg) {
+		if (!batchCount)
+			m_db->transaction();
+
+		// Messages that are already stored are skipped.
+		if (insertMessage(msg))
+			count++;
+
+		if (++batchCount == IMPORT_BATCH_SIZE) {
+			m_db->commit();
+			batchCount = 0;
+		}
+	};
+
+	bool success = true;
+
+	if (file.peek(64).trimmed().startsWith('<')) {
+		QXmlStreamReader reader(&file);
+		QDateTime stamp;
+
+		while (!reader.atEnd()) {
+			if (reader.readNext() != QXmlStreamReader::StartElement)
+				continue;
+
+			if (reader.name() == QStringLiteral("delay") && reader.namespaceUri() == QStringLiteral(NS_DELAY))
+				stamp = QDateTime::fromString(reader.attributes().value(QStringLiteral("stamp")).toString(), Qt::ISODateWithMs);
+			else if (reader.name() == QStringLiteral("result"))
+				stamp = {};
+			else if (reader.name() == QStringLiteral("message") && reader.namespaceUri() == QStringLiteral(NS_CLIENT))
+				importMessage(readMessageXml(reader, stamp));
+		}
+
+		if (reader.hasError()) {
+			qWarning() << "[MessageDb] Could not parse imported messages:" << reader.errorString();
+			success = false;
+		}
+	} else {
+		while (!file.atEnd()) {
+			const QByteArray line = file.readLine().trimmed();
+			if (line.isEmpty())
+				continue;
+
+			QJsonParseError error;
+			const auto document = QJsonDocument::fromJson(line, &error);
+			if (error.error != QJsonParseError::NoError) {
+				qWarning() << "[MessageDb] Could not parse imported message:" << error.errorString();
+				success = false;
+				break;
+			}
+
+			importMessage(messageFromJson(document.object()));
+		}
+	}
+
+	if (batchCount)
+		m_db->commit();
+
+	emit messagesImported(fileName, success ? count : -1);
 }
 
 void MessageDb::addMessage(const Message &msg)
+{
+	m_db->batchWrite();
+	insertMessage(msg);
+}
+
+bool MessageDb::insertMessage(const Message &msg)
 {
 	QSqlDatabase db = QSqlDatabase::database(DB_CONNECTION);
 
 	QSqlRecord record = db.record(DB_TABLE_MESSAGES);
+	// the rowid is assigned by SQLite
+	record.remove(record.indexOf("rowid"));
 	record.setValue("author", msg.from());
 	record.setValue("recipient", msg.to());
-	record.setValue("timestamp", msg.stamp().toString(Qt::ISODate));
+	record.setValue("timestamp", msg.stamp().toMSecsSinceEpoch());
 	record.setValue("message", msg.body());
 	record.setValue("id", msg.id().isEmpty() ? " " : msg.id());
 	record.setValue("deliveryState", int(msg.deliveryState()));
@@ -245,26 +737,75 @@ void MessageDb::addMessage(const Message &msg)
 	record.setValue("edited", msg.isEdited());
 	record.setValue("isSpoiler", msg.isSpoiler());
 	record.setValue("spoilerHint", msg.spoilerHint());
-	record.setValue("mediaUrl", msg.outOfBandUrl());
-	record.setValue("mediaContentType", msg.mediaContentType());
-	record.setValue("mediaLocation", msg.mediaLocation());
-	record.setValue("mediaSize", msg.mediaSize());
-	record.setValue("mediaLastModified", msg.mediaLastModified().toMSecsSinceEpoch());
 	record.setValue("errorText", msg.errorText());
 	record.setValue("replaceId", msg.replaceId());
 
+	// The same message can be received multiple times, e.g., via Message Carbons
+	// or after reconnecting. The stored message is kept because it may already
+	// have been corrected or its delivery state may have been updated.
 	QSqlQuery query(db);
-	Utils::execQuery(query, db.driver()->sqlStatement(
-	        QSqlDriver::InsertStatement,
-	        DB_TABLE_MESSAGES,
-	        record,
-	        false
-	));
+	Utils::execQuery(
+		query,
+		db.driver()->sqlStatement(
+			QSqlDriver::InsertStatement,
+			DB_TABLE_MESSAGES,
+			record,
+			true
+		) + QStringLiteral(" ON CONFLICT (author, recipient, id) WHERE id != ' ' DO NOTHING"),
+		Utils::recordValues(record)
+	);
+
+	if (!query.numRowsAffected())
+		return false;
+
+	const QVariant rowId = query.lastInsertId();
+
+	if (msg.mediaType() != MessageType::MessageText || !msg.outOfBandUrl().isEmpty() ||
+			!msg.mediaLocation().isEmpty()) {
+		QSqlRecord mediaRecord;
+		mediaRecord.append(Utils::createSqlField("messageRowId", rowId));
+		mediaRecord.append(Utils::createSqlField("mediaUrl", msg.outOfBandUrl()));
+		mediaRecord.append(Utils::createSqlField("mediaContentType", msg.mediaContentType()));
+		mediaRecord.append(Utils::createSqlField("mediaLocation", msg.mediaLocation()));
+		mediaRecord.append(Utils::createSqlField("mediaSize", msg.mediaSize()));
+		mediaRecord.append(Utils::createSqlField("mediaLastModified", msg.mediaLastModified().toMSecsSinceEpoch()));
+
+		Utils::execQuery(
+			query,
+			db.driver()->sqlStatement(
+				QSqlDriver::InsertStatement,
+				DB_TABLE_MESSAGE_MEDIA,
+				mediaRecord,
+				true
+			),
+			Utils::recordValues(mediaRecord)
+		);
+	}
+
+	if (!msg.body().isEmpty()) {
+		Utils::execQuery(
+			query,
+			"INSERT INTO " DB_TABLE_MESSAGES_FTS " (rowid, message) VALUES (?, ?)",
+			QVector<QVariant>() << rowId << msg.body()
+		);
+	}
+
+	return true;
 }
 
 void MessageDb::removeMessage(const QString &id)
 {
+	m_db->batchWrite();
+
+	removeFromFullTextIndex(id);
+
 	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	Utils::execQuery(
+		query,
+		"DELETE FROM " DB_TABLE_MESSAGE_MEDIA " "
+		"WHERE messageRowId IN (SELECT rowid FROM " DB_TABLE_MESSAGES " WHERE id = ?)",
+		QVector<QVariant>() << id
+	);
 	Utils::execQuery(
 		query,
 		"DELETE FROM " DB_TABLE_MESSAGES " WHERE id = ?",
@@ -274,8 +815,14 @@ void MessageDb::removeMessage(const QString &id)
 
 void MessageDb::removeAllMessages()
 {
+	m_db->batchWrite();
+
 	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	Utils::execQuery(query, "INSERT INTO " DB_TABLE_MESSAGES_FTS " (" DB_TABLE_MESSAGES_FTS ") VALUES ('delete-all')");
+	Utils::execQuery(query, "DELETE FROM " DB_TABLE_MESSAGE_MEDIA);
 	Utils::execQuery(query, "DELETE FROM " DB_TABLE_MESSAGES);
+	Utils::execQuery(query, "INSERT INTO " DB_ARCHIVE "." DB_TABLE_MESSAGES_FTS " (" DB_TABLE_MESSAGES_FTS ") VALUES ('delete-all')");
+	Utils::execQuery(query, "DELETE FROM " DB_ARCHIVE "." DB_TABLE_MESSAGES);
 }
 
 void MessageDb::updateMessage(const QString &id,
@@ -288,7 +835,7 @@ void MessageDb::updateMessage(const QString &id,
 	query.setForwardOnly(true);
 	Utils::execQuery(
 		query,
-		"SELECT * FROM " DB_TABLE_MESSAGES " WHERE id = ? LIMIT 1",
+		"SELECT " MESSAGE_COLUMNS " FROM " MESSAGES_WITH_MEDIA " WHERE m.id = ? LIMIT 1",
 		QVector<QVariant>() << id
 	);
 
@@ -304,24 +851,46 @@ void MessageDb::updateMessage(const QString &id,
 		if (msgs.first() != msg) {
 			// create an SQL record with only the differences
 			QSqlRecord rec = createUpdateRecord(msgs.first(), msg);
-
-			Utils::execQuery(
-			        query,
-			        db.driver()->sqlStatement(
-			                QSqlDriver::UpdateStatement,
-			                DB_TABLE_MESSAGES,
-			                rec,
-			                false
-			        ) +
-			        Utils::simpleWhereStatement(db.driver(), "id", id)
-			);
+			updateMessageRecord(id, rec);
 		}
 	}
 }
 
+void MessageDb::patchMessage(const QString &id, const MessagePatch &patch)
+{
+	if (!patch.isEmpty())
+		updateMessageRecord(id, createUpdateRecord(patch));
+}
+
 void MessageDb::updateMessageRecord(const QString &id,
                                     const QSqlRecord &updateRecord)
 {
+	m_db->batchWrite();
+
+	// The media attributes are stored in their own table.
+	QSqlRecord messageRecord;
+	QSqlRecord mediaRecord;
+	for (int i = 0; i < updateRecord.count(); i++) {
+		const QSqlField field = updateRecord.field(i);
+		if (field.name().startsWith(QStringLiteral("media")))
+			mediaRecord.append(field);
+		else
+			messageRecord.append(field);
+	}
+
+	// The media attributes are updated first because the message ID could be
+	// changed by the update of the message.
+	if (!mediaRecord.isEmpty())
+		updateMediaRecord(id, mediaRecord);
+
+	if (messageRecord.isEmpty())
+		return;
+
+	const bool bodyChanged = messageRecord.contains(QStringLiteral("message"));
+	QVector<qint64> rowIds;
+	if (bodyChanged)
+		rowIds = removeFromFullTextIndex(id);
+
 	QSqlDatabase db = QSqlDatabase::database(DB_CONNECTION);
 	QSqlQuery query(db);
 	Utils::execQuery(
@@ -329,10 +898,41 @@ void MessageDb::updateMessageRecord(const QString &id,
 	        db.driver()->sqlStatement(
 	                QSqlDriver::UpdateStatement,
 	                DB_TABLE_MESSAGES,
-	                updateRecord,
-	                false
+	                messageRecord,
+	                true
 	        ) +
-	        Utils::simpleWhereStatement(db.driver(), "id", id)
+	        QStringLiteral(" WHERE id = ?"),
+	        Utils::recordValues(messageRecord) << id
+	);
+
+	if (bodyChanged)
+		addToFullTextIndex(rowIds);
+}
+
+void MessageDb::updateMediaRecord(const QString &id, const QSqlRecord &updateRecord)
+{
+	QStringList columns;
+	QStringList placeholders;
+	QStringList assignments;
+	for (int i = 0; i < updateRecord.count(); i++) {
+		const QString column = updateRecord.fieldName(i);
+		columns << column;
+		placeholders << QStringLiteral("?");
+		assignments << column + QStringLiteral(" = excluded.") + column;
+	}
+
+	// The entry is created if the message has not had any media attributes yet.
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	Utils::execQuery(
+		query,
+		QStringLiteral(
+			"INSERT INTO " DB_TABLE_MESSAGE_MEDIA " (messageRowId, %1) "
+			"SELECT rowid, %2 FROM " DB_TABLE_MESSAGES " WHERE id = ? "
+			"ON CONFLICT(messageRowId) DO UPDATE SET %3"
+		).arg(columns.join(QStringLiteral(", ")),
+		      placeholders.join(QStringLiteral(", ")),
+		      assignments.join(QStringLiteral(", "))),
+		Utils::recordValues(updateRecord) << id
 	);
 }
 
@@ -347,9 +947,9 @@ void MessageDb::fetchPendingMessages(const QString& userJid)
 
 	Utils::execQuery(
 		query,
-		"SELECT * FROM " DB_TABLE_MESSAGES " "
-		"WHERE (author = :user AND deliveryState = :deliveryState) "
-		"ORDER BY timestamp ASC",
+		"SELECT " MESSAGE_COLUMNS " FROM " MESSAGES_WITH_MEDIA " "
+		"WHERE (m.author = :user AND m.deliveryState = :deliveryState) "
+		"ORDER BY m.timestamp ASC",
 		bindValues
 	);
 
@@ -359,3 +959,161 @@ void MessageDb::fetchPendingMessages(const QString& userJid)
 	emit pendingMessagesFetched(messages);
 }
 
+void MessageDb::searchMessages(int requestId,
+                               const QString &accountJid,
+                               const QString &chatJid,
+                               const QString &searchText)
+{
+	const QString fullTextQuery = createFullTextQuery(searchText);
+	if (fullTextQuery.isEmpty()) {
+		emit messageSearchFinished(requestId);
+		return;
+	}
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION_READ));
+	query.setForwardOnly(true);
+
+	QMap<QString, QVariant> bindValues = {
+		{ QStringLiteral(":query"), fullTextQuery },
+		{ QStringLiteral(":limit"), DB_SEARCH_RESULTS_LIMIT },
+	};
+
+	QString chatCondition;
+	if (!chatJid.isEmpty()) {
+		chatCondition = QStringLiteral(
+			"AND ((m.author = :user1 AND m.recipient = :user2) OR "
+			     "(m.author = :user2 AND m.recipient = :user1)) "
+		);
+		bindValues[QStringLiteral(":user1")] = accountJid;
+		bindValues[QStringLiteral(":user2")] = chatJid;
+	}
+
+	// The matching terms are marked by control characters in the snippet so
+	// that the body can be HTML-escaped before they are replaced by tags.
+	Utils::execQuery(
+		query,
+		QStringLiteral(
+			"SELECT m.rowid, m.id, m.author, m.recipient, m.timestamp, "
+				"snippet(" DB_TABLE_MESSAGES_FTS ", 0, char(2), char(3), '…', 12) AS snippet "
+			"FROM " DB_TABLE_MESSAGES_FTS " "
+			"JOIN " DB_TABLE_MESSAGES " m ON m.rowid = " DB_TABLE_MESSAGES_FTS ".rowid "
+			"WHERE " DB_TABLE_MESSAGES_FTS " MATCH :query %1"
+			"ORDER BY rank "
+			"LIMIT :limit"
+		).arg(chatCondition),
+		bindValues
+	);
+
+	QVector<MessageSearchResult> results;
+	results.reserve(SEARCH_RESULT_BATCH_SIZE);
+	int resultCount = 0;
+
+	while (query.next()) {
+		MessageSearchResult result;
+		result.rowId = query.value(0).toLongLong();
+		result.id = query.value(1).toString();
+		result.from = query.value(2).toString();
+		result.to = query.value(3).toString();
+		result.stamp = QDateTime::fromMSecsSinceEpoch(query.value(4).toLongLong(), Qt::UTC);
+		result.snippet = query.value(5).toString().toHtmlEscaped()
+			.replace(QChar(2), QStringLiteral("<b>"))
+			.replace(QChar(3), QStringLiteral("</b>"));
+		results << result;
+		resultCount++;
+
+		if (results.size() == SEARCH_RESULT_BATCH_SIZE) {
+			emit messagesFound(requestId, results);
+			results.clear();
+		}
+	}
+
+	// Archived messages are found after all other messages. Their index does
+	// not contain the bodies, so the snippet is the beginning of the body
+	// without highlighted terms.
+	if (resultCount < DB_SEARCH_RESULTS_LIMIT) {
+		bindValues[QStringLiteral(":limit")] = DB_SEARCH_RESULTS_LIMIT - resultCount;
+
+		Utils::execQuery(
+			query,
+			QStringLiteral(
+				"SELECT m.id, m.author, m.recipient, m.timestamp, m.message "
+				"FROM " DB_ARCHIVE "." DB_TABLE_MESSAGES_FTS " f "
+				"JOIN " DB_ARCHIVE "." DB_TABLE_MESSAGES " m ON m.rowid = f.rowid "
+				"WHERE f." DB_TABLE_MESSAGES_FTS " MATCH :query %1"
+				"ORDER BY rank "
+				"LIMIT :limit"
+			).arg(chatCondition),
+			bindValues
+		);
+
+		while (query.next()) {
+			MessageSearchResult result;
+			result.id = query.value(0).toString();
+			result.from = query.value(1).toString();
+			result.to = query.value(2).toString();
+			result.stamp = QDateTime::fromMSecsSinceEpoch(query.value(3).toLongLong(), Qt::UTC);
+
+			QString body = Utils::decompressText(query.value(4));
+			if (body.size() > ARCHIVE_SNIPPET_LENGTH) {
+				body.truncate(ARCHIVE_SNIPPET_LENGTH);
+				body.append(QStringLiteral("…"));
+			}
+			result.snippet = body.toHtmlEscaped();
+			results << result;
+
+			if (results.size() == SEARCH_RESULT_BATCH_SIZE) {
+				emit messagesFound(requestId, results);
+				results.clear();
+			}
+		}
+	}
+
+	if (!results.isEmpty())
+		emit messagesFound(requestId, results);
+
+	emit messageSearchFinished(requestId);
+}
+
+QVector<qint64> MessageDb::removeFromFullTextIndex(const QString &id)
+{
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	query.setForwardOnly(true);
+	Utils::execQuery(
+		query,
+		"SELECT rowid, message FROM " DB_TABLE_MESSAGES " WHERE id = ?",
+		QVector<QVariant>() << id
+	);
+
+	// The index does not store the bodies, so the exact old bodies have to be
+	// passed for removing them.
+	QVector<qint64> rowIds;
+	QVector<QString> bodies;
+	while (query.next()) {
+		rowIds << query.value(0).toLongLong();
+		bodies << query.value(1).toString();
+	}
+
+	for (int i = 0; i < rowIds.size(); i++) {
+		Utils::execQuery(
+			query,
+			"INSERT INTO " DB_TABLE_MESSAGES_FTS " (" DB_TABLE_MESSAGES_FTS ", rowid, message) "
+			"VALUES ('delete', ?, ?)",
+			QVector<QVariant>() << rowIds.at(i) << bodies.at(i)
+		);
+	}
+
+	return rowIds;
+}
+
+void MessageDb::addToFullTextIndex(const QVector<qint64> &rowIds)
+{
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	for (const auto rowId : rowIds) {
+		Utils::execQuery(
+			query,
+			"INSERT INTO " DB_TABLE_MESSAGES_FTS " (rowid, message) "
+			"SELECT rowid, message FROM " DB_TABLE_MESSAGES " WHERE rowid = ?",
+			QVector<QVariant>() << rowId
+		);
+	}
+}
@@ -30,12 +30,36 @@
 
 #pragma once
 
+#include <atomic>
+
 #include <QObject>
 
 #include "Message.h"
+#include "MessagePatch.h"
+#include "MessageRow.h"
 
 class QSqlQuery;
 class QSqlRecord;
+class Database;
+
+/**
+ * Message found by a full-text search
+ */
+struct MessageSearchResult
+{
+	qint64 rowId = 0;
+	QString id;
+	QString from;
+	QString to;
+	QDateTime stamp;
+
+	/**
+	 * HTML-escaped excerpt of the message body with the matching terms in bold
+	 */
+	QString snippet;
+};
+
+Q_DECLARE_METATYPE(MessageSearchResult)
 
 /**
  * @class The MessageDb is used to query the 'messages' database table. It's used by the
@@ -49,16 +73,44 @@ class MessageDb : public QObject
 	Q_OBJECT
 
 public:
-	explicit MessageDb(QObject *parent = nullptr);
+	/**
+	 * Direction in which messages are fetched relative to an anchor message.
+	 */
+	enum class FetchDirection {
+		Older,  ///< messages older than the anchor
+		Newer,  ///< messages newer than the anchor
+		Around  ///< the anchor and the messages directly before and after it
+	};
+	Q_ENUM(FetchDirection)
+
+	/**
+	 * Format of files containing exported messages
+	 */
+	enum class HistoryFormat {
+		Json,  ///< one JSON object per line with all attributes of a message
+		Xml    ///< message archive of XEP-0227: Portable Import/Export Format
+	};
+	Q_ENUM(HistoryFormat)
+
+	MessageDb(Database *db, QObject *parent = nullptr);
 	~MessageDb();
 
 	static MessageDb *instance();
 
 	/**
 	 * Parses a list of messages from a SELECT query.
+	 *
+	 * Attributes whose columns are not selected keep their default values.
 	 */
 	static void parseMessagesFromQuery(QSqlQuery &query, QVector<Message> &msgs);
 
+	/**
+	 * Parses the messages of a SELECT query one by one and passes each of them
+	 * to @p handleMessage without keeping them.
+	 */
+	static void parseMessagesFromQuery(QSqlQuery &query,
+	                                   const std::function<void (Message &&)> &handleMessage);
+
 	/**
 	 * Creates an @c QSqlRecord for updating an old message to a new message.
 	 *
@@ -68,13 +120,41 @@ public:
 	static QSqlRecord createUpdateRecord(const Message &oldMsg,
 	                                     const Message &newMsg);
 
+	/**
+	 * Creates an @c QSqlRecord for updating the attributes of a message that are
+	 * changed by a patch.
+	 */
+	static QSqlRecord createUpdateRecord(const MessagePatch &patch);
+
+	/**
+	 * Converts text entered by the user into an FTS5 query that matches messages
+	 * containing all words of the text, each as a prefix.
+	 *
+	 * @return the query or an empty string if the text contains no words
+	 */
+	static QString createFullTextQuery(const QString &searchText);
+
+	/**
+	 * Skips the requests of fetchMessages() with IDs up to @p lastRequestId
+	 * that have not been started yet.
+	 *
+	 * In contrast to the slots, this is called directly and can be called
+	 * from any thread, so that the requests are cancelled before they are
+	 * processed.
+	 */
+	void cancelMessageFetches(int lastRequestId);
+
 signals:
 	/**
 	 * Can be used to triggerd fetchMessages()
 	 */
-	void fetchMessagesRequested(const QString &user1,
+	void fetchMessagesRequested(int requestId,
+	                            const QString &user1,
 	                            const QString &user2,
-	                            int index);
+	                            const QDateTime &stamp,
+	                            qint64 rowId,
+	                            MessageDb::FetchDirection direction,
+	                            int limit);
 
 	/**
 	 *  Emitted to fetch pending messages.
@@ -83,26 +163,97 @@ signals:
 
 	/**
 	 * Emitted when new messages have been fetched
+	 *
+	 * The messages are ordered from the newest to the oldest one. They are
+	 * passed as rows, so that their texts are formatted on the database thread.
 	 */
-	void messagesFetched(const QVector<Message> &messages);
+	void messagesFetched(int requestId,
+	                     const QVector<MessageRow> &messages,
+	                     MessageDb::FetchDirection direction);
 
 	/**
 	 * Emitted when pending messages have been fetched
 	 */
 	void pendingMessagesFetched(const QVector<Message> &messages);
 
+	/**
+	 * Can be used to trigger searchMessages()
+	 */
+	void searchMessagesRequested(int requestId,
+	                             const QString &accountJid,
+	                             const QString &chatJid,
+	                             const QString &searchText);
+
+	/**
+	 * Emitted for each batch of messages found by searchMessages()
+	 *
+	 * The batches are ordered by relevance, i.e., the best results come first.
+	 */
+	void messagesFound(int requestId, const QVector<MessageSearchResult> &results);
+
+	/**
+	 * Emitted when all results of searchMessages() have been emitted
+	 */
+	void messageSearchFinished(int requestId);
+
+	/**
+	 * Can be used to trigger exportMessages()
+	 */
+	void exportMessagesRequested(const QString &fileName,
+	                             const QString &accountJid,
+	                             const QString &chatJid,
+	                             MessageDb::HistoryFormat format);
+
+	/**
+	 * Emitted when exportMessages() has finished.
+	 *
+	 * @param count number of exported messages or -1 if the file could not be
+	 * written
+	 */
+	void messagesExported(const QString &fileName, int count);
+
+	/**
+	 * Can be used to trigger importMessages()
+	 */
+	void importMessagesRequested(const QString &fileName);
+
+	/**
+	 * Emitted when importMessages() has finished.
+	 *
+	 * @param count number of imported messages or -1 if the file could not be
+	 * read
+	 */
+	void messagesImported(const QString &fileName, int count);
+
 public slots:
 	/**
-	 * @brief Fetches more entries from the database and emits messagesFetched() with
-	 * the results.
+	 * @brief Fetches a page of messages relative to an anchor message and emits
+	 * messagesFetched() with the results.
+	 *
+	 * The page continues directly from the anchor's position (timestamp and rowid)
+	 * instead of skipping an offset, so each page takes the same time regardless of
+	 * how far back in the history it is.
+	 *
+	 * This must be called on the thread of the read-only connection.
 	 *
+	 * @param requestId ID passed to messagesFetched() to assign the results to
+	 * the request, see also cancelMessageFetches()
 	 * @param user1 Messages are from or to this JID.
 	 * @param user2 Messages are from or to this JID.
-	 * @param index Number of entries to be skipped, used for paging.
+	 * @param stamp Timestamp of the anchor message. If it is invalid, the newest
+	 * messages (or the oldest ones for FetchDirection::Newer) are fetched.
+	 * @param rowId Rowid of the anchor message or 0 if it is not known.
+	 * @param direction Whether to fetch older or newer messages than the anchor or
+	 * the messages around it.
+	 * @param limit maximum number of messages to fetch
 	 */
-	void fetchMessages(const QString &user1,
+	void fetchMessages(int requestId,
+	                   const QString &user1,
 	                   const QString &user2,
-	                   int index);
+	                   const QDateTime &stamp,
+	                   qint64 rowId,
+	                   MessageDb::FetchDirection direction,
+	                   int limit);
 
 	/**
 	 * @brief Fetches messages that are marked as pending.
@@ -112,9 +263,58 @@ public slots:
 	void fetchPendingMessages(const QString &userJid);
 
 	/**
-	 * Fetches the last message and returns it.
+	 * @brief Searches the bodies of all messages or of the messages of one chat
+	 * using the full-text index.
+	 *
+	 * The results are emitted in batches via messagesFound() and the end of the
+	 * search is signaled by messageSearchFinished().
+	 *
+	 * This must be called on the thread of the read-only connection.
+	 *
+	 * @param requestId ID passed to the signals to assign the results to the
+	 * request
+	 * @param accountJid JID of the user's account
+	 * @param chatJid JID of the chat partner or an empty string to search in all
+	 * chats
+	 * @param searchText text entered by the user
+	 */
+	void searchMessages(int requestId,
+	                    const QString &accountJid,
+	                    const QString &chatJid,
+	                    const QString &searchText);
+
+	/**
+	 * @brief Writes the messages of one chat or of all chats to a file.
+	 *
+	 * The messages are written one by one while they are read, so that the
+	 * memory usage does not depend on the number of messages. The end of the
+	 * export is signaled by messagesExported().
+	 *
+	 * This must be called on the thread of the read-only connection.
+	 *
+	 * @param fileName path of the file to be created
+	 * @param accountJid JID of the user's account
+	 * @param chatJid JID of the chat partner or an empty string to export all
+	 * chats
+	 * @param format format of the file
+	 */
+	void exportMessages(const QString &fileName,
+	                    const QString &accountJid,
+	                    const QString &chatJid,
+	                    MessageDb::HistoryFormat format);
+
+	/**
+	 * @brief Adds the messages of a file created by exportMessages() to the
+	 * database.
+	 *
+	 * The format of the file is detected by its content. Messages that are
+	 * already stored are skipped. The messages are read one by one and written
+	 * in batches of one transaction each. The end of the import is signaled by
+	 * messagesImported().
+	 *
+	 * @param fileName path of the file to be imported
 	 */
-	Message fetchLastMessage(const QString &user1, const QString &user2);
+	void importMessages(const QString &fileName);
 
 	/**
 	 * Adds a message to the database.
@@ -134,11 +334,20 @@ public slots:
 	/**
 	 * Loads a message, runs the update lambda and writes it to the DB again.
 	 *
+	 * This should only be used if the message needs to be loaded for the update,
+	 * e.g., for replacing it completely. Otherwise, patchMessage() is faster.
+	 *
 	 * @param updateMsg Function that changes the message
 	 */
 	void updateMessage(const QString &id,
 			   const std::function<void (Message &)> &updateMsg);
 
+	/**
+	 * Changes the attributes of a message that are set in a patch with a single
+	 * @c UPDATE query.
+	 */
+	void patchMessage(const QString &id, const MessagePatch &patch);
+
 	/**
 	 * Updates message by @c UPDATE record: This means it doesn't load the message
 	 * from the database and writes it again, but executes an UPDATE query.
@@ -149,5 +358,51 @@ public slots:
 	                         const QSqlRecord &updateRecord);
 
 private:
+	/**
+	 * Fetches up to @p limit messages of a chat that are positioned strictly
+	 * before or after (@p stamp, @p rowId).
+	 *
+	 * @return the messages ordered from the newest to the oldest one
+	 */
+	static QVector<Message> fetchMessagesPage(const QString &user1,
+	                                          const QString &user2,
+	                                          const QDateTime &stamp,
+	                                          qint64 rowId,
+	                                          bool newer,
+	                                          int limit);
+
+	/**
+	 * Inserts a message into the database without starting a batch of writes.
+	 *
+	 * @return whether the message has been inserted or false if a message with
+	 * the same sender, recipient and ID is already stored
+	 */
+	static bool insertMessage(const Message &msg);
+
+	/**
+	 * Sets the media attributes of the messages with the given ID.
+	 *
+	 * @param updateRecord record containing only media attributes
+	 */
+	static void updateMediaRecord(const QString &id, const QSqlRecord &updateRecord);
+
+	/**
+	 * Removes the messages with the given ID from the full-text index.
+	 *
+	 * This must be called before the bodies of the messages are changed in the
+	 * messages table.
+	 *
+	 * @return the rowids of the removed messages
+	 */
+	static QVector<qint64> removeFromFullTextIndex(const QString &id);
+
+	/**
+	 * Adds the messages with the given rowids to the full-text index.
+	 */
+	static void addToFullTextIndex(const QVector<qint64> &rowIds);
+
+	Database *m_db;
+	std::atomic_int m_cancelledFetchRequestId { 0 };
+
 	static MessageDb *s_instance;
 };
@@ -202,10 +202,7 @@ void MessageHandler::sendCorrectedMessage(const Message &msg)
 		deliveryState = Enums::DeliveryState::Error;
 	}
 
-	emit m_model->updateMessageRequested(msg.id(), [=] (Message &localMessage) {
-		localMessage.setDeliveryState(deliveryState);
-		localMessage.setErrorText(errorText);
-	});
+	emit m_model->setMessageDeliveryStateRequested(msg.id(), deliveryState, errorText);
 }
 
 void MessageHandler::handleDiscoInfo(const QXmppDiscoveryIq &info)
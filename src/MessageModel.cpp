@@ -30,6 +30,12 @@
 
 #include "MessageModel.h"
 
+// std
+#include <algorithm>
+#include <utility>
+// Qt
+#include <QTimer>
+#include <QtMath>
 // QXmpp
 #include <QXmppUtils.h>
 // Kaidan
@@ -42,11 +48,26 @@
 constexpr int MAX_CORRECTION_MESSAGE_COUNT_DEPTH = 20;
 // defines that the message is suitable for correction only if it has ben sent not earlier than N days ago
 constexpr int MAX_CORRECTION_MESSAGE_DAYS_DEPTH = 2;
+// defines how many messages are kept loaded around the visible ones, older or newer ones are removed
+constexpr int MAX_LOADED_MESSAGE_COUNT = 10 * DB_MSG_QUERY_LIMIT;
+// defines the maximum number of messages fetched at once while the user scrolls fast
+constexpr int MAX_FETCH_PAGE_SIZE = 5 * DB_MSG_QUERY_LIMIT;
+// defines how much a new fetch duration is weighted in the average fetch duration
+constexpr qreal FETCH_LATENCY_WEIGHT = 0.25;
+// defines how many bytes the messages of recently opened chats may use
+constexpr int CHAT_CACHE_MEMORY_BUDGET = 8 * 1024 * 1024;
+// defines how long new messages and patches are collected before they are applied at once (in ms)
+constexpr int UPDATE_BATCH_INTERVAL = 16;
 
 MessageModel::MessageModel(MessageDb *msgDb, QObject *parent)
 	: QAbstractListModel(parent),
-	  m_msgDb(msgDb)
+	  m_msgDb(msgDb),
+	  m_updateTimer(new QTimer(this))
 {
+	m_updateTimer->setSingleShot(true);
+	m_updateTimer->setInterval(UPDATE_BATCH_INTERVAL);
+	connect(m_updateTimer, &QTimer::timeout, this, &MessageModel::applyPendingUpdates);
+
 	connect(msgDb, &MessageDb::messagesFetched,
 	        this, &MessageModel::handleMessagesFetched);
 	connect(msgDb, &MessageDb::pendingMessagesFetched,
@@ -62,6 +83,11 @@ MessageModel::MessageModel(MessageDb *msgDb, QObject *parent)
 	connect(this, &MessageModel::updateMessageInDatabaseRequested,
 	        msgDb, &MessageDb::updateMessage);
 
+	connect(this, &MessageModel::patchMessageRequested,
+	        this, &MessageModel::patchMessage);
+	connect(this, &MessageModel::patchMessageRequested,
+	        msgDb, &MessageDb::patchMessage);
+
 	connect(this, &MessageModel::setMessageDeliveryStateRequested,
 	        this, &MessageModel::setMessageDeliveryState);
 	connect(Kaidan::instance(), &Kaidan::correctMessage,
@@ -72,37 +98,41 @@ MessageModel::~MessageModel() = default;
 
 bool MessageModel::isEmpty() const
 {
-	return m_messages.isEmpty();
+	return m_window.messages.isEmpty();
 }
 
 int MessageModel::rowCount(const QModelIndex &) const
 {
-	return m_messages.length();
+	return m_window.messages.length();
 }
 
 QHash<int, QByteArray> MessageModel::roleNames() const
 {
 	QHash<int, QByteArray> roles;
-	roles[Timestamp] = "timestamp";
-	roles[Id] = "id";
-	roles[Sender] = "sender";
-	roles[Recipient] = "recipient";
-	roles[Body] = "body";
-	roles[SentByMe] = "sentByMe";
-	roles[MediaType] = "mediaType";
-	roles[IsEdited] = "isEdited";
-	roles[DeliveryState] = "deliveryState";
-	roles[MediaUrl] = "mediaUrl";
-	roles[MediaSize] = "mediaSize";
-	roles[MediaContentType] = "mediaContentType";
-	roles[MediaLastModified] = "mediaLastModifed";
-	roles[MediaLocation] = "mediaLocation";
-	roles[MediaThumb] = "mediaThumb";
-	roles[IsSpoiler] = "isSpoiler";
-	roles[SpoilerHint] = "spoilerHint";
-	roles[ErrorText] = "errorText";
-	roles[DeliveryStateIcon] = "deliveryStateIcon";
-	roles[DeliveryStateName] = "deliveryStateName";
+	roles[MessageRow::Timestamp] = "timestamp";
+	roles[MessageRow::Id] = "id";
+	roles[MessageRow::Sender] = "sender";
+	roles[MessageRow::Recipient] = "recipient";
+	roles[MessageRow::Body] = "body";
+	roles[MessageRow::SentByMe] = "sentByMe";
+	roles[MessageRow::MediaType] = "mediaType";
+	roles[MessageRow::IsEdited] = "isEdited";
+	roles[MessageRow::DeliveryState] = "deliveryState";
+	roles[MessageRow::MediaUrl] = "mediaUrl";
+	roles[MessageRow::MediaSize] = "mediaSize";
+	roles[MessageRow::MediaContentType] = "mediaContentType";
+	roles[MessageRow::MediaLastModified] = "mediaLastModifed";
+	roles[MessageRow::MediaLocation] = "mediaLocation";
+	roles[MessageRow::MediaThumb] = "mediaThumb";
+	roles[MessageRow::IsSpoiler] = "isSpoiler";
+	roles[MessageRow::SpoilerHint] = "spoilerHint";
+	roles[MessageRow::ErrorText] = "errorText";
+	roles[MessageRow::DeliveryStateIcon] = "deliveryStateIcon";
+	roles[MessageRow::DeliveryStateName] = "deliveryStateName";
+	roles[MessageRow::FormattedBody] = "formattedBody";
+	roles[MessageRow::FormattedTimestamp] = "formattedTimestamp";
+	roles[MessageRow::IsFirstOfDay] = "isFirstOfDay";
+	roles[MessageRow::IsFirstOfGroup] = "isFirstOfGroup";
 	return roles;
 }
 
@@ -112,83 +142,155 @@ QVariant MessageModel::data(const QModelIndex &index, int role) const
 		qWarning() << "Could not get data from message model." << index << role;
 		return {};
 	}
-	Message msg = m_messages.at(index.row());
+	const MessageRow &row = m_window.messages.at(index.row());
 
 	switch (role) {
-	case Timestamp:
-		return msg.stamp();
-	case Id:
-		return msg.id();
-	case Sender:
-		return msg.from();
-	case Recipient:
-		return msg.to();
-	case Body:
-		return msg.body();
-	case SentByMe:
-		return msg.sentByMe();
-	case MediaType:
-		return QVariant::fromValue(msg.mediaType());
-	case IsEdited:
-		return msg.isEdited();
-	case DeliveryState:
-		return QVariant::fromValue(msg.deliveryState());
-	case MediaUrl:
-		return msg.outOfBandUrl();
-	case MediaLocation:
-		return msg.mediaLocation();
-	case MediaContentType:
-		return msg.mediaContentType();
-	case MediaSize:
-		return msg.mediaLastModified();
-	case MediaLastModified:
-		return msg.mediaLastModified();
-	case IsSpoiler:
-		return msg.isSpoiler();
-	case SpoilerHint:
-		return msg.spoilerHint();
-	case ErrorText:
-		return msg.errorText();
-	case DeliveryStateIcon:
-		switch (msg.deliveryState()) {
-		case DeliveryState::Pending:
-			return QmlUtils::getResourcePath("images/dots.svg");
-		case DeliveryState::Sent:
-			return QmlUtils::getResourcePath("images/check-mark-pale.svg");
-		case DeliveryState::Delivered:
-			return QmlUtils::getResourcePath("images/check-mark.svg");
-		case DeliveryState::Error:
-			return QmlUtils::getResourcePath("images/cross.svg");
-		}
-		return {};
-	case DeliveryStateName:
-		switch (msg.deliveryState()) {
-		case DeliveryState::Pending:
-			return tr("Pending");
-		case DeliveryState::Sent:
-			return tr("Sent");
-		case DeliveryState::Delivered:
-			return tr("Delivered");
-		case DeliveryState::Error:
-			return tr("Error");
-		}
-		return {};
+	case MessageRow::DeliveryStateIcon:
+		return deliveryStateIcon(row.deliveryState);
+	case MessageRow::DeliveryStateName:
+		return deliveryStateName(row.deliveryState);
 
 	// TODO: add (only useful as soon as we have got SIMS)
-	case MediaThumb:
+	case MessageRow::MediaThumb:
 		return {};
 	}
+	return row.data(role);
+}
+
+QVariant MessageModel::deliveryStateIcon(Enums::DeliveryState state)
+{
+	// The paths are looked up only once because that checks the file system.
+	switch (state) {
+	case DeliveryState::Pending: {
+		static const QVariant icon = QmlUtils::getResourcePath("images/dots.svg");
+		return icon;
+	}
+	case DeliveryState::Sent: {
+		static const QVariant icon = QmlUtils::getResourcePath("images/check-mark-pale.svg");
+		return icon;
+	}
+	case DeliveryState::Delivered: {
+		static const QVariant icon = QmlUtils::getResourcePath("images/check-mark.svg");
+		return icon;
+	}
+	case DeliveryState::Error: {
+		static const QVariant icon = QmlUtils::getResourcePath("images/cross.svg");
+		return icon;
+	}
+	}
+	return {};
+}
+
+QVariant MessageModel::deliveryStateName(Enums::DeliveryState state)
+{
+	switch (state) {
+	case DeliveryState::Pending: {
+		static const QVariant name = tr("Pending");
+		return name;
+	}
+	case DeliveryState::Sent: {
+		static const QVariant name = tr("Sent");
+		return name;
+	}
+	case DeliveryState::Delivered: {
+		static const QVariant name = tr("Delivered");
+		return name;
+	}
+	case DeliveryState::Error: {
+		static const QVariant name = tr("Error");
+		return name;
+	}
+	}
 	return {};
 }
 
 void MessageModel::fetchMore(const QModelIndex &)
 {
-	emit m_msgDb->fetchMessagesRequested(AccountManager::instance()->jid(), m_currentChatJid, m_messages.size());
+	if (m_olderFetch.requestId)
+		return;
+
+	// continue after the oldest loaded message
+	QDateTime stamp;
+	qint64 rowId = 0;
+	if (!m_window.messages.isEmpty()) {
+		stamp = m_window.messages.constLast().stamp;
+		rowId = m_window.messages.constLast().rowId;
+	}
+
+	requestFetch(m_olderFetch, stamp, rowId, MessageDb::FetchDirection::Older, pageSize());
 }
 
 bool MessageModel::canFetchMore(const QModelIndex &) const
 {
-	return !m_fetchedAll;
+	return !m_window.fetchedOldest;
+}
+
+void MessageModel::fetchNewer()
+{
+	if (m_window.fetchedNewest || m_window.messages.isEmpty() || m_newerFetch.requestId)
+		return;
+
+	// continue before the newest loaded message
+	const auto &newest = m_window.messages.constFirst();
+	requestFetch(m_newerFetch, newest.stamp, newest.rowId, MessageDb::FetchDirection::Newer, pageSize());
+}
+
+bool MessageModel::canFetchNewer() const
+{
+	return !m_window.fetchedNewest;
+}
+
+void MessageModel::prefetch(int newestVisibleIndex, int oldestVisibleIndex, qreal velocity)
+{
+	m_scrollVelocity = qAbs(velocity);
+
+	// remember the scroll position for reopening the chat
+	if (newestVisibleIndex > 0 && newestVisibleIndex < m_window.messages.size()) {
+		m_window.scrollStamp = m_window.messages.at(newestVisibleIndex).stamp;
+		m_window.scrollRowId = m_window.messages.at(newestVisibleIndex).rowId;
+	} else if (newestVisibleIndex == 0 && m_window.fetchedNewest) {
+		m_window.scrollStamp = {};
+		m_window.scrollRowId = 0;
+	}
+
+	// Fetch the next messages early enough that they are loaded before the
+	// view reaches them.
+	const int margin = DB_MSG_QUERY_LIMIT / 2 + rowsScrolledPerFetch();
+
+	if (oldestVisibleIndex >= 0 && !m_window.fetchedOldest && m_window.messages.size() - 1 - oldestVisibleIndex < margin)
+		fetchMore({});
+	if (newestVisibleIndex >= 0 && !m_window.fetchedNewest && newestVisibleIndex < margin)
+		fetchNewer();
+}
+
+void MessageModel::showMessagesAround(const QDateTime &stamp, qint64 rowId)
+{
+	m_anchorStamp = stamp.toUTC();
+	m_anchorRowId = rowId;
+
+	// the messages of the current window are not needed anymore
+	cancelFetches();
+	requestFetch(m_aroundFetch, m_anchorStamp, m_anchorRowId, MessageDb::FetchDirection::Around, DB_MSG_QUERY_LIMIT);
+}
+
+void MessageModel::showLatestMessages()
+{
+	// The chat is reopened at the newest messages.
+	m_window.scrollStamp = {};
+	m_window.scrollRowId = 0;
+
+	if (m_window.fetchedNewest)
+		return;
+
+	// The view fetches the newest messages again after the reset.
+	applyPendingUpdates();
+	cancelFetches();
+	beginResetModel();
+	m_window.messages.clear();
+	m_window.stampsById.clear();
+	m_window.fetchedOldest = false;
+	setFetchedNewest(true);
+	endResetModel();
 }
 
 QString MessageModel::currentChatJid()
@@ -201,146 +303,621 @@ void MessageModel::setCurrentChatJid(const QString &currentChatJid)
 	if (currentChatJid == m_currentChatJid)
 		return;
 
-	m_currentChatJid = currentChatJid;
-	m_fetchedAll = false;
+	applyPendingUpdates();
+	cancelFetches();
+	cacheWindow();
 
+	m_currentChatJid = currentChatJid;
 	emit currentChatJidChanged(currentChatJid);
-	clearAll();
+
+	// A recently opened chat is restored without fetching its messages again.
+	beginResetModel();
+	m_window = takeCachedWindow(currentChatJid);
+	endResetModel();
+	emit canFetchNewerChanged();
+
+	if (m_window.scrollStamp.isValid() && !m_window.messages.isEmpty())
+		emit scrollPositionRestored(m_window.findRow(m_window.scrollStamp, m_window.scrollRowId));
+}
+
+void MessageModel::cacheWindow()
+{
+	if (m_currentChatJid.isEmpty() || m_window.messages.isEmpty())
+		return;
+
+	m_window.chatJid = m_currentChatJid;
+	m_window.cost = m_window.memoryUsage();
+	m_cachedWindows.prepend(std::move(m_window));
+	m_window = {};
+
+	int cost = 0;
+	for (int i = 0; i < m_cachedWindows.size(); i++) {
+		cost += m_cachedWindows.at(i).cost;
+		if (cost > CHAT_CACHE_MEMORY_BUDGET) {
+			m_cachedWindows.resize(i);
+			break;
+		}
+	}
+}
+
+MessageModel::ChatWindow MessageModel::takeCachedWindow(const QString &chatJid)
+{
+	for (int i = 0; i < m_cachedWindows.size(); i++) {
+		if (m_cachedWindows.at(i).chatJid == chatJid)
+			return m_cachedWindows.takeAt(i);
+	}
+
+	return {};
 }
 
 bool MessageModel::canCorrectMessage(int index) const
 {
 	// check index validity
-	if (index < 0 || index >= m_messages.size())
+	if (index < 0 || index >= m_window.messages.size())
 		return false;
 
 	// message needs to be sent by us and needs to be no error message
-	const auto &msg = m_messages.at(index);
-	if (!msg.sentByMe() || msg.deliveryState() == Enums::DeliveryState::Error)
+	const auto &msg = m_window.messages.at(index);
+	if (!msg.sentByMe || msg.deliveryState == Enums::DeliveryState::Error)
 		return false;
 
 	// check time limit
 	const auto timeThreshold =
 		QDateTime::currentDateTimeUtc().addDays(-MAX_CORRECTION_MESSAGE_DAYS_DEPTH);
-	if (msg.stamp() < timeThreshold)
+	if (msg.stamp < timeThreshold)
 		return false;
 
 	// check messages count limit
 	for (int i = 0, count = 0; i < index; i++) {
-		if (m_messages.at(i).sentByMe() && ++count == MAX_CORRECTION_MESSAGE_COUNT_DEPTH)
+		if (m_window.messages.at(i).sentByMe && ++count == MAX_CORRECTION_MESSAGE_COUNT_DEPTH)
 			return false;
 	}
 
 	return true;
 }
 
-void MessageModel::handleMessagesFetched(const QVector<Message> &msgs)
+void MessageModel::handleMessagesFetched(int requestId,
+                                         const QVector<MessageRow> &msgs,
+                                         MessageDb::FetchDirection direction)
 {
-	if (msgs.isEmpty())
+	auto &fetch = pendingFetch(direction);
+	// ignore the results of cancelled fetches
+	if (requestId != fetch.requestId)
 		return;
 
-	beginInsertRows(QModelIndex(), rowCount(), rowCount() + msgs.length() - 1);
-	for (auto msg : msgs) {
-		msg.setSentByMe(AccountManager::instance()->jid() == msg.from());
-		processMessage(msg);
-		m_messages << msg;
+	const auto latency = qreal(fetch.timer.elapsed());
+	m_fetchLatency = m_fetchLatency ? (1 - FETCH_LATENCY_WEIGHT) * m_fetchLatency + FETCH_LATENCY_WEIGHT * latency : latency;
+	const int limit = fetch.limit;
+	fetch.requestId = 0;
+
+	applyPendingUpdates();
+
+	if (direction == MessageDb::FetchDirection::Around) {
+		beginResetModel();
+		m_window.messages.clear();
+		m_window.stampsById.clear();
+		m_window.messages.reserve(msgs.size());
+		for (const auto &msg : msgs) {
+			m_window.messages << createRow(msg);
+			m_window.addToIndex(m_window.messages.constLast());
+		}
+		for (int i = 0; i < m_window.messages.size(); i++)
+			m_window.updateGrouping(i);
+		// Whether there are more messages is found out by the next fetches.
+		m_window.fetchedOldest = false;
+		setFetchedNewest(false);
+		endResetModel();
+
+		if (!m_window.messages.isEmpty())
+			emit messagesShownAround(m_window.findRow(m_anchorStamp, m_anchorRowId));
+		return;
+	}
+
+	if (msgs.isEmpty()) {
+		if (direction == MessageDb::FetchDirection::Older)
+			m_window.fetchedOldest = true;
+		else
+			setFetchedNewest(true);
+		return;
+	}
+
+	// newer messages are put in front of the newest one, older ones behind the oldest one
+	const int first = direction == MessageDb::FetchDirection::Newer ? 0 : rowCount();
+
+	QVector<MessageRow> rows;
+	rows.reserve(msgs.size());
+	for (const auto &msg : msgs) {
+		rows << createRow(msg);
+		m_window.addToIndex(rows.constLast());
 	}
+
+	beginInsertRows(QModelIndex(), first, first + msgs.length() - 1);
+	if (direction == MessageDb::FetchDirection::Newer)
+		m_window.messages = rows + m_window.messages;
+	else
+		m_window.messages += rows;
+	for (int i = first; i < first + msgs.length(); i++)
+		m_window.updateGrouping(i);
 	endInsertRows();
 
-	if (msgs.length() < DB_MSG_QUERY_LIMIT)
-		m_fetchedAll = true;
+	if (direction == MessageDb::FetchDirection::Older) {
+		// the previously oldest message is now followed by an older one
+		refreshGrouping(first - 1);
+
+		if (msgs.length() < limit)
+			m_window.fetchedOldest = true;
+		removeDistantMessages(true);
+	} else {
+		if (msgs.length() < limit)
+			setFetchedNewest(true);
+		removeDistantMessages(false);
+	}
 }
 
-void MessageModel::clearAll()
+void MessageModel::removeDistantMessages(bool newest)
 {
-	if (!m_messages.isEmpty()) {
-		beginRemoveRows(QModelIndex(), 0, rowCount() - 1);
-		m_messages.clear();
-		endRemoveRows();
+	const int count = m_window.messages.size() - MAX_LOADED_MESSAGE_COUNT;
+	if (count <= 0)
+		return;
+
+	const int first = newest ? 0 : m_window.messages.size() - count;
+	beginRemoveRows(QModelIndex(), first, first + count - 1);
+	m_window.removeMessages(first, count);
+	endRemoveRows();
+
+	// the removed messages are fetched again when the view gets near them
+	if (newest) {
+		setFetchedNewest(false);
+	} else {
+		m_window.fetchedOldest = false;
+		refreshGrouping(m_window.messages.size() - 1);
 	}
 }
 
-void MessageModel::insertMessage(int idx, const Message &msg)
+void MessageModel::requestFetch(PendingFetch &fetch, const QDateTime &stamp, qint64 rowId, MessageDb::FetchDirection direction, int limit)
+{
+	fetch.requestId = ++m_lastFetchRequestId;
+	fetch.limit = limit;
+	fetch.timer.start();
+
+	emit m_msgDb->fetchMessagesRequested(fetch.requestId, AccountManager::instance()->jid(), m_currentChatJid, stamp, rowId, direction, limit);
+}
+
+MessageModel::PendingFetch &MessageModel::pendingFetch(MessageDb::FetchDirection direction)
+{
+	switch (direction) {
+	case MessageDb::FetchDirection::Older:
+		return m_olderFetch;
+	case MessageDb::FetchDirection::Newer:
+		return m_newerFetch;
+	case MessageDb::FetchDirection::Around:
+		break;
+	}
+	return m_aroundFetch;
+}
+
+void MessageModel::cancelFetches()
+{
+	m_msgDb->cancelMessageFetches(m_lastFetchRequestId);
+	m_olderFetch.requestId = 0;
+	m_newerFetch.requestId = 0;
+	m_aroundFetch.requestId = 0;
+}
+
+int MessageModel::rowsScrolledPerFetch() const
+{
+	return qCeil(m_scrollVelocity * m_fetchLatency / 1000);
+}
+
+int MessageModel::pageSize() const
+{
+	// While the user scrolls fast, larger pages need fewer round trips to the
+	// database. A page covers the rows scrolled during two fetches.
+	return std::clamp(2 * rowsScrolledPerFetch(), DB_MSG_QUERY_LIMIT, MAX_FETCH_PAGE_SIZE);
+}
+
+void MessageModel::setFetchedNewest(bool fetchedNewest)
+{
+	if (m_window.fetchedNewest != fetchedNewest) {
+		m_window.fetchedNewest = fetchedNewest;
+		emit canFetchNewerChanged();
+	}
+}
+
+void MessageModel::scheduleUpdates()
+{
+	// The timer is not restarted, so that a continuous stream of messages does
+	// not delay the updates indefinitely.
+	if (!m_updateTimer->isActive())
+		m_updateTimer->start();
+}
+
+void MessageModel::applyPendingUpdates()
+{
+	m_updateTimer->stop();
+
+	if (!m_pendingMessages.isEmpty())
+		insertMessages(std::exchange(m_pendingMessages, {}));
+	if (!m_pendingPatches.isEmpty())
+		applyPatches(std::exchange(m_pendingPatches, {}));
+}
+
+void MessageModel::insertMessages(const QVector<Message> &msgs)
+{
+	QVector<MessageRow> rows;
+	rows.reserve(msgs.size());
+	QSet<QPair<QString, QString>> addedMessages;
+
+	for (const auto &msg : msgs) {
+		// The same message can be received multiple times, e.g., via Message
+		// Carbons or after reconnecting.
+		if (!msg.id().trimmed().isEmpty()) {
+			const QPair<QString, QString> key = { msg.id(), msg.from() };
+			if (addedMessages.contains(key) || m_window.findMessage(msg.id(), msg.from()) != -1)
+				continue;
+			addedMessages.insert(key);
+		}
+
+		// Messages newer than the loaded ones are added when they are fetched.
+		if (!m_window.fetchedNewest && m_window.insertPosition(msg.stamp()) == 0)
+			continue;
+
+		rows << createRow(MessageRow(msg));
+	}
+
+	// Messages with the same timestamp keep the order in which they were received.
+	std::stable_sort(rows.begin(), rows.end(), [](const MessageRow &a, const MessageRow &b) {
+		return a.stamp > b.stamp;
+	});
+
+	for (int first = 0; first < rows.size();) {
+		// All rows that belong between the same two loaded messages are inserted
+		// at once.
+		const int position = m_window.insertPosition(rows.at(first).stamp);
+		int last = first;
+		while (last + 1 < rows.size() &&
+		       (position == m_window.messages.size() ||
+		        m_window.messages.at(position).stamp < rows.at(last + 1).stamp))
+			last++;
+
+		const int count = last - first + 1;
+		beginInsertRows(QModelIndex(), position, position + count - 1);
+		for (int i = 0; i < count; i++)
+			m_window.insertMessage(position + i, rows.at(first + i));
+		for (int i = position; i < position + count; i++)
+			m_window.updateGrouping(i);
+		endInsertRows();
+
+		refreshGrouping(position - 1);
+		first = last + 1;
+	}
+
+	removeDistantMessages(false);
+}
+
+void MessageModel::applyPatches(const QVector<QPair<QString, MessagePatch>> &patches)
+{
+	QVector<int> changedRows;
+	QVector<int> roles;
+
+	for (const auto &patch : patches) {
+		if (const int i = m_window.findMessage(patch.first); i != -1) {
+			patch.second.apply(m_window.messages[i]);
+			changedRows << i;
+			roles << changedRoles(patch.second);
+		}
+	}
+
+	std::sort(changedRows.begin(), changedRows.end());
+	changedRows.erase(std::unique(changedRows.begin(), changedRows.end()), changedRows.end());
+	std::sort(roles.begin(), roles.end());
+	roles.erase(std::unique(roles.begin(), roles.end()), roles.end());
+
+	for (int first = 0; first < changedRows.size();) {
+		int last = first;
+		while (last + 1 < changedRows.size() && changedRows.at(last + 1) == changedRows.at(last) + 1)
+			last++;
+
+		emit dataChanged(index(changedRows.at(first)), index(changedRows.at(last)), roles);
+		first = last + 1;
+	}
+}
+
+QVector<int> MessageModel::changedRoles(const MessagePatch &patch)
+{
+	QVector<int> roles;
+	if (patch.deliveryState)
+		roles << MessageRow::DeliveryState << MessageRow::DeliveryStateIcon << MessageRow::DeliveryStateName;
+	if (patch.errorText)
+		roles << MessageRow::ErrorText;
+	if (patch.outOfBandUrl)
+		roles << MessageRow::MediaUrl;
+	if (patch.mediaLocation)
+		roles << MessageRow::MediaLocation;
+	return roles;
+}
+
+void MessageModel::insertMessage(int idx, const MessageRow &msg)
 {
 	beginInsertRows(QModelIndex(), idx, idx);
-	m_messages.insert(idx, msg);
+	m_window.insertMessage(idx, msg);
 	endInsertRows();
+
+	refreshGrouping(idx - 1);
 }
 
-void MessageModel::addMessage(Message msg)
+void MessageModel::removeMessage(int i)
 {
-	if (QXmppUtils::jidToBareJid(msg.from()) == m_currentChatJid ||
-			QXmppUtils::jidToBareJid(msg.to()) == m_currentChatJid) {
-		processMessage(msg);
+	beginRemoveRows(QModelIndex(), i, i);
+	m_window.removeMessages(i, 1);
+	endRemoveRows();
 
-		// index where to add the new message
-		int i = 0;
-		for (const auto &message : qAsConst(m_messages)) {
-			if (msg.stamp() > message.stamp()) {
-				insertMessage(i, msg);
-				return;
-			}
-			i++;
+	refreshGrouping(i - 1);
+}
+
+void MessageModel::refreshGrouping(int i)
+{
+	if (m_window.updateGrouping(i)) {
+		const QModelIndex modelIndex = index(i);
+		emit dataChanged(modelIndex, modelIndex, { MessageRow::IsFirstOfDay, MessageRow::IsFirstOfGroup });
+	}
+}
+
+int MessageModel::ChatWindow::insertPosition(const QDateTime &stamp) const
+{
+	// The messages are ordered from the newest to the oldest one. A new message
+	// is put behind the messages with the same timestamp.
+	const auto itr = std::lower_bound(messages.cbegin(), messages.cend(), stamp,
+	                                  [](const MessageRow &message, const QDateTime &stamp) {
+		return message.stamp >= stamp;
+	});
+	return std::distance(messages.cbegin(), itr);
+}
+
+int MessageModel::ChatWindow::findMessage(const QString &id, const QString &from) const
+{
+	const auto stamps = stampsById.values(id);
+	for (const auto &stamp : stamps) {
+		auto itr = std::lower_bound(messages.cbegin(), messages.cend(), stamp,
+		                            [](const MessageRow &message, const QDateTime &stamp) {
+			return message.stamp > stamp;
+		});
+
+		for (; itr != messages.cend() && itr->stamp == stamp; ++itr) {
+			if (itr->id == id && (from.isEmpty() || itr->from == from))
+				return std::distance(messages.cbegin(), itr);
+		}
+	}
+
+	return -1;
+}
+
+int MessageModel::ChatWindow::findRow(const QDateTime &stamp, qint64 rowId) const
+{
+	auto itr = std::lower_bound(messages.cbegin(), messages.cend(), stamp,
+	                            [](const MessageRow &message, const QDateTime &stamp) {
+		return message.stamp > stamp;
+	});
+
+	if (rowId) {
+		for (auto msg = itr; msg != messages.cend() && msg->stamp == stamp; ++msg) {
+			if (msg->rowId == rowId)
+				return std::distance(messages.cbegin(), msg);
+		}
+	}
+
+	return std::min<int>(std::distance(messages.cbegin(), itr), messages.size() - 1);
+}
+
+void MessageModel::ChatWindow::insertMessage(int i, const MessageRow &msg)
+{
+	messages.insert(i, msg);
+	addToIndex(msg);
+	updateGrouping(i);
+}
+
+void MessageModel::ChatWindow::removeMessages(int first, int count)
+{
+	for (int i = first; i < first + count; i++)
+		removeFromIndex(messages.at(i));
+	messages.remove(first, count);
+}
+
+void MessageModel::ChatWindow::addMessage(const MessageRow &msg)
+{
+	if (!msg.id.trimmed().isEmpty() && findMessage(msg.id, msg.from) != -1)
+		return;
+
+	const int i = insertPosition(msg.stamp);
+	if (i == 0 && !fetchedNewest)
+		return;
+
+	insertMessage(i, msg);
+	updateGrouping(i - 1);
+
+	if (messages.size() > MAX_LOADED_MESSAGE_COUNT) {
+		removeMessages(MAX_LOADED_MESSAGE_COUNT, messages.size() - MAX_LOADED_MESSAGE_COUNT);
+		updateGrouping(messages.size() - 1);
+		fetchedOldest = false;
+	}
+}
+
+bool MessageModel::ChatWindow::updateGrouping(int i)
+{
+	if (i < 0 || i >= messages.size())
+		return false;
+
+	auto &msg = messages[i];
+	const bool hasOlder = i + 1 < messages.size();
+	const bool isFirstOfDay = !hasOlder || messages.at(i + 1).day != msg.day;
+	const bool isFirstOfGroup = isFirstOfDay || messages.at(i + 1).from != msg.from;
+
+	if (msg.isFirstOfDay == isFirstOfDay && msg.isFirstOfGroup == isFirstOfGroup)
+		return false;
+
+	msg.isFirstOfDay = isFirstOfDay;
+	msg.isFirstOfGroup = isFirstOfGroup;
+	return true;
+}
+
+int MessageModel::ChatWindow::memoryUsage() const
+{
+	// The JIDs are shared by all rows.
+	int usage = messages.size() * int(sizeof(MessageRow));
+	for (const auto &msg : messages) {
+		usage += int(sizeof(QChar)) * (msg.id.size() + msg.body.size() + msg.formattedBody.size() +
+		                               msg.formattedStamp.size() + msg.replaceId.size() +
+		                               msg.spoilerHint.size() + msg.errorText.size() +
+		                               msg.outOfBandUrl.size() + msg.mediaContentType.size() +
+		                               msg.mediaLocation.size());
+	}
+	return usage;
+}
+
+void MessageModel::ChatWindow::addToIndex(const MessageRow &msg)
+{
+	// Messages without IDs are stored with a space as their ID.
+	if (!msg.id.trimmed().isEmpty())
+		stampsById.insert(msg.id, msg.stamp);
+}
+
+void MessageModel::ChatWindow::removeFromIndex(const MessageRow &msg)
+{
+	auto itr = stampsById.find(msg.id);
+	while (itr != stampsById.end() && itr.key() == msg.id) {
+		if (itr.value() == msg.stamp) {
+			stampsById.erase(itr);
+			return;
 		}
+		++itr;
+	}
+}
 
-		// add message to the end of the list
-		insertMessage(i, msg);
+void MessageModel::addMessage(Message msg)
+{
+	const auto from = QXmppUtils::jidToBareJid(msg.from());
+	const auto to = QXmppUtils::jidToBareJid(msg.to());
+
+	if (from == m_currentChatJid || to == m_currentChatJid) {
+		// Many messages can be received at once, e.g., after reconnecting.
+		// They are inserted together instead of relayouting the view for each.
+		m_pendingMessages << msg;
+		scheduleUpdates();
+		return;
+	}
+
+	// keep the windows of recently opened chats up to date
+	for (auto &window : m_cachedWindows) {
+		if (window.chatJid == from || window.chatJid == to) {
+			window.addMessage(createRow(MessageRow(msg)));
+			window.cost = window.memoryUsage();
+			return;
+		}
 	}
 }
 
+MessageRow MessageModel::createRow(MessageRow row)
+{
+	row.sentByMe = AccountManager::instance()->jid() == row.from;
+	row.from = internJid(row.from);
+	row.to = internJid(row.to);
+	return row;
+}
+
+QString MessageModel::internJid(const QString &jid)
+{
+	// The rows share the JIDs of the chat instead of storing a copy each.
+	if (const auto itr = m_jids.constFind(jid); itr != m_jids.cend())
+		return *itr;
+
+	m_jids.insert(jid);
+	return jid;
+}
+
 void MessageModel::updateMessage(const QString &id,
                                  const std::function<void(Message &)> &updateMsg)
 {
-	for (int i = 0; i < m_messages.length(); i++) {
-		if (m_messages.at(i).id() == id) {
-			// update message
-			Message msg = m_messages.at(i);
-			updateMsg(msg);
-
-			// check if item was actually modified
-			if (m_messages.at(i) == msg)
-				return;
-
-			// check, if the position of the new message may be different
-			if (msg.stamp() == m_messages.at(i).stamp()) {
-				beginRemoveRows(QModelIndex(), i, i);
-				m_messages.removeAt(i);
-				endRemoveRows();
-
-				// add the message at the same position
-				insertMessage(i, msg);
-			} else {
-				beginRemoveRows(QModelIndex(), i, i);
-				m_messages.removeAt(i);
-				endRemoveRows();
-
-				// put to new position
-				addMessage(msg);
+	applyPendingUpdates();
+
+	if (const int i = m_window.findMessage(id); i != -1) {
+		// update message
+		const Message oldMsg = m_window.messages.at(i).toMessage();
+		Message msg = oldMsg;
+		updateMsg(msg);
+
+		// check if item was actually modified
+		if (oldMsg == msg)
+			return;
+
+		// check, if the position of the new message may be different
+		if (msg.stamp() == oldMsg.stamp()) {
+			removeMessage(i);
+
+			// add the message at the same position
+			insertMessage(i, createRow(MessageRow(msg)));
+		} else {
+			removeMessage(i);
+
+			// put to new position
+			addMessage(msg);
+		}
+	} else {
+		for (auto &window : m_cachedWindows) {
+			if (const int i = window.findMessage(id); i != -1) {
+				Message msg = window.messages.at(i).toMessage();
+				updateMsg(msg);
+
+				window.removeMessages(i, 1);
+				window.updateGrouping(i - 1);
+				window.addMessage(createRow(MessageRow(msg)));
+				window.cost = window.memoryUsage();
+				break;
 			}
-			break;
 		}
 	}
 
 	emit updateMessageInDatabaseRequested(id, updateMsg);
 }
 
+void MessageModel::patchMessage(const QString &id, const MessagePatch &patch)
+{
+	// Messages that have not been inserted yet are patched before they are.
+	for (auto &msg : m_pendingMessages) {
+		if (msg.id() == id)
+			patch.apply(msg);
+	}
+
+	if (m_window.findMessage(id) != -1) {
+		m_pendingPatches.append({ id, patch });
+		scheduleUpdates();
+		return;
+	}
+
+	for (auto &window : m_cachedWindows) {
+		if (const int i = window.findMessage(id); i != -1) {
+			patch.apply(window.messages[i]);
+			return;
+		}
+	}
+}
+
 void MessageModel::setMessageDeliveryState(const QString &msgId, Enums::DeliveryState state, const QString &errText)
 {
-	updateMessage(msgId, [state, errText](Message &msg) {
-		msg.setDeliveryState(state);
-		msg.setErrorText(errText);
-	});
+	MessagePatch patch;
+	patch.deliveryState = state;
+	patch.errorText = errText;
+	emit patchMessageRequested(msgId, patch);
 }
 
 int MessageModel::searchForMessageFromNewToOld(const QString &searchString, const int startIndex) const
 {
 	int indexOfFoundMessage = startIndex;
 
-	if (indexOfFoundMessage >= m_messages.size())
+	if (indexOfFoundMessage >= m_window.messages.size())
 		indexOfFoundMessage = 0;
 
-	for (; indexOfFoundMessage < m_messages.size(); indexOfFoundMessage++) {
-		if (m_messages.at(indexOfFoundMessage).body().contains(searchString, Qt::CaseInsensitive))
+	for (; indexOfFoundMessage < m_window.messages.size(); indexOfFoundMessage++) {
+		if (m_window.messages.at(indexOfFoundMessage).body.contains(searchString, Qt::CaseInsensitive))
 			return indexOfFoundMessage;
 	}
 
@@ -352,25 +929,16 @@ int MessageModel::searchForMessageFromOldToNew(const QString &searchString, cons
 	int indexOfFoundMessage = startIndex;
 
 	if (indexOfFoundMessage < 0)
-		indexOfFoundMessage = m_messages.size() - 1;
+		indexOfFoundMessage = m_window.messages.size() - 1;
 
 	for (; indexOfFoundMessage >= 0; indexOfFoundMessage--) {
-		if (m_messages.at(indexOfFoundMessage).body().contains(searchString, Qt::CaseInsensitive))
+		if (m_window.messages.at(indexOfFoundMessage).body.contains(searchString, Qt::CaseInsensitive))
 			break;
 	}
 
 	return indexOfFoundMessage;
 }
 
-void MessageModel::processMessage(Message &msg)
-{
-	if (msg.body().size() > MESSAGE_MAX_CHARS) {
-		auto body = msg.body();
-		body.truncate(MESSAGE_MAX_CHARS);
-		msg.setBody(body);
-	}
-}
-
 void MessageModel::sendPendingMessages()
 {
 	emit m_msgDb->fetchPendingMessagesRequested(AccountManager::instance()->jid());
@@ -378,40 +946,50 @@ void MessageModel::sendPendingMessages()
 
 void MessageModel::correctMessage(const QString &msgId, const QString &message)
 {
-	const auto hasCorrectId = [&msgId](const Message& msg) {
-		return msg.id() == msgId;
-	};
-	auto itr = std::find_if(m_messages.begin(), m_messages.end(), hasCorrectId);
-
-	if (itr != m_messages.end()) {
-		Message &msg = *itr;
-		msg.setBody(message);
-		if (msg.deliveryState() != Enums::DeliveryState::Pending) {
-			msg.setId(QXmppUtils::generateStanzaHash());
-			// Set replaceId only on first correction, so it's always the original id
-			// (`id` is the id of the current edit, `replaceId` is the original id)
-			if (!msg.isEdited()) {
-				msg.setIsEdited(true);
-				msg.setReplaceId(msgId);
-			}
-			msg.setDeliveryState(Enums::DeliveryState::Pending);
-
-			if (ConnectionState(Kaidan::instance()->connectionState()) == Enums::ConnectionState::StateConnected) {
-				// the trick with the time is important for the servers
-				// this way they can tell which version of the message is the latest
-				Message copy = msg;
-				copy.setStamp(QDateTime::currentDateTimeUtc());
-				emit sendCorrectedMessageRequested(copy);
-			}
-		} else if (!msg.isEdited()) {
-			msg.setStamp(QDateTime::currentDateTimeUtc());
-		}
+	applyPendingUpdates();
 
-		QModelIndex index = createIndex(std::distance(m_messages.begin(), itr), 0);
-		emit dataChanged(index, index);
+	const int i = m_window.findMessage(msgId);
+	if (i == -1)
+		return;
 
-		emit updateMessageInDatabaseRequested(msgId, [=] (Message &localMessage) {
-			localMessage = msg;
-		});
+	MessageRow row = m_window.messages.at(i);
+	row.setBody(message);
+	if (row.deliveryState != Enums::DeliveryState::Pending) {
+		row.id = QXmppUtils::generateStanzaHash();
+		// Set replaceId only on first correction, so it's always the original id
+		// (`id` is the id of the current edit, `replaceId` is the original id)
+		if (!row.isEdited) {
+			row.isEdited = true;
+			row.replaceId = msgId;
+		}
+		row.deliveryState = Enums::DeliveryState::Pending;
+
+		if (ConnectionState(Kaidan::instance()->connectionState()) == Enums::ConnectionState::StateConnected) {
+			// the trick with the time is important for the servers
+			// this way they can tell which version of the message is the latest
+			Message copy = row.toMessage();
+			copy.setStamp(QDateTime::currentDateTimeUtc());
+			emit sendCorrectedMessageRequested(copy);
+		}
+	} else if (!row.isEdited) {
+		row.setStamp(QDateTime::currentDateTimeUtc());
 	}
+
+	if (row.stamp != m_window.messages.at(i).stamp) {
+		// keep the messages ordered by their timestamps
+		removeMessage(i);
+		insertMessage(m_window.insertPosition(row.stamp), row);
+	} else {
+		m_window.removeFromIndex(m_window.messages.at(i));
+		m_window.messages[i] = row;
+		m_window.addToIndex(row);
+
+		const QModelIndex modelIndex = index(i);
+		emit dataChanged(modelIndex, modelIndex);
+	}
+
+	const Message msg = row.toMessage();
+	emit updateMessageInDatabaseRequested(msgId, [=] (Message &localMessage) {
+		localMessage = msg;
+	});
 }
@@ -31,41 +31,23 @@
 #pragma once
 
 #include <QAbstractListModel>
+#include <QElapsedTimer>
+#include <QMultiHash>
+#include <QSet>
 #include "Message.h"
+#include "MessageDb.h"
+#include "MessageRow.h"
 
-class MessageDb;
 class Kaidan;
+class QTimer;
 
 class MessageModel : public QAbstractListModel
 {
 	Q_OBJECT
 	Q_PROPERTY(QString currentChatJid READ currentChatJid WRITE setCurrentChatJid NOTIFY currentChatJidChanged)
+	Q_PROPERTY(bool canFetchNewer READ canFetchNewer NOTIFY canFetchNewerChanged)
 
 public:
-	enum MessageRoles {
-		Timestamp = Qt::UserRole + 1,
-		Id,
-		Sender,
-		Recipient,
-		Body,
-		SentByMe,
-		MediaType,
-		IsEdited,
-		DeliveryState,
-		MediaUrl,
-		MediaSize,
-		MediaContentType,
-		MediaLastModified,
-		MediaLocation,
-		MediaThumb,
-		IsSpoiler,
-		SpoilerHint,
-		ErrorText,
-		DeliveryStateIcon,
-		DeliveryStateName
-	};
-	Q_ENUM(MessageRoles)
-
 	MessageModel(MessageDb *msgDb, QObject *parent = nullptr);
 	~MessageModel();
 
@@ -77,6 +59,49 @@ public:
 	Q_INVOKABLE void fetchMore(const QModelIndex &parent) override;
 	Q_INVOKABLE bool canFetchMore(const QModelIndex &parent) const override;
 
+	/**
+	 * Fetches the messages that are newer than the loaded ones.
+	 *
+	 * Only a limited number of messages is kept loaded. If the user scrolls
+	 * back in the history, the newest messages are removed and fetched again
+	 * by this when the user scrolls forward.
+	 */
+	Q_INVOKABLE void fetchNewer();
+
+	/**
+	 * Returns whether there are messages newer than the loaded ones.
+	 */
+	bool canFetchNewer() const;
+
+	/**
+	 * Fetches older or newer messages before the view reaches the oldest or
+	 * newest loaded one.
+	 *
+	 * The faster the user scrolls and the longer fetches take, the earlier
+	 * and the more messages are fetched.
+	 *
+	 * @param newestVisibleIndex row of the newest visible message or -1
+	 * @param oldestVisibleIndex row of the oldest visible message or -1
+	 * @param velocity scroll speed in rows per second
+	 */
+	Q_INVOKABLE void prefetch(int newestVisibleIndex, int oldestVisibleIndex, qreal velocity);
+
+	/**
+	 * Replaces the loaded messages by the messages around a message or a point
+	 * in time, e.g., for showing a search result.
+	 *
+	 * messagesShownAround() is emitted when the messages are loaded.
+	 *
+	 * @param stamp timestamp of the message or point in time
+	 * @param rowId rowid of the message or 0 for a point in time
+	 */
+	Q_INVOKABLE void showMessagesAround(const QDateTime &stamp, qint64 rowId = 0);
+
+	/**
+	 * Replaces the loaded messages by the newest ones if they are not loaded.
+	 */
+	Q_INVOKABLE void showLatestMessages();
+
 	QString currentChatJid();
 	void setCurrentChatJid(const QString &currentChatJid);
 
@@ -113,39 +138,243 @@ public:
 
 signals:
 	void currentChatJidChanged(const QString &currentChatJid);
+	void canFetchNewerChanged();
+
+	/**
+	 * Emitted when the messages requested by showMessagesAround() are loaded.
+	 *
+	 * @param index row of the requested message or of the newest message
+	 * before the requested point in time
+	 */
+	void messagesShownAround(int index);
+
+	/**
+	 * Emitted when the messages of a recently opened chat are restored and the
+	 * view was not scrolled to the newest message.
+	 *
+	 * @param index row of the message that was the newest visible one
+	 */
+	void scrollPositionRestored(int index);
 
 	void addMessageRequested(const Message &msg);
 	void updateMessageRequested(const QString &id,
 	                            const std::function<void (Message &)> &updateMsg);
 	void setMessageDeliveryStateRequested(const QString &msgId, Enums::DeliveryState state, const QString &errText = QString());
+	void patchMessageRequested(const QString &id, const MessagePatch &patch);
 	void pendingMessagesFetched(const QVector<Message> &messages);
 	void sendCorrectedMessageRequested(const Message &msg);
 	void updateMessageInDatabaseRequested(const QString &id,
 	                                      const std::function<void (Message &)> &updateMsg);
 
 private slots:
-	void handleMessagesFetched(const QVector<Message> &m_messages);
+	void handleMessagesFetched(int requestId,
+	                           const QVector<MessageRow> &m_messages,
+	                           MessageDb::FetchDirection direction);
 
 	void addMessage(Message msg);
 	void updateMessage(const QString &id,
 	                   const std::function<void (Message &)> &updateMsg);
 
+	void patchMessage(const QString &id, const MessagePatch &patch);
+
 	void setMessageDeliveryState(const QString &msgId, Enums::DeliveryState state, const QString &errText = QString());
 	void correctMessage(const QString &msgId, const QString &message);
 
+	/**
+	 * Applies the messages and patches received since the last call at once.
+	 *
+	 * This must be called before any other change of the current window, so
+	 * that the changes are applied in the order they were requested.
+	 */
+	void applyPendingUpdates();
+
 private:
-	void clearAll();
-	void insertMessage(int i, const Message &msg);
+	/**
+	 * Fetch of messages whose results have not been received yet
+	 */
+	struct PendingFetch
+	{
+		// ID of the request or 0 if there is no pending fetch
+		int requestId = 0;
+		int limit = 0;
+		QElapsedTimer timer;
+	};
 
 	/**
-	 * Shortens messages to 10000 if longer to prevent DoS
-	 * @param message to process
+	 * Loaded part of the history of a chat
 	 */
-	void processMessage(Message &msg);
+	struct ChatWindow
+	{
+		/**
+		 * Returns the row at which a new message with the given timestamp is
+		 * inserted, found by a binary search.
+		 */
+		int insertPosition(const QDateTime &stamp) const;
+
+		/**
+		 * Returns the row of a message by its ID.
+		 *
+		 * @param from sender of the message or an empty string for any sender
+		 * @return the row or -1 if there is no such message
+		 */
+		int findMessage(const QString &id, const QString &from = {}) const;
+
+		/**
+		 * Returns the row of a message by its timestamp and rowid.
+		 *
+		 * @param rowId rowid of the message or 0 for the newest message before
+		 * @p stamp
+		 */
+		int findRow(const QDateTime &stamp, qint64 rowId) const;
+
+		void insertMessage(int i, const MessageRow &msg);
+		void removeMessages(int first, int count);
+
+		/**
+		 * Adds a new message to a window that is not displayed.
+		 *
+		 * Messages newer than the loaded ones are not added.
+		 */
+		void addMessage(const MessageRow &msg);
+
+		/**
+		 * Sets whether a message is the first one of its day or of consecutive
+		 * messages from the same sender, depending on the next older message.
+		 *
+		 * @return whether the flags have changed
+		 */
+		bool updateGrouping(int i);
+
+		/**
+		 * Returns the approximate number of bytes used by the messages.
+		 */
+		int memoryUsage() const;
+
+		void addToIndex(const MessageRow &msg);
+		void removeFromIndex(const MessageRow &msg);
+
+		QString chatJid;
+		// ordered from the newest to the oldest message
+		QVector<MessageRow> messages;
+		// Timestamps of the messages by their IDs. The rows are found by a binary
+		// search for the timestamps, so that the index does not need to be updated
+		// when rows are inserted or removed in front of a message.
+		QMultiHash<QString, QDateTime> stampsById;
+		// newest visible message if the view is not scrolled to the newest one
+		QDateTime scrollStamp;
+		qint64 scrollRowId = 0;
+		// result of memoryUsage() when the window was cached
+		int cost = 0;
+		bool fetchedOldest = false;
+		bool fetchedNewest = true;
+	};
+
+	void requestFetch(PendingFetch &fetch, const QDateTime &stamp, qint64 rowId, MessageDb::FetchDirection direction, int limit);
+	PendingFetch &pendingFetch(MessageDb::FetchDirection direction);
+
+	/**
+	 * Cancels all pending fetches so that their results are ignored.
+	 */
+	void cancelFetches();
+
+	/**
+	 * Returns the number of rows the view scrolls past while messages are
+	 * fetched.
+	 */
+	int rowsScrolledPerFetch() const;
+
+	/**
+	 * Returns the number of messages to be fetched at once.
+	 */
+	int pageSize() const;
+
+	/**
+	 * Removes the newest or oldest messages if more than the maximum number
+	 * of messages are loaded.
+	 */
+	void removeDistantMessages(bool newest);
+
+	void setFetchedNewest(bool fetchedNewest);
+
+	/**
+	 * Puts the window of the current chat into the cache of recently opened
+	 * chats and removes the least recently opened ones exceeding its budget.
+	 */
+	void cacheWindow();
+
+	/**
+	 * Removes the window of a chat from the cache.
+	 *
+	 * @return the cached window or an empty one if the chat is not cached
+	 */
+	ChatWindow takeCachedWindow(const QString &chatJid);
+
+	/**
+	 * Starts the timer for applying the pending updates if it is not running.
+	 */
+	void scheduleUpdates();
+
+	/**
+	 * Inserts new messages of the current chat with one insertion per range of
+	 * consecutive rows.
+	 */
+	void insertMessages(const QVector<Message> &msgs);
+
+	/**
+	 * Applies patches to the messages of the current chat and emits one
+	 * dataChanged() per range of consecutive changed rows.
+	 */
+	void applyPatches(const QVector<QPair<QString, MessagePatch>> &patches);
+
+	void insertMessage(int i, const MessageRow &msg);
+	void removeMessage(int i);
+
+	/**
+	 * Updates the grouping flags of a message and emits dataChanged() if they
+	 * have changed.
+	 */
+	void refreshGrouping(int i);
+
+	/**
+	 * Completes the row of a message to be displayed by the attributes that
+	 * depend on the user's account.
+	 */
+	MessageRow createRow(MessageRow row);
+
+	/**
+	 * Returns a JID equal to @p jid that is shared by all rows.
+	 */
+	QString internJid(const QString &jid);
+
+	/**
+	 * Returns the roles whose values are changed by a patch.
+	 */
+	static QVector<int> changedRoles(const MessagePatch &patch);
+
+	static QVariant deliveryStateIcon(Enums::DeliveryState state);
+	static QVariant deliveryStateName(Enums::DeliveryState state);
 
 	MessageDb *m_msgDb;
 
-	QVector<Message> m_messages;
+	// window of the current chat
+	ChatWindow m_window;
+	// windows of recently opened chats, ordered from the most recently opened one
+	QVector<ChatWindow> m_cachedWindows;
+	// JIDs of the messages, shared by their rows
+	QSet<QString> m_jids;
 	QString m_currentChatJid;
-	bool m_fetchedAll = false;
+	QDateTime m_anchorStamp;
+	qint64 m_anchorRowId = 0;
+	PendingFetch m_olderFetch;
+	PendingFetch m_newerFetch;
+	PendingFetch m_aroundFetch;
+	int m_lastFetchRequestId = 0;
+	// average duration of fetches in milliseconds
+	qreal m_fetchLatency = 0;
+	// scroll speed in rows per second
+	qreal m_scrollVelocity = 0;
+	// new messages and patches of the current chat that are applied at once
+	QTimer *m_updateTimer;
+	QVector<Message> m_pendingMessages;
+	QVector<QPair<QString, MessagePatch>> m_pendingPatches;
 };
@@ -0,0 +1,151 @@
+/*
+ *  Kaidan - A user-friendly XMPP client for every device!
+ *
+ *  Copyright (C) 2016-2021 Kaidan developers and contributors
+ *  (see the LICENSE file for a full list of copyright authors)
+ *
+ *  Kaidan is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  In addition, as a special exception, the author of Kaidan gives
+ *  permission to link the code of its release with the OpenSSL
+ *  project's "OpenSSL" library (or with modified versions of it that
+ *  use the same license as the "OpenSSL" library), and distribute the
+ *  linked executables. You must obey the GNU General Public License in
+ *  all respects for all of the code used other than "OpenSSL". If you
+ *  modify this file, you may extend this exception to your version of
+ *  the file, but you are not obligated to do so.  If you do not wish to
+ *  do so, delete this exception statement from your version.
+ *
+ *  Kaidan is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kaidan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MessageRow.h"
+
+#include <QVariant>
+
+#include "Globals.h"
+#include "Message.h"
+#include "Utils.h"
+
+MessageRow::MessageRow(const Message &msg)
+	: rowId(msg.rowId()),
+	  id(msg.id()),
+	  from(msg.from()),
+	  to(msg.to()),
+	  replaceId(msg.replaceId()),
+	  spoilerHint(msg.spoilerHint()),
+	  errorText(msg.errorText()),
+	  outOfBandUrl(msg.outOfBandUrl()),
+	  mediaContentType(msg.mediaContentType()),
+	  mediaLocation(msg.mediaLocation()),
+	  mediaLastModified(msg.mediaLastModified()),
+	  mediaSize(msg.mediaSize()),
+	  mediaType(msg.mediaType()),
+	  deliveryState(msg.deliveryState()),
+	  sentByMe(msg.sentByMe()),
+	  isEdited(msg.isEdited()),
+	  isSpoiler(msg.isSpoiler())
+{
+	setStamp(msg.stamp());
+	setBody(msg.body());
+}
+
+Message MessageRow::toMessage() const
+{
+	Message msg;
+	msg.setRowId(rowId);
+	msg.setStamp(stamp);
+	msg.setId(id);
+	msg.setFrom(from);
+	msg.setTo(to);
+	msg.setBody(body);
+	msg.setReplaceId(replaceId);
+	msg.setSpoilerHint(spoilerHint);
+	msg.setErrorText(errorText);
+	msg.setOutOfBandUrl(outOfBandUrl);
+	msg.setMediaContentType(mediaContentType);
+	msg.setMediaLocation(mediaLocation);
+	msg.setMediaLastModified(mediaLastModified);
+	msg.setMediaSize(mediaSize);
+	msg.setMediaType(mediaType);
+	msg.setDeliveryState(deliveryState);
+	msg.setSentByMe(sentByMe);
+	msg.setIsEdited(isEdited);
+	msg.setIsSpoiler(isSpoiler);
+	msg.setReceiptRequested(true);
+	return msg;
+}
+
+QVariant MessageRow::data(int role) const
+{
+	switch (role) {
+	case Timestamp:
+		return stamp;
+	case Id:
+		return id;
+	case Sender:
+		return from;
+	case Recipient:
+		return to;
+	case Body:
+		return body;
+	case SentByMe:
+		return sentByMe;
+	case MediaType:
+		return QVariant::fromValue(mediaType);
+	case IsEdited:
+		return isEdited;
+	case DeliveryState:
+		return QVariant::fromValue(deliveryState);
+	case MediaUrl:
+		return outOfBandUrl;
+	case MediaLocation:
+		return mediaLocation;
+	case MediaContentType:
+		return mediaContentType;
+	case MediaSize:
+		return mediaSize;
+	case MediaLastModified:
+		return mediaLastModified;
+	case IsSpoiler:
+		return isSpoiler;
+	case SpoilerHint:
+		return spoilerHint;
+	case ErrorText:
+		return errorText;
+	case FormattedBody:
+		return formattedBody;
+	case FormattedTimestamp:
+		return formattedStamp;
+	case IsFirstOfDay:
+		return isFirstOfDay;
+	case IsFirstOfGroup:
+		return isFirstOfGroup;
+	}
+	return {};
+}
+
+void MessageRow::setStamp(const QDateTime &stamp)
+{
+	this->stamp = stamp;
+
+	const auto localStamp = stamp.toLocalTime();
+	day = localStamp.date();
+	formattedStamp = localStamp.toString(QStringLiteral("dd. MMM yyyy, hh:mm"));
+}
+
+void MessageRow::setBody(const QString &body)
+{
+	// Long messages are shortened to prevent DoS.
+	this->body = body.left(MESSAGE_MAX_CHARS);
+	formattedBody = Utils::formatMessageBody(this->body);
+}
@@ -0,0 +1,142 @@
+/*
+ *  Kaidan - A user-friendly XMPP client for every device!
+ *
+ *  Copyright (C) 2016-2021 Kaidan developers and contributors
+ *  (see the LICENSE file for a full list of copyright authors)
+ *
+ *  Kaidan is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  In addition, as a special exception, the author of Kaidan gives
+ *  permission to link the code of its release with the OpenSSL
+ *  project's "OpenSSL" library (or with modified versions of it that
+ *  use the same license as the "OpenSSL" library), and distribute the
+ *  linked executables. You must obey the GNU General Public License in
+ *  all respects for all of the code used other than "OpenSSL". If you
+ *  modify this file, you may extend this exception to your version of
+ *  the file, but you are not obligated to do so.  If you do not wish to
+ *  do so, delete this exception statement from your version.
+ *
+ *  Kaidan is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kaidan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QDate>
+#include <QDateTime>
+#include <QMetaType>
+#include <QString>
+
+#include "Enums.h"
+
+class Message;
+class QVariant;
+
+/**
+ * Attributes of a message as displayed by the MessageModel
+ *
+ * In contrast to Message, a row contains only the attributes that are read by
+ * the user interface or needed for correcting the message. Reading them does
+ * not copy the extensions of a QXmppMessage and does not allocate memory.
+ *
+ * The texts displayed for the body and the timestamp are created together with
+ * the row, which is done by the MessageDb for fetched messages, so that they
+ * are not created on the GUI thread while scrolling.
+ */
+struct MessageRow
+{
+	/**
+	 * Roles of the MessageModel
+	 */
+	enum Role {
+		Timestamp = Qt::UserRole + 1,
+		Id,
+		Sender,
+		Recipient,
+		Body,
+		SentByMe,
+		MediaType,
+		IsEdited,
+		DeliveryState,
+		MediaUrl,
+		MediaSize,
+		MediaContentType,
+		MediaLastModified,
+		MediaLocation,
+		MediaThumb,
+		IsSpoiler,
+		SpoilerHint,
+		ErrorText,
+		DeliveryStateIcon,
+		DeliveryStateName,
+		FormattedBody,
+		FormattedTimestamp,
+		IsFirstOfDay,
+		IsFirstOfGroup
+	};
+
+	MessageRow() = default;
+	explicit MessageRow(const Message &msg);
+
+	/**
+	 * Creates a message with the attributes of this row.
+	 */
+	Message toMessage() const;
+
+	/**
+	 * Returns the value of a role of the MessageModel.
+	 *
+	 * The roles that are derived from the delivery state are provided by the
+	 * model itself.
+	 */
+	QVariant data(int role) const;
+
+	/**
+	 * Sets the timestamp and the date and text displayed for it.
+	 */
+	void setStamp(const QDateTime &stamp);
+
+	/**
+	 * Sets the body shortened to MESSAGE_MAX_CHARS and its formatted text.
+	 */
+	void setBody(const QString &body);
+
+	qint64 rowId = 0;
+	// set by setStamp()
+	QDateTime stamp;
+	QDate day;
+	QString formattedStamp;
+	QString id;
+	QString from;
+	QString to;
+	// set by setBody()
+	QString body;
+	QString formattedBody;
+	QString replaceId;
+	QString spoilerHint;
+	QString errorText;
+	QString outOfBandUrl;
+	QString mediaContentType;
+	QString mediaLocation;
+	QDateTime mediaLastModified;
+	qint64 mediaSize = 0;
+	Enums::MessageType mediaType = Enums::MessageType::MessageText;
+	Enums::DeliveryState deliveryState = Enums::DeliveryState::Delivered;
+	bool sentByMe = false;
+	bool isEdited = false;
+	bool isSpoiler = false;
+
+	// set by the MessageModel depending on the next older message
+	bool isFirstOfDay = true;
+	bool isFirstOfGroup = true;
+};
+
+Q_DECLARE_METATYPE(MessageRow)
@@ -0,0 +1,158 @@
+/*
+ *  Kaidan - A user-friendly XMPP client for every device!
+ *
+ *  Copyright (C) 2016-2021 Kaidan developers and contributors
+ *  (see the LICENSE file for a full list of copyright authors)
+ *
+ *  Kaidan is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  In addition, as a special exception, the author of Kaidan gives
+ *  permission to link the code of its release with the OpenSSL
+ *  project's "OpenSSL" library (or with modified versions of it that
+ *  use the same license as the "OpenSSL" library), and distribute the
+ *  linked executables. You must obey the GNU General Public License in
+ *  all respects for all of the code used other than "OpenSSL". If you
+ *  modify this file, you may extend this exception to your version of
+ *  the file, but you are not obligated to do so.  If you do not wish to
+ *  do so, delete this exception statement from your version.
+ *
+ *  Kaidan is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kaidan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "MessageSearchModel.h"
+
+#include "AccountManager.h"
+
+int MessageSearchModel::s_lastRequestId = 0;
+
+MessageSearchModel::MessageSearchModel(QObject *parent)
+	: QAbstractListModel(parent)
+{
+	connect(MessageDb::instance(), &MessageDb::messagesFound,
+	        this, &MessageSearchModel::handleMessagesFound);
+	connect(MessageDb::instance(), &MessageDb::messageSearchFinished,
+	        this, &MessageSearchModel::handleMessageSearchFinished);
+}
+
+QHash<int, QByteArray> MessageSearchModel::roleNames() const
+{
+	return {
+		{RowId, QByteArrayLiteral("rowId")},
+		{Id, QByteArrayLiteral("id")},
+		{ChatJid, QByteArrayLiteral("chatJid")},
+		{Sender, QByteArrayLiteral("sender")},
+		{Timestamp, QByteArrayLiteral("timestamp")},
+		{Snippet, QByteArrayLiteral("snippet")},
+		{SentByMe, QByteArrayLiteral("sentByMe")}
+	};
+}
+
+QVariant MessageSearchModel::data(const QModelIndex &index, int role) const
+{
+	Q_ASSERT(checkIndex(index, QAbstractItemModel::CheckIndexOption::IndexIsValid | QAbstractItemModel::CheckIndexOption::ParentIsInvalid));
+
+	const auto &result = m_results.at(index.row());
+	const bool sentByMe = result.from == AccountManager::instance()->jid();
+
+	switch(role) {
+	case RowId:
+		return result.rowId;
+	case Id:
+		return result.id;
+	case ChatJid:
+		return sentByMe ? result.to : result.from;
+	case Sender:
+		return result.from;
+	case Timestamp:
+		return result.stamp;
+	case Snippet:
+		return result.snippet;
+	case SentByMe:
+		return sentByMe;
+	}
+
+	Q_UNREACHABLE();
+}
+
+int MessageSearchModel::rowCount(const QModelIndex &parent) const
+{
+	if (parent.isValid())
+		return 0;
+
+	return m_results.count();
+}
+
+QString MessageSearchModel::chatJid() const
+{
+	return m_chatJid;
+}
+
+void MessageSearchModel::setChatJid(const QString &chatJid)
+{
+	if (m_chatJid != chatJid) {
+		m_chatJid = chatJid;
+		clear();
+		emit chatJidChanged();
+	}
+}
+
+bool MessageSearchModel::searching() const
+{
+	return m_searching;
+}
+
+void MessageSearchModel::search(const QString &searchText)
+{
+	clear();
+
+	m_requestId = ++s_lastRequestId;
+	setSearching(true);
+
+	emit MessageDb::instance()->searchMessagesRequested(m_requestId, AccountManager::instance()->jid(), m_chatJid, searchText);
+}
+
+void MessageSearchModel::clear()
+{
+	// results of a running search are ignored from now on
+	m_requestId = 0;
+	setSearching(false);
+
+	if (!m_results.isEmpty()) {
+		beginResetModel();
+		m_results.clear();
+		endResetModel();
+	}
+}
+
+void MessageSearchModel::handleMessagesFound(int requestId, const QVector<MessageSearchResult> &results)
+{
+	if (requestId != m_requestId)
+		return;
+
+	beginInsertRows({}, m_results.count(), m_results.count() + results.count() - 1);
+	m_results.append(results);
+	endInsertRows();
+}
+
+void MessageSearchModel::handleMessageSearchFinished(int requestId)
+{
+	if (requestId == m_requestId)
+		setSearching(false);
+}
+
+void MessageSearchModel::setSearching(bool searching)
+{
+	if (m_searching != searching) {
+		m_searching = searching;
+		emit searchingChanged();
+	}
+}
@@ -0,0 +1,110 @@
+/*
+ *  Kaidan - A user-friendly XMPP client for every device!
+ *
+ *  Copyright (C) 2016-2021 Kaidan developers and contributors
+ *  (see the LICENSE file for a full list of copyright authors)
+ *
+ *  Kaidan is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  In addition, as a special exception, the author of Kaidan gives
+ *  permission to link the code of its release with the OpenSSL
+ *  project's "OpenSSL" library (or with modified versions of it that
+ *  use the same license as the "OpenSSL" library), and distribute the
+ *  linked executables. You must obey the GNU General Public License in
+ *  all respects for all of the code used other than "OpenSSL". If you
+ *  modify this file, you may extend this exception to your version of
+ *  the file, but you are not obligated to do so.  If you do not wish to
+ *  do so, delete this exception statement from your version.
+ *
+ *  Kaidan is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kaidan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+#include <QAbstractListModel>
+#include <QVector>
+
+#include "MessageDb.h"
+
+/**
+ * Results of a full-text search in the messages of one chat or of all chats
+ *
+ * The search is run by the MessageDb on the database thread. The results are
+ * appended in batches ordered by relevance while they arrive.
+ */
+class MessageSearchModel : public QAbstractListModel
+{
+	Q_OBJECT
+
+	Q_PROPERTY(QString chatJid READ chatJid WRITE setChatJid NOTIFY chatJidChanged)
+	Q_PROPERTY(bool searching READ searching NOTIFY searchingChanged)
+
+public:
+	enum Roles {
+		RowId = Qt::UserRole + 1,
+		Id,
+		ChatJid,
+		Sender,
+		Timestamp,
+		Snippet,
+		SentByMe
+	};
+	Q_ENUM(Roles)
+
+	explicit MessageSearchModel(QObject *parent = nullptr);
+
+	QHash<int, QByteArray> roleNames() const override;
+	QVariant data(const QModelIndex &index, int role) const override;
+	int rowCount(const QModelIndex &parent = QModelIndex()) const override;
+
+	/**
+	 * JID of the chat to search in or an empty string for searching in all chats
+	 */
+	QString chatJid() const;
+	void setChatJid(const QString &chatJid);
+
+	/**
+	 * Whether results of the current search are still being loaded
+	 */
+	bool searching() const;
+
+	/**
+	 * Starts a new search and replaces the results of a previous one.
+	 *
+	 * @param searchText words that have to be contained in the found messages,
+	 * each as a prefix of a word in the message
+	 */
+	Q_INVOKABLE void search(const QString &searchText);
+
+	/**
+	 * Removes all results and ignores the results of a running search.
+	 */
+	Q_INVOKABLE void clear();
+
+signals:
+	void chatJidChanged();
+	void searchingChanged();
+
+private slots:
+	void handleMessagesFound(int requestId, const QVector<MessageSearchResult> &results);
+	void handleMessageSearchFinished(int requestId);
+
+private:
+	void setSearching(bool searching);
+
+	static int s_lastRequestId;
+
+	QString m_chatJid;
+	QVector<MessageSearchResult> m_results;
+	int m_requestId = 0;
+	bool m_searching = false;
+};
@@ -42,6 +42,8 @@
 #include <QUrl>
 // QXmpp
 #include "qxmpp-exts/QXmppColorGenerator.h"
+// Kaidan
+#include "Utils.h"
 
 static QmlUtils *s_instance;
 
@@ -161,9 +163,7 @@ QString QmlUtils::fileSizeFromUrl(const QUrl &url)
 
 QString QmlUtils::formatMessage(const QString &message)
 {
-	// escape all special XML chars (like '<' and '>')
-	// and spilt into words for processing
-	return processMsgFormatting(message.toHtmlEscaped().split(" "));
+	return Utils::formatMessageBody(message);
 }
 
 QColor QmlUtils::getUserColor(const QString &nickName)
@@ -217,21 +217,3 @@ QString QmlUtils::timestampForFileName(const QDateTime &dateTime)
 {
 	return dateTime.toString(u"yyyyMMdd_hhmmss");
 }
-
-QString QmlUtils::processMsgFormatting(const QStringList &list, bool isFirst)
-{
-	if (list.isEmpty())
-		return QString();
-
-	// link highlighting
-	if (list.first().startsWith("https://") || list.first().startsWith("http://"))
-		return (isFirst ? QString() : " ") + QString("<a href='%1'>%1</a>").arg(list.first())
-		       + processMsgFormatting(list.mid(1), false);
-
-	// preserve newlines
-	if (list.first().contains("\n"))
-		return (isFirst ? QString() : " ") + QString(list.first()).replace("\n", "<br>")
-		       + processMsgFormatting(list.mid(1), false);
-
-	return (isFirst ? QString() : " ") + list.first() + processMsgFormatting(list.mid(1), false);
-}
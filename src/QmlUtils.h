@@ -163,10 +163,4 @@ public:
 	 * Returns the timestamp in a format for file names.
 	 */
 	static QString timestampForFileName(const QDateTime &dateTime = QDateTime::currentDateTime());
-
-private:
-	/**
-	 * Highlights links in a list of words
-	 */
-	static QString processMsgFormatting(const QStringList &words, bool isFirst = true);
 };
@@ -35,7 +35,6 @@
 #include "Utils.h"
 #include "RosterItem.h"
 #include "Message.h"
-#include "MessageDb.h"
 // Qt
 #include <QSqlDriver>
 #include <QSqlField>
@@ -51,8 +50,24 @@ RosterDb::RosterDb(Database *db, QObject *parent)
 	Q_ASSERT(!RosterDb::s_instance);
 	s_instance = this;
 
-	connect(this, &RosterDb::fetchItemsRequested, this, &RosterDb::fetchItems);
+	// items are fetched by the read-only connection
+	connect(this, &RosterDb::fetchItemsRequested, db->readContext(), [this](const QString &accountId) {
+		m_db->readAfterBatch([this, accountId]() {
+			fetchItems(accountId);
+		});
+	});
+	connect(this, &RosterDb::fetchVersionRequested, db->readContext(), [this]() {
+		m_db->readAfterBatch([this]() {
+			fetchVersion();
+		});
+	});
+	connect(this, &RosterDb::fetchCachedItemsRequested, db->readContext(), [this]() {
+		m_db->readAfterBatch([this]() {
+			fetchCachedItems();
+		});
+	});
 	connect(this, &RosterDb::updateItemRequested, this, &RosterDb::updateItem);
+	connect(this, &RosterDb::setVersionRequested, this, &RosterDb::setVersion);
 }
 
 RosterDb::~RosterDb()
@@ -71,12 +86,15 @@ void RosterDb::parseItemsFromQuery(QSqlQuery &query, QVector<RosterItem> &items)
 	int idxJid = rec.indexOf("jid");
 	int idxName = rec.indexOf("name");
 	int idxUnreadMessages = rec.indexOf("unreadMessages");
+	int idxSubscription = rec.indexOf("subscription");
 
 	while (query.next()) {
 		RosterItem item;
 		item.setJid(query.value(idxJid).toString());
 		item.setName(query.value(idxName).toString());
 		item.setUnreadMessages(query.value(idxUnreadMessages).toInt());
+		if (!query.isNull(idxSubscription))
+			item.setSubscription(QXmppRosterIq::Item::SubscriptionType(query.value(idxSubscription).toInt()));
 
 		items << item;
 	}
@@ -94,6 +112,8 @@ QSqlRecord RosterDb::createUpdateRecord(const RosterItem &oldItem, const RosterI
 			"unreadMessages",
 			newItem.unreadMessages()
 		));
+	if (oldItem.subscription() != newItem.subscription())
+		rec.append(Utils::createSqlField("subscription", int(newItem.subscription())));
 	return rec;
 }
 
@@ -107,20 +127,22 @@ void RosterDb::addItems(const QVector<RosterItem> &items)
 	QSqlDatabase db = QSqlDatabase::database(DB_CONNECTION);
 	m_db->transaction();
 
+	// An item may already be stored, e.g., if a roster push is received while
+	// the roster is replaced. In that case, only its roster attributes are
+	// updated.
 	QSqlQuery query(db);
-	Utils::prepareQuery(query, db.driver()->sqlStatement(
-		QSqlDriver::InsertStatement,
-		DB_TABLE_ROSTER,
-		db.record(DB_TABLE_ROSTER),
-		true
-	));
+	Utils::prepareQuery(
+		query,
+		"INSERT INTO " DB_TABLE_ROSTER " (jid, name, lastExchanged, unreadMessages, lastMessage, subscription) "
+		"VALUES (?, ?, '', ?, NULL, ?) "
+		"ON CONFLICT(jid) DO UPDATE SET name = excluded.name, subscription = excluded.subscription"
+	);
 
 	for (const auto &item : items) {
 		query.addBindValue(item.jid());
 		query.addBindValue(item.name());
-		query.addBindValue(QStringLiteral("")); // lastExchanged (NOT NULL)
 		query.addBindValue(item.unreadMessages());
-		query.addBindValue(QString()); // lastMessage
+		query.addBindValue(int(item.subscription()));
 		Utils::execQuery(query);
 	}
 
@@ -175,9 +197,10 @@ void RosterDb::updateItem(const QString &jid,
 			                QSqlDriver::UpdateStatement,
 			                DB_TABLE_ROSTER,
 			                rec,
-			                false
+			                true
 			        ) +
-			        Utils::simpleWhereStatement(db.driver(), "jid", jid)
+			        QStringLiteral(" WHERE jid = ?"),
+			        Utils::recordValues(rec) << jid
 			);
 		}
 	}
@@ -185,46 +208,46 @@ void RosterDb::updateItem(const QString &jid,
 
 void RosterDb::replaceItems(const QHash<QString, RosterItem> &items)
 {
-	// load current items
 	QSqlDatabase db = QSqlDatabase::database(DB_CONNECTION);
 	QSqlQuery query(db);
-	query.setForwardOnly(true);
-	Utils::execQuery(query, "SELECT * FROM Roster");
-
-	QVector<RosterItem> currentItems;
-	parseItemsFromQuery(query, currentItems);
 
 	m_db->transaction();
 
-#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
-	QList<QString> keys = items.keys();
-	QSet<QString> newJids = QSet<QString>(keys.begin(), keys.end());
-#else
-	QSet<QString> newJids = items.keys().toSet();
-#endif
-
-	for (const auto &oldItem : qAsConst(currentItems)) {
-		// We will remove the already existing JIDs, so we get a set of JIDs that
-		// are completely new.
-		//
-		// By calling remove(), we also find out whether the JID is already
-		// existing or not.
-		if (newJids.remove(oldItem.jid())) {
-			// item is also included in newJids -> update
-
-			// name is (currently) the only attribute that is defined by the
-			// XMPP roster and so could cause a change
-			if (oldItem.name() != items[oldItem.jid()].name())
-				setItemName(oldItem.jid(), items[oldItem.jid()].name());
-		} else {
-			// item is not included in newJids -> delete
-			removeItem(oldItem.jid());
-		}
+	// name and subscription are (currently) the only stored attributes that
+	// are defined by the XMPP roster and so could cause a change
+	Utils::prepareQuery(
+		query,
+		"INSERT INTO " DB_TABLE_ROSTER " (jid, name, lastExchanged, unreadMessages, lastMessage, subscription) "
+		"VALUES (?, ?, '', ?, NULL, ?) "
+		"ON CONFLICT(jid) DO UPDATE SET name = excluded.name, subscription = excluded.subscription "
+		"WHERE name IS NOT excluded.name OR subscription IS NOT excluded.subscription"
+	);
+	for (const auto &item : items) {
+		query.addBindValue(item.jid());
+		query.addBindValue(item.name());
+		query.addBindValue(item.unreadMessages());
+		query.addBindValue(int(item.subscription()));
+		Utils::execQuery(query);
+	}
+
+	// The JIDs of the new items are written to a temporary table, so that the
+	// items that are not included anymore can be removed by one statement.
+	// The table only exists until the roster is replaced.
+	Utils::execQuery(query, "CREATE TEMPORARY TABLE roster_replacement (jid TEXT NOT NULL PRIMARY KEY)");
+
+	Utils::prepareQuery(query, "INSERT INTO roster_replacement (jid) VALUES (?)");
+	for (const auto &item : items) {
+		query.addBindValue(item.jid());
+		Utils::execQuery(query);
 	}
 
-	// now add the completely new JIDs
-	for (const QString &jid : newJids)
-		addItem(items[jid]);
+	Utils::execQuery(
+		query,
+		"DELETE FROM " DB_TABLE_ROSTER " "
+		"WHERE jid NOT IN (SELECT jid FROM roster_replacement)"
+	);
+
+	Utils::execQuery(query, "DROP TABLE roster_replacement");
 
 	m_db->commit();
 }
@@ -243,9 +266,20 @@ void RosterDb::setItemName(const QString &jid, const QString &name)
 			QSqlDriver::UpdateStatement,
 			DB_TABLE_ROSTER,
 			rec,
-			false
+			true
 		) +
-		Utils::simpleWhereStatement(db.driver(), "jid", jid)
+		QStringLiteral(" WHERE jid = ?"),
+		Utils::recordValues(rec) << jid
+	);
+}
+
+void RosterDb::setVersion(const QString &version)
+{
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	Utils::execQuery(
+		query,
+		"UPDATE " DB_TABLE_INFO " SET rosterVersion = ?",
+		QVector<QVariant>() << version
 	);
 }
 
@@ -253,22 +287,104 @@ void RosterDb::clearAll()
 {
 	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
 	Utils::execQuery(query, "DELETE FROM Roster");
+	// the roster needs to be requested completely again
+	Utils::execQuery(query, "UPDATE " DB_TABLE_INFO " SET rosterVersion = NULL");
 }
 
 void RosterDb::fetchItems(const QString &accountId)
 {
-	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION_READ));
 	query.setForwardOnly(true);
-	Utils::execQuery(query, "SELECT * FROM Roster");
 
-	QVector<RosterItem> items;
-	parseItemsFromQuery(query, items);
+	// The last message of each chat is looked up in the same query by the
+	// latest message of each direction.
+	Utils::execQuery(
+		query,
+		"SELECT r.*, "
+			"m.timestamp AS lastMessageTimestamp, m.message AS lastMessageBody, "
+			"m.type AS lastMessageType, m.isSpoiler AS lastMessageIsSpoiler, "
+			"m.spoilerHint AS lastMessageSpoilerHint "
+		"FROM " DB_TABLE_ROSTER " r "
+		"LEFT JOIN " DB_TABLE_MESSAGES " m ON m.rowid = ("
+			"SELECT rowid FROM ("
+				"SELECT * FROM ("
+					"SELECT rowid, timestamp FROM " DB_TABLE_MESSAGES " "
+					"WHERE author = :accountJid AND recipient = r.jid "
+					"ORDER BY timestamp DESC, rowid DESC LIMIT 1"
+				") UNION ALL SELECT * FROM ("
+					"SELECT rowid, timestamp FROM " DB_TABLE_MESSAGES " "
+					"WHERE author = r.jid AND recipient = :accountJid "
+					"ORDER BY timestamp DESC, rowid DESC LIMIT 1"
+				")"
+			") ORDER BY timestamp DESC, rowid DESC LIMIT 1"
+		")",
+		QMap<QString, QVariant> { { QStringLiteral(":accountJid"), accountId } }
+	);
+
+	QSqlRecord rec = query.record();
+	int idxJid = rec.indexOf("jid");
+	int idxName = rec.indexOf("name");
+	int idxUnreadMessages = rec.indexOf("unreadMessages");
+	int idxSubscription = rec.indexOf("subscription");
+	int idxLastMessageTimestamp = rec.indexOf("lastMessageTimestamp");
+	int idxLastMessageBody = rec.indexOf("lastMessageBody");
+	int idxLastMessageType = rec.indexOf("lastMessageType");
+	int idxLastMessageIsSpoiler = rec.indexOf("lastMessageIsSpoiler");
+	int idxLastMessageSpoilerHint = rec.indexOf("lastMessageSpoilerHint");
 
-	for (auto &item : items) {
-		Message lastMessage = MessageDb::instance()->fetchLastMessage(accountId, item.jid());
+	QVector<RosterItem> items;
+	while (query.next()) {
+		RosterItem item;
+		item.setJid(query.value(idxJid).toString());
+		item.setName(query.value(idxName).toString());
+		item.setUnreadMessages(query.value(idxUnreadMessages).toInt());
+		if (!query.isNull(idxSubscription))
+			item.setSubscription(QXmppRosterIq::Item::SubscriptionType(query.value(idxSubscription).toInt()));
+
+		// only the attributes needed for the preview text are loaded
+		Message lastMessage;
+		if (!query.isNull(idxLastMessageTimestamp)) {
+			lastMessage.setStamp(QDateTime::fromMSecsSinceEpoch(
+				query.value(idxLastMessageTimestamp).toLongLong(),
+				Qt::UTC
+			));
+			lastMessage.setBody(query.value(idxLastMessageBody).toString());
+			lastMessage.setMediaType(static_cast<MessageType>(query.value(idxLastMessageType).toInt()));
+			lastMessage.setIsSpoiler(query.value(idxLastMessageIsSpoiler).toBool());
+			lastMessage.setSpoilerHint(query.value(idxLastMessageSpoilerHint).toString());
+		}
 		item.setLastExchanged(lastMessage.stamp());
 		item.setLastMessage(lastMessage.previewText());
+
+		items << item;
 	}
 
 	emit itemsFetched(items);
 }
+
+void RosterDb::fetchVersion()
+{
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION_READ));
+	query.setForwardOnly(true);
+	Utils::execQuery(query, "SELECT rosterVersion FROM " DB_TABLE_INFO);
+
+	QString version;
+	if (query.next())
+		version = query.value(0).toString();
+	// the statement would otherwise stay active and keep its read snapshot
+	query.finish();
+
+	emit versionFetched(version);
+}
+
+void RosterDb::fetchCachedItems()
+{
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION_READ));
+	query.setForwardOnly(true);
+	Utils::execQuery(query, "SELECT jid, name, unreadMessages, subscription FROM " DB_TABLE_ROSTER);
+
+	QVector<RosterItem> items;
+	parseItemsFromQuery(query, items);
+
+	emit cachedItemsFetched(items);
+}
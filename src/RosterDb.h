@@ -65,6 +65,35 @@ signals:
 	void updateItemRequested(const QString &jid,
 	                         const std::function<void (RosterItem &)> &updateItem);
 
+	/**
+	 * Can be used to trigger fetchVersion()
+	 */
+	void fetchVersionRequested();
+
+	/**
+	 * Emitted when the version of the stored roster has been fetched
+	 *
+	 * @param version version or an empty string if the roster has no version
+	 */
+	void versionFetched(const QString &version);
+
+	/**
+	 * Can be used to trigger setVersion()
+	 */
+	void setVersionRequested(const QString &version);
+
+	/**
+	 * Can be used to trigger fetchCachedItems()
+	 */
+	void fetchCachedItemsRequested();
+
+	/**
+	 * Emitted when the items of the stored roster have been fetched
+	 *
+	 * Only the attributes defined by the XMPP roster are set.
+	 */
+	void cachedItemsFetched(const QVector<RosterItem> &items);
+
 public slots:
 	void addItem(const RosterItem &item);
 	void addItems(const QVector<RosterItem> &items);
@@ -73,11 +102,32 @@ public slots:
 	                const std::function<void (RosterItem &)> &updateItem);
 	void replaceItems(const QHash<QString, RosterItem> &items);
 	void setItemName(const QString &jid, const QString &name);
+
+	/**
+	 * Stores the version of the roster received from the server (XEP-0237:
+	 * Roster Versioning).
+	 */
+	void setVersion(const QString &version);
+
 	void clearAll();
 
 private slots:
 	void fetchItems(const QString &accountId);
 
+	/**
+	 * Fetches the version of the stored roster and emits versionFetched().
+	 *
+	 * This must be called on the thread of the read-only connection.
+	 */
+	void fetchVersion();
+
+	/**
+	 * Fetches the stored roster items and emits cachedItemsFetched().
+	 *
+	 * This must be called on the thread of the read-only connection.
+	 */
+	void fetchCachedItems();
+
 private:
 	Database *m_db;
 
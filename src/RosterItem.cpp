@@ -31,7 +31,7 @@
 #include "RosterItem.h"
 
 RosterItem::RosterItem(const QXmppRosterIq::Item &item, const QDateTime &dateTime)
-	: m_jid(item.bareJid()), m_name(item.name()), m_lastExchanged(dateTime)
+	: m_jid(item.bareJid()), m_name(item.name()), m_lastExchanged(dateTime), m_subscription(item.subscriptionType())
 {
 }
 
@@ -85,6 +85,16 @@ void RosterItem::setLastMessage(const QString &lastMessage)
 	m_lastMessage = lastMessage;
 }
 
+QXmppRosterIq::Item::SubscriptionType RosterItem::subscription() const
+{
+	return m_subscription;
+}
+
+void RosterItem::setSubscription(QXmppRosterIq::Item::SubscriptionType subscription)
+{
+	m_subscription = subscription;
+}
+
 QString RosterItem::displayName() const
 {
 	return m_name.isEmpty() ? m_jid : m_name;
@@ -96,7 +106,8 @@ bool RosterItem::operator==(const RosterItem &other) const
 	       m_name == other.name() &&
 	       m_lastMessage == other.lastMessage() &&
 	       m_lastExchanged == other.lastExchanged() &&
-	       m_unreadMessages == other.unreadMessages();
+	       m_unreadMessages == other.unreadMessages() &&
+	       m_subscription == other.subscription();
 }
 
 bool RosterItem::operator!=(const RosterItem &other) const
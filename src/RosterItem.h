@@ -57,6 +57,9 @@ public:
 	QString lastMessage() const;
 	void setLastMessage(const QString &lastMessage);
 
+	QXmppRosterIq::Item::SubscriptionType subscription() const;
+	void setSubscription(QXmppRosterIq::Item::SubscriptionType subscription);
+
 	QString displayName() const;
 
 	bool operator==(const RosterItem &other) const;
@@ -93,4 +96,10 @@ private:
 	 * Last message of the conversation.
 	 */
 	QString m_lastMessage;
+
+	/**
+	 * Subscription state of the contact, cached for requesting only changes of
+	 * the roster.
+	 */
+	QXmppRosterIq::Item::SubscriptionType m_subscription = QXmppRosterIq::Item::NotSet;
 };
@@ -31,7 +31,9 @@
 #include "RosterManager.h"
 // Kaidan
 #include "Kaidan.h"
+#include "RosterDb.h"
 #include "VCardManager.h"
+#include "qxmpp-exts/QXmppRosterVersionManager.h"
 // QXmpp
 #include <QXmppClient.h>
 #include <QXmppRosterManager.h>
@@ -46,10 +48,30 @@ RosterManager::RosterManager(QXmppClient *client,
 	  m_model(model),
 	  m_avatarStorage(avatarStorage),
 	  m_vCardManager(vCardManager),
-	  m_manager(client->findExtension<QXmppRosterManager>())
+	  m_manager(client->findExtension<QXmppRosterManager>()),
+	  m_versionManager(new QXmppRosterVersionManager)
 {
-	connect(m_manager, &QXmppRosterManager::rosterReceived,
-	        this, &RosterManager::populateRoster);
+	// The version manager must handle the roster stanzas before the roster
+	// manager.
+	client->insertExtension(0, m_versionManager);
+
+	// Only the changes since the stored roster are requested, see XEP-0237:
+	// Roster Versioning.
+	connect(client, &QXmppClient::connected, this, [] {
+		emit RosterDb::instance()->fetchVersionRequested();
+	});
+	connect(RosterDb::instance(), &RosterDb::versionFetched,
+	        m_versionManager, &QXmppRosterVersionManager::requestRoster);
+
+	connect(m_versionManager, &QXmppRosterVersionManager::rosterReceived,
+	        this, &RosterManager::handleRosterReceived);
+	connect(m_versionManager, &QXmppRosterVersionManager::storedRosterUpToDate, this, [] {
+		emit RosterDb::instance()->fetchCachedItemsRequested();
+	});
+	connect(RosterDb::instance(), &RosterDb::cachedItemsFetched,
+	        this, &RosterManager::loadCachedRoster);
+	connect(m_versionManager, &QXmppRosterVersionManager::versionChanged,
+	        RosterDb::instance(), &RosterDb::setVersionRequested);
 
 	connect(m_manager, &QXmppRosterManager::itemAdded,
 		this, [this, vCardManager, model] (const QString &jid) {
@@ -60,8 +82,10 @@ RosterManager::RosterManager(QXmppClient *client,
 
 	connect(m_manager, &QXmppRosterManager::itemChanged,
 		this, [this, model] (const QString &jid) {
+		const auto entry = m_manager->getRosterEntry(jid);
 		emit model->updateItemRequested(jid, [=] (RosterItem &item) {
-			item.setName(m_manager->getRosterEntry(jid).name());
+			item.setName(entry.name());
+			item.setSubscription(entry.subscriptionType());
 		});
 	});
 
@@ -101,15 +125,47 @@ void RosterManager::populateRoster()
 	const auto currentTime = QDateTime::currentDateTimeUtc();
 	for (const auto &jid : bareJids) {
 		items[jid] = RosterItem(m_manager->getRosterEntry(jid), currentTime);
-
-		if (m_avatarStorage->getHashOfJid(jid).isEmpty())
-			m_vCardManager->requestVCard(jid);
+		requestMissingAvatar(jid);
 	}
 
 	// replace current contacts with new ones from server
 	emit m_model->replaceItemsRequested(items);
 }
 
+void RosterManager::handleRosterReceived(const QString &version)
+{
+	populateRoster();
+
+	// The version is stored after the items, so that it never belongs to a
+	// newer roster than the stored one.
+	emit RosterDb::instance()->setVersionRequested(version);
+}
+
+void RosterManager::loadCachedRoster(const QVector<RosterItem> &items)
+{
+	qDebug() << "[client] [RosterManager] Stored roster is up to date";
+
+	QList<QXmppRosterIq::Item> rosterItems;
+	rosterItems.reserve(items.size());
+	for (const auto &item : items) {
+		QXmppRosterIq::Item rosterItem;
+		rosterItem.setBareJid(item.jid());
+		rosterItem.setName(item.name());
+		rosterItem.setSubscriptionType(item.subscription());
+		rosterItems << rosterItem;
+
+		requestMissingAvatar(item.jid());
+	}
+
+	m_versionManager->loadStoredRoster(rosterItems);
+}
+
+void RosterManager::requestMissingAvatar(const QString &jid)
+{
+	if (m_avatarStorage->getHashOfJid(jid).isEmpty())
+		m_vCardManager->requestVCard(jid);
+}
+
 void RosterManager::addContact(const QString &jid, const QString &name, const QString &msg)
 {
 	if (m_client->state() == QXmppClient::ConnectedState) {
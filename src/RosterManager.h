@@ -35,8 +35,10 @@
 // QXmpp
 class QXmppClient;
 class QXmppRosterManager;
+class QXmppRosterVersionManager;
 // Kaidan
 class AvatarFileStorage;
+class RosterItem;
 class RosterModel;
 class VCardManager;
 
@@ -57,10 +59,26 @@ public slots:
 private slots:
 	void populateRoster();
 
+	/**
+	 * Replaces the stored roster by the whole roster received from the server.
+	 */
+	void handleRosterReceived(const QString &version);
+
+	/**
+	 * Loads the stored roster into the QXmppRosterManager if it is up to date.
+	 */
+	void loadCachedRoster(const QVector<RosterItem> &items);
+
 private:
+	/**
+	 * Requests the vCard of a contact if its avatar is not stored.
+	 */
+	void requestMissingAvatar(const QString &jid);
+
 	QXmppClient *m_client;
 	RosterModel *m_model;
 	AvatarFileStorage *m_avatarStorage;
 	VCardManager *m_vCardManager;
 	QXmppRosterManager *m_manager;
+	QXmppRosterVersionManager *m_versionManager;
 };
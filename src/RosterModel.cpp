@@ -30,16 +30,29 @@
 
 #include "RosterModel.h"
 
+// std
+#include <algorithm>
+#include <utility>
+// Qt
+#include <QTimer>
 // Kaidan
 #include "AccountManager.h"
 #include "RosterDb.h"
 #include "MessageModel.h"
 #include "Kaidan.h"
 
+// defines how long changes by new messages are collected before they are applied at once (in ms)
+constexpr int UPDATE_BATCH_INTERVAL = 16;
+
 RosterModel::RosterModel(RosterDb *rosterDb, QObject *parent)
         : QAbstractListModel(parent),
-	  m_rosterDb(rosterDb)
+	  m_rosterDb(rosterDb),
+	  m_updateTimer(new QTimer(this))
 {
+	m_updateTimer->setSingleShot(true);
+	m_updateTimer->setInterval(UPDATE_BATCH_INTERVAL);
+	connect(m_updateTimer, &QTimer::timeout, this, &RosterModel::applyPendingChanges);
+
 	connect(rosterDb, &RosterDb::itemsFetched,
 		this, &RosterModel::handleItemsFetched);
 
@@ -62,8 +75,11 @@ RosterModel::RosterModel(RosterDb *rosterDb, QObject *parent)
 		rosterDb, &RosterDb::replaceItems);
 
 	connect(AccountManager::instance(), &AccountManager::jidChanged, this, [=]() {
+		applyPendingChanges();
+
 		beginResetModel();
 		m_items.clear();
+		m_rowsByJid.clear();
 		endResetModel();
 
 		emit rosterDb->fetchItemsRequested(AccountManager::instance()->jid());
@@ -128,14 +144,23 @@ QVariant RosterModel::data(const QModelIndex &index, int role) const
 
 std::optional<const RosterItem> RosterModel::findItem(const QString &jid) const
 {
-	for (const auto &item : qAsConst(m_items)) {
-		if (item.jid() == jid)
-			return item;
-	}
+	if (const int i = itemRow(jid); i != -1)
+		return m_items.at(i);
 
 	return std::nullopt;
 }
 
+int RosterModel::itemRow(const QString &jid) const
+{
+	return m_rowsByJid.value(jid, -1);
+}
+
+void RosterModel::updateRowIndex(int first, int last)
+{
+	for (int i = first; i <= last; i++)
+		m_rowsByJid.insert(m_items.at(i).jid(), i);
+}
+
 QString RosterModel::itemName(const QString &jid) const
 {
 	if (auto item = findItem(jid))
@@ -145,75 +170,78 @@ QString RosterModel::itemName(const QString &jid) const
 
 void RosterModel::handleItemsFetched(const QVector<RosterItem> &items)
 {
+	applyPendingChanges();
+
 	beginResetModel();
 	m_items = items;
 	std::sort(m_items.begin(), m_items.end());
+	m_rowsByJid.clear();
+	m_rowsByJid.reserve(m_items.size());
+	updateRowIndex(0, m_items.size() - 1);
 	endResetModel();
 }
 
 void RosterModel::addItem(const RosterItem &item)
 {
+	applyPendingChanges();
+
 	insertContact(positionToInsert(item), item);
 }
 
 void RosterModel::removeItem(const QString &jid)
 {
-	QMutableVectorIterator<RosterItem> itr(m_items);
-	int i = 0;
-	while (itr.hasNext()) {
-		if (itr.next().jid() == jid) {
-			beginRemoveRows(QModelIndex(), i, i);
-			itr.remove();
-			endRemoveRows();
-			return;
-		}
-		i++;
-	}
+	applyPendingChanges();
+
+	const int i = itemRow(jid);
+	if (i == -1)
+		return;
+
+	beginRemoveRows(QModelIndex(), i, i);
+	m_items.remove(i);
+	m_rowsByJid.remove(jid);
+	updateRowIndex(i, m_items.size() - 1);
+	endRemoveRows();
 }
 
 void RosterModel::updateItem(const QString &jid,
                              const std::function<void (RosterItem &)> &updateItem)
 {
-	for (int i = 0; i < m_items.length(); i++) {
-		if (m_items.at(i).jid() == jid) {
-			// update item
-			RosterItem item = m_items.at(i);
-			updateItem(item);
+	applyPendingChanges();
+
+	const int i = itemRow(jid);
+	if (i == -1)
+		return;
 
-			// check if item was actually modified
-			if (m_items.at(i) == item)
-				return;
+	// update item
+	RosterItem item = m_items.at(i);
+	updateItem(item);
 
-			m_items.replace(i, item);
+	// check if item was actually modified
+	if (m_items.at(i) == item)
+		return;
 
-			// item was changed: refresh all roles
-			emit dataChanged(index(i), index(i), {});
+	m_items.replace(i, item);
 
-			// check, if the position of the new item may be different
-			updateItemPosition(i);
-			return;
-		}
-	}
+	// item was changed: refresh all roles
+	emit dataChanged(index(i), index(i), {});
+
+	// check, if the position of the new item may be different
+	updateItemPosition(i);
 }
 
 void RosterModel::replaceItems(const QHash<QString, RosterItem> &items)
 {
+	applyPendingChanges();
+
 	QVector<RosterItem> newItems;
+	newItems.reserve(items.size());
 	for (auto item : qAsConst(items)) {
-		// find old item
-		auto oldItem = std::find_if(
-			m_items.begin(),
-			m_items.end(),
-			[&] (const RosterItem &oldItem) {
-				return oldItem.jid() == item.jid();
-			}
-		);
-
 		// use the old item's values, if found
-		if (oldItem != m_items.end()) {
-			item.setLastMessage(oldItem->lastMessage());
-			item.setLastExchanged(oldItem->lastExchanged());
-			item.setUnreadMessages(oldItem->unreadMessages());
+		if (const int i = itemRow(item.jid()); i != -1) {
+			const auto &oldItem = m_items.at(i);
+			item.setLastMessage(oldItem.lastMessage());
+			item.setLastExchanged(oldItem.lastExchanged());
+			item.setUnreadMessages(oldItem.unreadMessages());
 		}
 
 		newItems << item;
@@ -226,16 +254,20 @@ void RosterModel::replaceItems(const QHash<QString, RosterItem> &items)
 void RosterModel::handleMessageAdded(const Message &message)
 {
 	const auto contactJid = message.sentByMe() ? message.to() : message.from();
-	auto itr = std::find_if(m_items.begin(), m_items.end(), [&contactJid](const RosterItem &item) {
-		return item.jid() == contactJid;
-	});
+	const int i = itemRow(contactJid);
 
 	// contact not found
-	if (itr == m_items.end())
+	if (i == -1)
 		return;
 
+	// Many messages can be received at once, e.g., after reconnecting. Their
+	// changes are collected and applied to the items at once by
+	// applyPendingChanges(). Until then, the items stay ordered.
+	auto change = m_pendingChanges.value(contactJid, PendingChange { m_items.at(i), {} });
+	auto &item = change.item;
+
 	// new message is older than most recent event
-	if (itr->lastExchanged() > message.stamp())
+	if (item.lastExchanged() > message.stamp())
 		return;
 
 	QVector<int> changedRoles = {
@@ -243,12 +275,12 @@ void RosterModel::handleMessageAdded(const Message &message)
 	};
 
 	// last exchanged
-	itr->setLastExchanged(message.stamp());
+	item.setLastExchanged(message.stamp());
 
 	// last message
 	const auto lastMessage = message.previewText();
-	if (itr->lastMessage() != lastMessage) {
-		itr->setLastMessage(lastMessage);
+	if (item.lastMessage() != lastMessage) {
+		item.setLastMessage(lastMessage);
 		changedRoles << int(LastMessageRole);
 	}
 
@@ -259,58 +291,99 @@ void RosterModel::handleMessageAdded(const Message &message)
 		newUnreadMessages = 0;
 	} else if (Kaidan::instance()->messageModel()->currentChatJid() != contactJid) {
 		// increase counter, if chat isn't open
-		newUnreadMessages = itr->unreadMessages() + 1;
+		newUnreadMessages = item.unreadMessages() + 1;
 	}
 
 	if (newUnreadMessages.has_value()) {
-		itr->setUnreadMessages(*newUnreadMessages);
+		item.setUnreadMessages(*newUnreadMessages);
 		changedRoles << int(UnreadMessagesRole);
+	}
 
-		emit m_rosterDb->updateItemRequested(contactJid, [=](RosterItem &item) {
-			item.setUnreadMessages(*newUnreadMessages);
-		});
+	for (const int role : qAsConst(changedRoles)) {
+		if (!change.roles.contains(role))
+			change.roles << role;
 	}
+	m_pendingChanges.insert(contactJid, change);
 
-	// notify gui
-	const auto i = std::distance(m_items.begin(), itr);
-	const auto modelIndex = index(i);
-	emit dataChanged(modelIndex, modelIndex, changedRoles);
+	if (!m_updateTimer->isActive())
+		m_updateTimer->start();
+}
 
-	// move row to correct position
-	updateItemPosition(i);
+void RosterModel::applyPendingChanges()
+{
+	m_updateTimer->stop();
+	if (m_pendingChanges.isEmpty())
+		return;
+
+	const auto changes = std::exchange(m_pendingChanges, {});
+
+	// Each changed item is moved to its position right after it has been
+	// changed, so that all other items are still ordered for the binary search.
+	for (const auto &change : changes) {
+		const auto &item = change.item;
+		const int i = itemRow(item.jid());
+		if (i == -1)
+			continue;
+
+		m_items.replace(i, item);
+
+		if (change.roles.contains(UnreadMessagesRole)) {
+			const int unreadMessages = item.unreadMessages();
+			emit m_rosterDb->updateItemRequested(item.jid(), [=](RosterItem &item) {
+				item.setUnreadMessages(unreadMessages);
+			});
+		}
+
+		// notify gui
+		const auto modelIndex = index(i);
+		emit dataChanged(modelIndex, modelIndex, change.roles);
+
+		// move row to correct position
+		updateItemPosition(i);
+	}
 }
 
 void RosterModel::insertContact(int i, const RosterItem &item)
 {
 	beginInsertRows(QModelIndex(), i, i);
 	m_items.insert(i, item);
+	updateRowIndex(i, m_items.size() - 1);
 	endInsertRows();
 }
 
 int RosterModel::updateItemPosition(int currentPosition)
 {
-	const int newPosition = positionToInsert(m_items.at(currentPosition));
+	const auto &item = m_items.at(currentPosition);
+
+	// Search for the new position among the other items, which are still
+	// ordered.
+	int newPosition = currentPosition;
+	if (currentPosition > 0 && item < m_items.at(currentPosition - 1)) {
+		const auto itr = std::lower_bound(m_items.cbegin(), m_items.cbegin() + currentPosition, item);
+		newPosition = std::distance(m_items.cbegin(), itr);
+	} else if (currentPosition + 1 < m_items.size() && m_items.at(currentPosition + 1) < item) {
+		const auto itr = std::lower_bound(m_items.cbegin() + currentPosition + 1, m_items.cend(), item);
+		newPosition = std::distance(m_items.cbegin(), itr) - 1;
+	}
+
 	if (currentPosition == newPosition)
 		return currentPosition;
 
-	beginMoveRows(QModelIndex(), currentPosition, currentPosition, QModelIndex(), newPosition);
+	// When moving a row down, the destination is the row before which it is
+	// moved, counted before the move.
+	const int destination = newPosition > currentPosition ? newPosition + 1 : newPosition;
+	beginMoveRows(QModelIndex(), currentPosition, currentPosition, QModelIndex(), destination);
 	m_items.move(currentPosition, newPosition);
+	updateRowIndex(std::min(currentPosition, newPosition), std::max(currentPosition, newPosition));
 	endMoveRows();
 
 	return newPosition;
 }
 
-int RosterModel::positionToInsert(const RosterItem &item)
+int RosterModel::positionToInsert(const RosterItem &item) const
 {
-	// prepend the item, if no timestamp is set
-	if (item.lastExchanged().isNull())
-		return 0;
-
-	for (int i = 0; i < m_items.size(); i++) {
-		if (item <= m_items.at(i))
-			return i;
-	}
-
-	// append
-	return m_items.size();
+	// Items without a timestamp are ordered as by handleItemsFetched(), i.e.,
+	// behind the others, so that the items stay ordered for the binary search.
+	const auto itr = std::lower_bound(m_items.cbegin(), m_items.cend(), item);
+	return std::distance(m_items.cbegin(), itr);
 }
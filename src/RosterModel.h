@@ -39,6 +39,7 @@
 #include "RosterItem.h"
 
 class Kaidan;
+class QTimer;
 class RosterDb;
 class MessageModel;
 class Message;
@@ -89,16 +90,53 @@ private slots:
 	void replaceItems(const QHash<QString, RosterItem> &items);
 	void handleMessageAdded(const Message &message);
 
+	/**
+	 * Applies the changes of the items by the messages received since the last
+	 * call, notifies the views and updates the database.
+	 *
+	 * This must be called before any other change of the items, so that the
+	 * items are ordered correctly.
+	 */
+	void applyPendingChanges();
+
 private:
+	struct PendingChange {
+		RosterItem item;
+		QVector<int> roles;
+	};
+
 	/**
 	 * Searches for the roster item with a given JID.
 	 */
 	std::optional<const RosterItem> findItem(const QString &jid) const;
 
+	/**
+	 * Returns the row of the roster item with a given JID or -1 if there is
+	 * no such item.
+	 */
+	int itemRow(const QString &jid) const;
+
+	/**
+	 * Updates the rows of the items from @p first to @p last in the index of
+	 * the rows by JIDs.
+	 */
+	void updateRowIndex(int first, int last);
+
 	void insertContact(int i, const RosterItem &item);
 	int updateItemPosition(int currentIndex);
-	int positionToInsert(const RosterItem &item);
+
+	/**
+	 * Returns the row at which an item is inserted to keep the items ordered,
+	 * found by a binary search.
+	 */
+	int positionToInsert(const RosterItem &item) const;
 
 	RosterDb *m_rosterDb;
 	QVector<RosterItem> m_items;
+	// rows of the items by their JIDs
+	QHash<QString, int> m_rowsByJid;
+	// changed items and their changed roles by their JIDs, applied at once by
+	// applyPendingChanges()
+	QHash<QString, PendingChange> m_pendingChanges;
+	QTimer *m_updateTimer;
 };
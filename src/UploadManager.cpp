@@ -118,9 +118,9 @@ void UploadManager::handleUploadSucceeded(const QXmppHttpUpload *upload)
 	                     ? oobUrl
 	                     : originalMsg->body() + "\n" + oobUrl;
 
-	emit Kaidan::instance()->messageModel()->updateMessageRequested(originalMsg->id(), [=] (Message &msg) {
-		msg.setOutOfBandUrl(oobUrl);
-	});
+	MessagePatch patch;
+	patch.outOfBandUrl = oobUrl;
+	emit Kaidan::instance()->messageModel()->patchMessageRequested(originalMsg->id(), patch);
 
 	// send message
 	QXmppMessage m(originalMsg->from(), originalMsg->to(), body);
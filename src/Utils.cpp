@@ -29,31 +29,252 @@
  */
 
 #include "Utils.h"
+// std
+#include <algorithm>
+#include <atomic>
+#include <cmath>
 // Qt
+#include <QByteArray>
+#include <QCache>
 #include <QDebug>
+#include <QElapsedTimer>
+#include <QHash>
 #include <QMap>
+#include <QMutex>
 #include <QSqlDriver>
 #include <QSqlError>
 #include <QSqlField>
 #include <QSqlQuery>
 #include <QSqlRecord>
+#include <QTextStream>
+#include <QThread>
 #include <QVariant>
 #include <QVector>
 
+// number of attempts to execute a query while another connection locks the database
+constexpr int BUSY_RETRY_COUNT = 5;
+// delay in ms between the attempts, multiplied by the number of the attempt
+constexpr int BUSY_RETRY_DELAY = 200;
+
+// maximum number of prepared queries cached per database connection
+constexpr int PREPARED_QUERY_CACHE_SIZE = 64;
+
+// time in µs after which an execution is recorded as a slow query (one frame)
+constexpr qint64 SLOW_QUERY_THRESHOLD = 16 * 1000;
+// maximum number of recorded slow queries, older ones are discarded
+constexpr int SLOW_QUERY_COUNT = 32;
+
+namespace {
+	// Each connection has its own cache so that queries are only evicted by the
+	// thread using the connection.
+	QMutex preparedQueryCachesMutex;
+	QHash<const QSqlDriver *, QCache<QString, QSqlQuery> *> preparedQueryCaches;
+
+	std::atomic<quint64> preparedQueryCacheHits { 0 };
+	std::atomic<quint64> preparedQueryCacheMisses { 0 };
+
+	std::atomic_bool queryStatisticsEnabled { false };
+	QMutex queryStatisticsMutex;
+	QHash<QString, Utils::QueryStatistics> queryStatistics;
+	QVector<Utils::SlowQuery> slowQueries;
+}
+
+/**
+ * Adds an execution of a query to the statistics.
+ *
+ * @param time execution time in µs
+ */
+static void recordQueryExecution(const QSqlQuery &query, qint64 time)
+{
+	const QString statement = query.lastQuery();
+
+	int bucket = 0;
+	while (bucket < Utils::QUERY_LATENCY_BUCKET_COUNT - 1 && (Q_INT64_C(1) << bucket) <= time)
+		bucket++;
+
+	QMutexLocker locker(&queryStatisticsMutex);
+
+	auto &statistics = queryStatistics[statement];
+	if (statistics.statement.isNull())
+		statistics.statement = statement;
+	statistics.executionCount++;
+	statistics.totalTime += time;
+	statistics.maxTime = std::max(statistics.maxTime, time);
+	if (!query.isSelect())
+		statistics.rowCount += std::max(query.numRowsAffected(), 0);
+	statistics.latencyHistogram[bucket]++;
+
+	if (time >= SLOW_QUERY_THRESHOLD) {
+		if (slowQueries.size() == SLOW_QUERY_COUNT)
+			slowQueries.removeFirst();
+		slowQueries.append({ statement, time, QDateTime::currentDateTimeUtc(), QThread::currentThread()->objectName() });
+	}
+}
+
+/**
+ * Returns whether an error occurred because the database was locked by another
+ * connection, even after waiting for the busy timeout.
+ */
+static bool isBusyError(const QSqlError &error)
+{
+	// primary result code SQLITE_BUSY
+	// SQLITE_LOCKED is not retried because it is caused by a statement of the
+	// same connection, which does not go away by waiting.
+	const int code = error.nativeErrorCode().toInt() & 0xff;
+	return code == 5;
+}
+
 void Utils::prepareQuery(QSqlQuery &query, const QString &sql)
 {
-	if (!query.prepare(sql)) {
-		qDebug() << "Failed to prepare query:" << sql;
-		qFatal("QSqlError: %s", qPrintable(query.lastError().text()));
+	QMutexLocker locker(&preparedQueryCachesMutex);
+
+	auto *cache = preparedQueryCaches.value(query.driver());
+	if (!cache) {
+		cache = new QCache<QString, QSqlQuery>(PREPARED_QUERY_CACHE_SIZE);
+		preparedQueryCaches.insert(query.driver(), cache);
+	}
+
+	if (const auto *cachedQuery = cache->object(sql)) {
+		// A query whose results are still being read, e.g., by a caller preparing
+		// the same statement in its loop over them, must not be reset. It is
+		// replaced by a new query below and finalized with its last copy.
+		const bool beingRead = cachedQuery->isActive() && cachedQuery->isSelect() &&
+		                       cachedQuery->at() != QSql::AfterLastRow;
+		if (!beingRead) {
+			query = *cachedQuery;
+			// Reset the statement so that it does not stay active and hold its
+			// read snapshot, e.g., if the results were not read completely.
+			query.finish();
+			preparedQueryCacheHits++;
+			return;
+		}
+	}
+	preparedQueryCacheMisses++;
+
+	// Results are only read sequentially.
+	// That needs less memory and makes the cached queries usable by all callers.
+	query.setForwardOnly(true);
+	for (int attempt = 1; !query.prepare(sql); attempt++) {
+		if (attempt == BUSY_RETRY_COUNT || !isBusyError(query.lastError())) {
+			qDebug() << "Failed to prepare query:" << sql;
+			qFatal("QSqlError: %s", qPrintable(query.lastError().text()));
+		}
+
+		qDebug() << "Database is locked, retrying to prepare query:" << sql;
+		QThread::msleep(attempt * BUSY_RETRY_DELAY);
+	}
+
+	cache->insert(sql, new QSqlQuery(query));
+}
+
+Utils::PreparedQueryCacheStatistics Utils::preparedQueryCacheStatistics()
+{
+	PreparedQueryCacheStatistics statistics;
+	statistics.hits = preparedQueryCacheHits;
+	statistics.misses = preparedQueryCacheMisses;
+	return statistics;
+}
+
+void Utils::clearPreparedQueryCache(const QSqlDriver *driver)
+{
+	QMutexLocker locker(&preparedQueryCachesMutex);
+	delete preparedQueryCaches.take(driver);
+}
+
+qint64 Utils::QueryStatistics::latencyPercentile(double fraction) const
+{
+	const auto limit = quint64(std::ceil(fraction * executionCount));
+
+	quint64 count = 0;
+	for (int i = 0; i < QUERY_LATENCY_BUCKET_COUNT; i++) {
+		count += latencyHistogram[i];
+		if (count >= limit && count)
+			return i == QUERY_LATENCY_BUCKET_COUNT - 1 ? maxTime : std::min(Q_INT64_C(1) << i, maxTime);
+	}
+
+	return maxTime;
+}
+
+void Utils::setQueryStatisticsEnabled(bool enabled)
+{
+	queryStatisticsEnabled = enabled;
+}
+
+QVector<Utils::QueryStatistics> Utils::queryStatistics()
+{
+	QMutexLocker locker(&queryStatisticsMutex);
+	QVector<QueryStatistics> statistics;
+	statistics.reserve(::queryStatistics.size());
+	for (const auto &statementStatistics : qAsConst(::queryStatistics))
+		statistics << statementStatistics;
+	locker.unlock();
+
+	std::sort(statistics.begin(), statistics.end(), [](const QueryStatistics &a, const QueryStatistics &b) {
+		return a.totalTime > b.totalTime;
+	});
+	return statistics;
+}
+
+QVector<Utils::SlowQuery> Utils::slowQueries()
+{
+	QMutexLocker locker(&queryStatisticsMutex);
+	return ::slowQueries;
+}
+
+QString Utils::queryStatisticsReport()
+{
+	QString report;
+	QTextStream stream(&report);
+
+	stream << "Query statistics (times in µs):\n";
+	stream << "count\ttotal\tmean\tp50\tp95\tp99\tmax\trows\tstatement\n";
+	const auto statistics = queryStatistics();
+	for (const auto &statementStatistics : statistics) {
+		stream << statementStatistics.executionCount << '\t'
+		       << statementStatistics.totalTime << '\t'
+		       << statementStatistics.totalTime / qint64(statementStatistics.executionCount) << '\t'
+		       << statementStatistics.latencyPercentile(0.5) << '\t'
+		       << statementStatistics.latencyPercentile(0.95) << '\t'
+		       << statementStatistics.latencyPercentile(0.99) << '\t'
+		       << statementStatistics.maxTime << '\t'
+		       << statementStatistics.rowCount << '\t'
+		       << statementStatistics.statement.simplified() << '\n';
+	}
+
+	stream << "\nSlow queries:\n";
+	const auto queries = slowQueries();
+	for (const auto &query : queries) {
+		stream << query.executionStamp.toString(Qt::ISODateWithMs) << '\t'
+		       << query.threadName << '\t'
+		       << query.time << '\t'
+		       << query.statement.simplified() << '\n';
 	}
+
+	stream.flush();
+	return report;
 }
 
 void Utils::execQuery(QSqlQuery &query)
 {
-	if (!query.exec()) {
-		qDebug() << "Failed to execute query:" << query.executedQuery();
-		qFatal("QSqlError: %s", qPrintable(query.lastError().text()));
+	QElapsedTimer timer;
+	if (queryStatisticsEnabled)
+		timer.start();
+
+	// Another connection (e.g., of another instance of Kaidan) can lock the
+	// database for longer than the busy timeout.
+	// The bound values are kept for the next attempt.
+	for (int attempt = 1; !query.exec(); attempt++) {
+		if (attempt == BUSY_RETRY_COUNT || !isBusyError(query.lastError())) {
+			qDebug() << "Failed to execute query:" << query.executedQuery();
+			qFatal("QSqlError: %s", qPrintable(query.lastError().text()));
+		}
+
+		qDebug() << "Database is locked, retrying to execute query:" << query.executedQuery();
+		QThread::msleep(attempt * BUSY_RETRY_DELAY);
 	}
+
+	if (timer.isValid())
+		recordQueryExecution(query, timer.nsecsElapsed() / 1000);
 }
 
 void Utils::execQuery(QSqlQuery &query, const QString &sql)
@@ -87,6 +308,15 @@ void Utils::execQuery(QSqlQuery &query,
 	execQuery(query);
 }
 
+QVector<QVariant> Utils::recordValues(const QSqlRecord &record)
+{
+	QVector<QVariant> values;
+	values.reserve(record.count());
+	for (int i = 0; i < record.count(); i++)
+		values << record.value(i);
+	return values;
+}
+
 QSqlField Utils::createSqlField(const QString &key, const QVariant &val)
 {
 	QSqlField field(key, val.type());
@@ -108,3 +338,45 @@ QString Utils::simpleWhereStatement(const QSqlDriver *driver,
 	        false
 	);
 }
+
+QVariant Utils::compressText(const QString &text)
+{
+	const QByteArray data = text.toUtf8();
+	const QByteArray compressedData = qCompress(data);
+	if (compressedData.size() < data.size())
+		return compressedData;
+	return text;
+}
+
+QString Utils::decompressText(const QVariant &value)
+{
+	// Uncompressed texts are stored as TEXT and read as strings.
+	if (value.type() == QVariant::ByteArray)
+		return QString::fromUtf8(qUncompress(value.toByteArray()));
+	return value.toString();
+}
+
+QString Utils::formatMessageBody(const QString &body)
+{
+	// escape all special XML chars (like '<' and '>')
+	// and split into words for processing
+	const auto words = body.toHtmlEscaped().split(QLatin1Char(' '));
+
+	QString formatted;
+	formatted.reserve(body.size());
+	for (int i = 0; i < words.size(); i++) {
+		const auto &word = words.at(i);
+		if (i)
+			formatted += QLatin1Char(' ');
+
+		// link highlighting
+		if (word.startsWith(QStringLiteral("https://")) || word.startsWith(QStringLiteral("http://")))
+			formatted += QStringLiteral("<a href='%1'>%1</a>").arg(word);
+		// preserve newlines
+		else if (word.contains(QLatin1Char('\n')))
+			formatted += QString(word).replace(QLatin1Char('\n'), QStringLiteral("<br>"));
+		else
+			formatted += word;
+	}
+	return formatted;
+}
@@ -30,11 +30,17 @@
 
 #pragma once
 
+#include <array>
+
+#include <QDateTime>
+#include <QString>
+#include <QtGlobal>
+
 template <class Key, class T> class QMap;
 class QSqlDriver;
 class QSqlField;
 class QSqlQuery;
-class QString;
+class QSqlRecord;
 class QVariant;
 template <class T> class QVector;
 
@@ -44,15 +50,118 @@ template <class T> class QVector;
 class Utils
 {
 public:
+	/**
+	 * Numbers of lookups in the prepared query cache
+	 */
+	struct PreparedQueryCacheStatistics
+	{
+		quint64 hits = 0;
+		quint64 misses = 0;
+	};
+
+	/**
+	 * Number of buckets of the latency histogram in QueryStatistics
+	 *
+	 * Bucket 0 counts executions taking less than 1 µs and bucket i those
+	 * taking from 2^(i - 1) to 2^i µs. The last bucket counts all slower ones.
+	 */
+	static constexpr int QUERY_LATENCY_BUCKET_COUNT = 24;
+
+	/**
+	 * Statistics about the executions of one SQL statement
+	 *
+	 * As the values are bound to placeholders, each statement stands for one
+	 * shape of queries.
+	 */
+	struct QueryStatistics
+	{
+		QString statement;
+		quint64 executionCount = 0;
+		// in µs
+		qint64 totalTime = 0;
+		qint64 maxTime = 0;
+		// rows changed by the executions, selected rows are not counted
+		quint64 rowCount = 0;
+		std::array<quint64, QUERY_LATENCY_BUCKET_COUNT> latencyHistogram {};
+
+		/**
+		 * Returns the upper bound in µs of the latency of the given fraction of
+		 * executions, e.g., 0.95 for the 95th percentile.
+		 */
+		qint64 latencyPercentile(double fraction) const;
+	};
+
+	/**
+	 * Execution of a statement that took longer than the slow query threshold
+	 */
+	struct SlowQuery
+	{
+		QString statement;
+		// in µs
+		qint64 time = 0;
+		QDateTime executionStamp;
+		QString threadName;
+	};
+
 	/**
 	 * Prepares an SQL query for executing it by @c execQuery and handles possible
 	 * errors.
 	 *
+	 * Prepared queries are cached per database connection and reused when the
+	 * same statement is prepared again, so that SQLite does not have to parse
+	 * and plan it each time. In that case, @p query shares the cached query and
+	 * only the bound values are replaced. The statement is reset when it is
+	 * handed out again, unless its results are still being read. In that case,
+	 * e.g., when the same statement is prepared within a loop over its results,
+	 * a new query is prepared instead. Callers reading only some of the results
+	 * have to call QSqlQuery::finish() afterwards so that the statement does not
+	 * stay active and block e.g. dropping tables. The cached queries are
+	 * forward-only.
+	 *
 	 * @param query SQL query
 	 * @param sql SQL statement
 	 */
 	static void prepareQuery(QSqlQuery &query, const QString &sql);
 
+	/**
+	 * Returns the numbers of cache hits and misses of @c prepareQuery since the
+	 * start of the application.
+	 */
+	static PreparedQueryCacheStatistics preparedQueryCacheStatistics();
+
+	/**
+	 * Removes all prepared queries of a database connection from the cache.
+	 *
+	 * This must be called before the connection is closed.
+	 *
+	 * @param driver SQL database driver of the connection
+	 */
+	static void clearPreparedQueryCache(const QSqlDriver *driver);
+
+	/**
+	 * Enables or disables recording the statistics of all queries executed by
+	 * @c execQuery.
+	 *
+	 * They are disabled by default.
+	 */
+	static void setQueryStatisticsEnabled(bool enabled);
+
+	/**
+	 * Returns the statistics of all recorded statements ordered by their total
+	 * execution time, starting with the longest one.
+	 */
+	static QVector<QueryStatistics> queryStatistics();
+
+	/**
+	 * Returns the latest recorded slow queries, starting with the oldest one.
+	 */
+	static QVector<SlowQuery> slowQueries();
+
+	/**
+	 * Returns a human-readable report of queryStatistics() and slowQueries().
+	 */
+	static QString queryStatisticsReport();
+
 	/**
 	 * Executes an SQL query and handles possible errors.
 	 *
@@ -92,6 +201,16 @@ public:
 	                      const QString &sql,
 	                      const QMap<QString, QVariant> &bindValues);
 
+	/**
+	 * Returns the values of an SQL record in the order of its fields.
+	 *
+	 * They can be bound to a statement created with placeholders by
+	 * @c QSqlDriver::sqlStatement().
+	 *
+	 * @param record SQL record
+	 */
+	static QVector<QVariant> recordValues(const QSqlRecord &record);
+
 	/**
 	 * Creates an SQL field that may be used for an SQL statement.
 	 *
@@ -113,4 +232,25 @@ public:
 	static QString simpleWhereStatement(const QSqlDriver *driver,
 	                                    const QString &key,
 	                                    const QVariant &val);
+
+	/**
+	 * Compresses a text for storing it in a BLOB column.
+	 *
+	 * @return the compressed UTF-8 data or the text itself if compressing it
+	 *         would not make it smaller
+	 */
+	static QVariant compressText(const QString &text);
+
+	/**
+	 * Returns the text of a value created by compressText().
+	 */
+	static QString decompressText(const QVariant &value);
+
+	/**
+	 * Styles/formats a message body for displaying it as rich text.
+	 *
+	 * This escapes all special XML characters, highlights links and preserves
+	 * line breaks.
+	 */
+	static QString formatMessageBody(const QString &body);
 };
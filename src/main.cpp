@@ -55,7 +55,9 @@
 #include "Enums.h"
 #include "Kaidan.h"
 #include "Message.h"
+#include "MessageDb.h"
 #include "MessageModel.h"
+#include "MessageSearchModel.h"
 #include "QmlUtils.h"
 #include "RegistrationDataFormFilterModel.h"
 #include "RegistrationManager.h"
@@ -67,6 +69,7 @@
 #include "QrCodeScannerFilter.h"
 #include "VCardModel.h"
 #include "UserDevicesModel.h"
+#include "Utils.h"
 #include "CameraModel.h"
 #include "AudioDeviceModel.h"
 #include "MediaUtils.h"
@@ -120,6 +123,7 @@ CommandLineParseResult parseCommandLine(QCommandLineParser &parser, QString *err
 	QCommandLineOption versionOption = parser.addVersionOption();
 	parser.addOption({"disable-xml-log", "Disable output of full XMPP XML stream."});
 	parser.addOption({{"m", "multiple"}, "Allow multiple instances to be started."});
+	parser.addOption({"dump-query-statistics", "Print latency statistics of the database queries on exit."});
 	parser.addPositionalArgument("xmpp-uri", "An XMPP-URI to open (i.e. join a chat).",
 	                             "[xmpp-uri]");
 
@@ -219,10 +223,13 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
 	qRegisterMetaType<TransferJob*>("TransferJob*");
 	qRegisterMetaType<QmlUtils*>("QmlUtils*");
 	qRegisterMetaType<QVector<Message>>("QVector<Message>");
+	qRegisterMetaType<QVector<MessageRow>>("QVector<MessageRow>");
+	qRegisterMetaType<QVector<MessageSearchResult>>("QVector<MessageSearchResult>");
 	qRegisterMetaType<QVector<RosterItem>>("QVector<RosterItem>");
 	qRegisterMetaType<QHash<QString,RosterItem>>("QHash<QString,RosterItem>");
 	qRegisterMetaType<std::function<void(RosterItem&)>>("std::function<void(RosterItem&)>");
 	qRegisterMetaType<std::function<void(Message&)>>("std::function<void(Message&)>");
+	qRegisterMetaType<MessagePatch>();
 	qRegisterMetaType<QXmppVCardIq>("QXmppVCardIq");
 	qRegisterMetaType<QMimeType>();
 	qRegisterMetaType<CameraInfo>();
@@ -241,6 +248,8 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
 	qRegisterMetaType<Enums::MessageType>();
 	qRegisterMetaType<Presence::Availability>();
 	qRegisterMetaType<Enums::DeliveryState>();
+	qRegisterMetaType<MessageDb::FetchDirection>();
+	qRegisterMetaType<MessageDb::HistoryFormat>();
 	qRegisterMetaType<CommonEncoderSettings::EncodingQuality>();
 	qRegisterMetaType<CommonEncoderSettings::EncodingMode>();
 	qRegisterMetaType<AudioDeviceModel::Mode>();
@@ -302,6 +311,9 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
 	//
 	// Kaidan back-end
 	//
+	const bool dumpQueryStatistics = parser.isSet("dump-query-statistics");
+	Utils::setQueryStatisticsEnabled(dumpQueryStatistics);
+
 	Kaidan kaidan(&app, !parser.isSet("disable-xml-log"));
 
 #if !defined(Q_OS_IOS) && !defined(Q_OS_ANDROID)
@@ -363,6 +375,7 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
 	qmlRegisterType<MediaSettingsVideoFrameRateModel>(APPLICATION_ID, 1, 0, "MediaSettingsVideoFrameRateModel");
 	qmlRegisterType<MediaRecorder>(APPLICATION_ID, 1, 0, "MediaRecorder");
 	qmlRegisterType<UserDevicesModel>(APPLICATION_ID, 1, 0, "UserDevicesModel");
+	qmlRegisterType<MessageSearchModel>(APPLICATION_ID, 1, 0, "MessageSearchModel");
 	qmlRegisterType<CredentialsGenerator>(APPLICATION_ID, 1, 0, "CredentialsGenerator");
 	qmlRegisterType<CredentialsValidator>(APPLICATION_ID, 1, 0, "CredentialsValidator");
 	qmlRegisterType<QrCodeGenerator>(APPLICATION_ID, 1, 0, "QrCodeGenerator");
@@ -415,5 +428,10 @@ Q_DECL_EXPORT int main(int argc, char *argv[])
 #endif
 
 	// enter qt main loop
-	return app.exec();
+	const int exitCode = app.exec();
+
+	if (dumpQueryStatistics)
+		qInfo().noquote() << Utils::queryStatisticsReport();
+
+	return exitCode;
 }
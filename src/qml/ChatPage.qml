@@ -409,13 +409,16 @@ ChatPageBase {
 	// button for jumping to the latest message
 	Controls.RoundButton {
 		visible: width > 0
-		width: messageListView.atYEnd ? 0 : 50
-		height: messageListView.atYEnd ? 0 : 50
+		width: messageListView.atYEnd && !Kaidan.messageModel.canFetchNewer ? 0 : 50
+		height: messageListView.atYEnd && !Kaidan.messageModel.canFetchNewer ? 0 : 50
 		anchors.horizontalCenter: parent.horizontalCenter
 		anchors.bottom: parent.bottom
 		anchors.bottomMargin: sendingPane.height + 5
 		icon.name: "go-down"
-		onClicked: messageListView.positionViewAtIndex(0, ListView.Center)
+		onClicked: {
+			Kaidan.messageModel.showLatestMessages()
+			messageListView.positionViewAtIndex(0, ListView.Center)
+		}
 
 		Behavior on width {
 			SmoothedAnimation {}
@@ -473,6 +476,39 @@ ChatPageBase {
 		// Connect to the database,
 		model: Kaidan.messageModel
 
+		// Load the newer messages that have been removed while scrolling back in the history.
+		onAtYEndChanged: {
+			if (atYEnd && Kaidan.messageModel.canFetchNewer)
+				Kaidan.messageModel.fetchNewer()
+		}
+
+		// Load older or newer messages before the oldest or newest loaded one becomes visible.
+		// The newest message is at the bottom.
+		onContentYChanged: {
+			if (count === 0)
+				return
+
+			const rowHeight = contentHeight / count
+			Kaidan.messageModel.prefetch(
+				indexAt(contentX, contentY + height - 1),
+				indexAt(contentX, contentY),
+				verticalVelocity / rowHeight
+			)
+		}
+
+		Connections {
+			target: Kaidan.messageModel
+
+			function onMessagesShownAround(index) {
+				messageListView.positionViewAtIndex(index, ListView.Center)
+				messageListView.currentIndex = index
+			}
+
+			function onScrollPositionRestored(index) {
+				messageListView.positionViewAtIndex(index, ListView.Center)
+			}
+		}
+
 		ChatMessageContextMenu {
 			id: messageContextMenu
 		}
@@ -485,7 +521,9 @@ ChatPageBase {
 			contextMenu: messageContextMenu
 			sentByMe: model.sentByMe
 			messageBody: model.body
+			formattedBody: model.formattedBody
 			dateTime: new Date(model.timestamp)
+			formattedDateTime: model.formattedTimestamp
 			deliveryState: model.deliveryState
 			mediaType: model.mediaType
 			mediaGetUrl: model.mediaUrl
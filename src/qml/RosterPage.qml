@@ -115,6 +115,24 @@ Kirigami.ScrollablePage {
 			isSelected: !Kirigami.Settings.isMobile && Kaidan.messageModel.currentChatJid === jid
 		}
 
+		ColumnLayout {
+			anchors.centerIn: parent
+			width: parent.width - Kirigami.Units.gridUnit * 4
+			visible: Kaidan.databaseConversionProgress < 1
+
+			Controls.Label {
+				text: qsTr("Updating the message history…")
+				wrapMode: Text.Wrap
+				horizontalAlignment: Text.AlignHCenter
+				Layout.fillWidth: true
+			}
+
+			Controls.ProgressBar {
+				value: Kaidan.databaseConversionProgress
+				Layout.fillWidth: true
+			}
+		}
+
 		Connections {
 			target: Kaidan
 
@@ -48,7 +48,9 @@ RowLayout {
 	property string senderName
 	property bool sentByMe: true
 	property string messageBody
+	property string formattedBody
 	property date dateTime
+	property string formattedDateTime
 	property int deliveryState: Enums.DeliveryState.Delivered
 	property int mediaType
 	property string mediaGetUrl
@@ -227,7 +229,7 @@ RowLayout {
 				Controls.Label {
 					id: bodyLabel
 					visible: messageBody
-					text: Utils.formatMessage(messageBody)
+					text: formattedBody
 					textFormat: Text.StyledText
 					wrapMode: Text.Wrap
 					color: Kirigami.Theme.textColor
@@ -254,7 +256,7 @@ RowLayout {
 
 				Controls.Label {
 					id: dateLabel
-					text: Qt.formatDateTime(dateTime, "dd. MMM yyyy, hh:mm")
+					text: formattedDateTime
 					color: Kirigami.Theme.disabledTextColor
 					font.pixelSize: Kirigami.Units.gridUnit * 0.8
 				}
@@ -0,0 +1,192 @@
+/*
+ *  Kaidan - A user-friendly XMPP client for every device!
+ *
+ *  Copyright (C) 2016-2021 Kaidan developers and contributors
+ *  (see the LICENSE file for a full list of copyright authors)
+ *
+ *  Kaidan is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  In addition, as a special exception, the author of Kaidan gives
+ *  permission to link the code of its release with the OpenSSL
+ *  project's "OpenSSL" library (or with modified versions of it that
+ *  use the same license as the "OpenSSL" library), and distribute the
+ *  linked executables. You must obey the GNU General Public License in
+ *  all respects for all of the code used other than "OpenSSL". If you
+ *  modify this file, you may extend this exception to your version of
+ *  the file, but you are not obligated to do so.  If you do not wish to
+ *  do so, delete this exception statement from your version.
+ *
+ *  Kaidan is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kaidan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "QXmppRosterVersionManager.h"
+
+#include <utility>
+
+#include <QDomDocument>
+#include <QDomElement>
+#include <QXmlStreamWriter>
+
+#include <QXmppClient.h>
+#include <QXmppRosterManager.h>
+#include <QXmppUtils.h>
+
+/// Roster request that always contains a version, even an empty one, so that
+/// the result contains the version of the server's roster. Servers not
+/// supporting roster versioning ignore the attribute.
+
+class QXmppVersionedRosterRequestIq : public QXmppIq
+{
+public:
+    explicit QXmppVersionedRosterRequestIq(const QString &version)
+        : QXmppIq(QXmppIq::Get),
+          m_version(version)
+    {
+    }
+
+protected:
+    void toXmlElementFromChild(QXmlStreamWriter *writer) const override
+    {
+        writer->writeStartElement(QStringLiteral("query"));
+        writer->writeDefaultNamespace(QStringLiteral("jabber:iq:roster"));
+        writer->writeAttribute(QStringLiteral("ver"), m_version);
+        writer->writeEndElement();
+    }
+
+private:
+    QString m_version;
+};
+
+/// Passes a stanza to the roster manager as if it had been received.
+
+static bool passToRosterManager(QXmppRosterManager *manager, const QXmppStanza &stanza)
+{
+    QByteArray xml;
+    QXmlStreamWriter writer(&xml);
+    stanza.toXml(&writer);
+
+    QDomDocument document;
+    document.setContent(xml, true);
+    return manager->handleStanza(document.documentElement());
+}
+
+QXmppRosterVersionManager::QXmppRosterVersionManager()
+{
+}
+
+void QXmppRosterVersionManager::requestRoster(const QString &version)
+{
+    if (!client()->isAuthenticated())
+        return;
+
+    QXmppVersionedRosterRequestIq request(version);
+    m_requestId = request.id();
+    m_requestContainsVersion = true;
+    client()->sendPacket(request);
+}
+
+void QXmppRosterVersionManager::loadStoredRoster(const QList<QXmppRosterIq::Item> &items)
+{
+    if (!m_loadingStoredRoster)
+        return;
+
+    QXmppRosterIq roster;
+    roster.setType(QXmppIq::Result);
+    for (const auto &item : items)
+        roster.addItem(item);
+    passToRosterManager(m_rosterManager, roster);
+
+    m_loadingStoredRoster = false;
+    const auto pushes = std::exchange(m_pendingPushes, {});
+    for (const auto &push : pushes)
+        handleRosterPush(push);
+}
+
+bool QXmppRosterVersionManager::handleStanza(const QDomElement &element)
+{
+    if (element.tagName() != QStringLiteral("iq"))
+        return false;
+
+    // result of the roster request
+    if (!m_requestId.isEmpty() && element.attribute(QStringLiteral("id")) == m_requestId) {
+        m_requestId.clear();
+
+        if (element.attribute(QStringLiteral("type")) == QStringLiteral("error")) {
+            // request the whole roster without a version in case the server
+            // does not accept the versioned request
+            if (m_requestContainsVersion) {
+                warning(QStringLiteral("Versioned roster request failed, requesting the whole roster"));
+                QXmppRosterIq request;
+                request.setType(QXmppIq::Get);
+                m_requestId = request.id();
+                m_requestContainsVersion = false;
+                client()->sendPacket(request);
+            }
+            return true;
+        }
+
+        const QDomElement query = element.firstChildElement(QStringLiteral("query"));
+        if (query.isNull()) {
+            // The stored roster is up to date and changes are sent as roster pushes.
+            m_loadingStoredRoster = true;
+            emit storedRosterUpToDate();
+        } else {
+            m_rosterManager->handleStanza(element);
+            emit rosterReceived(query.attribute(QStringLiteral("ver")));
+        }
+        return true;
+    }
+
+    // roster push
+    if (element.attribute(QStringLiteral("type")) == QStringLiteral("set") && QXmppRosterIq::isRosterIq(element)) {
+        // only the server is allowed to push roster changes
+        const QString from = element.attribute(QStringLiteral("from"));
+        if (!from.isEmpty() && QXmppUtils::jidToBareJid(from) != client()->configuration().jidBare())
+            return false;
+
+        QXmppRosterIq push;
+        push.parse(element);
+
+        if (m_loadingStoredRoster)
+            m_pendingPushes << push;
+        else
+            handleRosterPush(push);
+        return true;
+    }
+
+    return false;
+}
+
+void QXmppRosterVersionManager::setClient(QXmppClient *client)
+{
+    QXmppClientExtension::setClient(client);
+
+    // The roster is requested by this manager instead of the roster manager.
+    m_rosterManager = client->findExtension<QXmppRosterManager>();
+    Q_ASSERT(m_rosterManager);
+    disconnect(client, &QXmppClient::connected, m_rosterManager, nullptr);
+
+    connect(client, &QXmppClient::disconnected, this, &QXmppRosterVersionManager::handleDisconnected);
+}
+
+void QXmppRosterVersionManager::handleRosterPush(const QXmppRosterIq &push)
+{
+    if (passToRosterManager(m_rosterManager, push) && !push.version().isEmpty())
+        emit versionChanged(push.version());
+}
+
+void QXmppRosterVersionManager::handleDisconnected()
+{
+    m_requestId.clear();
+    m_loadingStoredRoster = false;
+    m_pendingPushes.clear();
+}
@@ -0,0 +1,94 @@
+/*
+ *  Kaidan - A user-friendly XMPP client for every device!
+ *
+ *  Copyright (C) 2016-2021 Kaidan developers and contributors
+ *  (see the LICENSE file for a full list of copyright authors)
+ *
+ *  Kaidan is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  In addition, as a special exception, the author of Kaidan gives
+ *  permission to link the code of its release with the OpenSSL
+ *  project's "OpenSSL" library (or with modified versions of it that
+ *  use the same license as the "OpenSSL" library), and distribute the
+ *  linked executables. You must obey the GNU General Public License in
+ *  all respects for all of the code used other than "OpenSSL". If you
+ *  modify this file, you may extend this exception to your version of
+ *  the file, but you are not obligated to do so.  If you do not wish to
+ *  do so, delete this exception statement from your version.
+ *
+ *  Kaidan is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Kaidan.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef QXMPPROSTERVERSIONMANAGER_H
+#define QXMPPROSTERVERSIONMANAGER_H
+
+#include <QXmppClientExtension.h>
+#include <QXmppRosterIq.h>
+
+class QXmppRosterManager;
+
+/// \class QXmppRosterVersionManager Requests the roster with the version of a
+/// stored roster (XEP-0237: Roster Versioning), so that the server only sends
+/// the whole roster if the stored one is outdated.
+///
+/// It replaces the roster request of the QXmppRosterManager, which must have
+/// been added to the client before. Either the roster received from the server
+/// or the stored one is passed to the QXmppRosterManager, which handles the
+/// roster as usual afterwards.
+
+class QXmppRosterVersionManager : public QXmppClientExtension
+{
+    Q_OBJECT
+
+public:
+    QXmppRosterVersionManager();
+
+    /// Requests the changes of the roster since \a version or the whole roster
+    /// if \a version is empty or outdated.
+    void requestRoster(const QString &version);
+
+    /// Passes the items of the stored roster to the QXmppRosterManager after
+    /// storedRosterUpToDate() has been emitted.
+    void loadStoredRoster(const QList<QXmppRosterIq::Item> &items);
+
+    bool handleStanza(const QDomElement &element) override;
+
+signals:
+    /// Emitted when the whole roster has been received and passed to the
+    /// QXmppRosterManager because the stored one was outdated.
+    void rosterReceived(const QString &version);
+
+    /// Emitted when the stored roster is up to date and needs to be passed to
+    /// loadStoredRoster().
+    void storedRosterUpToDate();
+
+    /// Emitted after a roster push has been applied by the QXmppRosterManager.
+    void versionChanged(const QString &version);
+
+protected:
+    void setClient(QXmppClient *client) override;
+
+private:
+    void handleRosterPush(const QXmppRosterIq &push);
+    void handleDisconnected();
+
+    QXmppRosterManager *m_rosterManager = nullptr;
+    QString m_requestId;
+    bool m_requestContainsVersion = false;
+
+    // Roster pushes received while the stored roster is loaded. They are
+    // applied after the stored items.
+    bool m_loadingStoredRoster = false;
+    QList<QXmppRosterIq> m_pendingPushes;
+};
+
+#endif // QXMPPROSTERVERSIONMANAGER_H
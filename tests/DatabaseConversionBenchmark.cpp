@@ -0,0 +1,138 @@
+// SPDX-FileCopyrightText: 2021 Kaidan developers and contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <QtTest>
+
+#include <algorithm>
+
+#include <QDir>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QStandardPaths>
+
+#include "../src/Database.h"
+#include "../src/Globals.h"
+
+constexpr int CONTACT_COUNT = 100;
+constexpr int MESSAGE_COUNT = 1000000;
+
+class DatabaseConversionBenchmark : public QObject
+{
+	Q_OBJECT
+
+private:
+	Q_SLOT void initTestCase();
+	Q_SLOT void cleanupTestCase();
+	Q_SLOT void convertV1Database();
+
+	void removeDatabaseFile();
+	void createV1Database();
+
+	QString m_databaseFilePath;
+};
+
+void DatabaseConversionBenchmark::initTestCase()
+{
+	QStandardPaths::setTestModeEnabled(true);
+
+	const QDir writeDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+	m_databaseFilePath = writeDir.absoluteFilePath(DB_FILENAME);
+}
+
+void DatabaseConversionBenchmark::cleanupTestCase()
+{
+	QSqlDatabase::removeDatabase(DB_CONNECTION);
+	removeDatabaseFile();
+}
+
+void DatabaseConversionBenchmark::convertV1Database()
+{
+	createV1Database();
+
+	Database database;
+	QVector<qreal> progress;
+	connect(&database, &Database::conversionProgressChanged, this, [&progress](qreal value) {
+		progress << value;
+	});
+
+	QBENCHMARK_ONCE {
+		database.openDatabase();
+	}
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT COUNT(*) FROM " DB_TABLE_MESSAGES)));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), MESSAGE_COUNT);
+
+	QVERIFY(!QSqlDatabase::database(DB_CONNECTION).tables().contains(DB_TABLE_CONVERSION));
+
+	QVERIFY(progress.size() > 2);
+	QVERIFY(std::is_sorted(progress.cbegin(), progress.cend()));
+	QVERIFY(progress.constFirst() == 0);
+	QVERIFY(progress.constLast() == 1);
+}
+
+void DatabaseConversionBenchmark::removeDatabaseFile()
+{
+	QFile::remove(m_databaseFilePath);
+	QFile::remove(m_databaseFilePath + QStringLiteral("-wal"));
+	QFile::remove(m_databaseFilePath + QStringLiteral("-shm"));
+	QFile::remove(QFileInfo(m_databaseFilePath).absoluteDir().absoluteFilePath(DB_ARCHIVE_FILENAME));
+}
+
+/**
+ * Creates a database with the schema of Kaidan v0.2 and MESSAGE_COUNT messages
+ * spread over the chats with CONTACT_COUNT contacts.
+ */
+void DatabaseConversionBenchmark::createV1Database()
+{
+	removeDatabaseFile();
+	QDir().mkpath(QFileInfo(m_databaseFilePath).absolutePath());
+
+	{
+		auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("v1"));
+		db.setDatabaseName(m_databaseFilePath);
+		QVERIFY(db.open());
+
+		const QStringList statements = {
+			QStringLiteral("CREATE TABLE 'Roster' ('jid' TEXT NOT NULL, 'name' TEXT NOT NULL, "
+			               "'lastExchanged' TEXT NOT NULL, 'unreadMessages' INTEGER, "
+			               "'lastMessage' TEXT, 'lastOnline' TEXT, 'activity' TEXT, "
+			               "'status' TEXT, 'mood' TEXT)"),
+			QStringLiteral("CREATE TABLE 'Messages' ('author' TEXT NOT NULL, 'author_resource' TEXT, "
+			               "'recipient' TEXT NOT NULL, 'recipient_resource' TEXT, "
+			               "'timestamp' TEXT NOT NULL, 'message' TEXT, 'id' TEXT NOT NULL, "
+			               "'isSent' BOOL, 'isDelivered' BOOL)"),
+			QStringLiteral("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < %1) "
+			               "INSERT INTO Roster (jid, name, lastExchanged, unreadMessages, lastMessage) "
+			               "SELECT 'contact' || i || '@kaidan.im', 'Contact ' || i, '', 0, '' FROM n")
+				.arg(CONTACT_COUNT),
+			QStringLiteral("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < %1) "
+			               "INSERT INTO Messages (author, author_resource, recipient, recipient_resource, "
+			               "timestamp, message, id, isSent, isDelivered) "
+			               "SELECT "
+			               "CASE WHEN i % 2 THEN 'alice@kaidan.im' ELSE 'contact' || (i % %2 + 1) || '@kaidan.im' END, "
+			               "'kaidan', "
+			               "CASE WHEN i % 2 THEN 'contact' || (i % %2 + 1) || '@kaidan.im' ELSE 'alice@kaidan.im' END, "
+			               "'kaidan', "
+			               "strftime('%Y-%m-%dT%H:%M:%SZ', 1500000000 + i * 60, 'unixepoch'), "
+			               "'Message number ' || i || ' of the conversation', 'message-' || i, 1, i % 3 != 0 "
+			               "FROM n")
+				.arg(MESSAGE_COUNT).arg(CONTACT_COUNT),
+		};
+
+		QVERIFY(db.transaction());
+		QSqlQuery query(db);
+		for (const auto &statement : statements)
+			QVERIFY2(query.exec(statement), qPrintable(query.lastError().text()));
+		QVERIFY(db.commit());
+
+		db.close();
+	}
+	QSqlDatabase::removeDatabase(QStringLiteral("v1"));
+}
+
+QTEST_GUILESS_MAIN(DatabaseConversionBenchmark)
+#include "DatabaseConversionBenchmark.moc"
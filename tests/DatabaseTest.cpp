@@ -0,0 +1,469 @@
+// SPDX-FileCopyrightText: 2021 Kaidan developers and contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <QtTest>
+
+#include <algorithm>
+#include <numeric>
+
+#include <QDir>
+#include <QSqlDatabase>
+#include <QSqlError>
+#include <QSqlQuery>
+#include <QSqlRecord>
+#include <QStandardPaths>
+
+#include "../src/Database.h"
+#include "../src/Globals.h"
+#include "../src/Utils.h"
+
+class DatabaseTest : public QObject
+{
+	Q_OBJECT
+
+private:
+	Q_SLOT void initTestCase();
+	Q_SLOT void cleanup();
+	Q_SLOT void queryPlans_data();
+	Q_SLOT void queryPlans();
+	Q_SLOT void conversion();
+	Q_SLOT void conversionFromV1();
+	Q_SLOT void rosterPrimaryKey();
+	Q_SLOT void timestampConversion();
+	Q_SLOT void fullTextIndex();
+	Q_SLOT void mediaTable();
+	Q_SLOT void uniqueMessages();
+	Q_SLOT void maintenance();
+	Q_SLOT void queryStatistics();
+	Q_SLOT void nestedPreparedQueries();
+
+	void removeDatabaseFile();
+	void createV1Database();
+	void createV12Database();
+
+	QString m_databaseFilePath;
+};
+
+void DatabaseTest::initTestCase()
+{
+	QStandardPaths::setTestModeEnabled(true);
+
+	const QDir writeDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+	m_databaseFilePath = writeDir.absoluteFilePath(DB_FILENAME);
+}
+
+void DatabaseTest::cleanup()
+{
+	QSqlDatabase::removeDatabase(DB_CONNECTION);
+	removeDatabaseFile();
+}
+
+void DatabaseTest::queryPlans_data()
+{
+	QTest::addColumn<bool>("converted");
+	QTest::addColumn<QString>("statement");
+	QTest::addColumn<QString>("index");
+
+	const QVector<std::pair<QString, QString>> statements = {
+		{
+			QStringLiteral("SELECT * FROM " DB_TABLE_MESSAGES " "
+			               "WHERE (author = 'alice@kaidan.im' AND recipient = 'bob@kaidan.im') OR "
+			               "(author = 'bob@kaidan.im' AND recipient = 'alice@kaidan.im') "
+			               "ORDER BY timestamp DESC LIMIT 20"),
+			QStringLiteral("idx_messages_chat")
+		},
+		{
+			QStringLiteral("SELECT rowid, * FROM " DB_TABLE_MESSAGES " "
+			               "WHERE author = 'alice@kaidan.im' AND recipient = 'bob@kaidan.im' "
+			               "AND (timestamp, rowid) < (1609502400000, 42) "
+			               "ORDER BY timestamp DESC, rowid DESC LIMIT 20"),
+			QStringLiteral("idx_messages_chat")
+		},
+		{
+			QStringLiteral("SELECT * FROM " DB_TABLE_MESSAGES " WHERE id = 'message-id' LIMIT 1"),
+			QStringLiteral("idx_messages_id")
+		},
+		{
+			QStringLiteral("UPDATE " DB_TABLE_MESSAGES " SET deliveryState = 2 WHERE id = 'message-id'"),
+			QStringLiteral("idx_messages_id")
+		},
+		{
+			QStringLiteral("SELECT * FROM " DB_TABLE_MESSAGES " "
+			               "WHERE (author = 'alice@kaidan.im' AND deliveryState = 0) "
+			               "ORDER BY timestamp ASC"),
+			QStringLiteral("idx_messages_pending")
+		},
+		{
+			QStringLiteral("SELECT * FROM " DB_TABLE_MESSAGE_MEDIA " WHERE messageRowId = 42"),
+			QStringLiteral("INTEGER PRIMARY KEY")
+		},
+		{
+			QStringLiteral("UPDATE " DB_TABLE_ROSTER " SET name = 'Bob' WHERE jid = 'bob@kaidan.im'"),
+			QStringLiteral("sqlite_autoindex_Roster_1")
+		},
+	};
+
+	for (bool converted : { false, true }) {
+		for (const auto &[statement, index] : statements) {
+			QTest::newRow(qPrintable(QStringLiteral("%1: %2")
+				.arg(converted ? QStringLiteral("converted") : QStringLiteral("new"), statement)))
+				<< converted << statement << index;
+		}
+	}
+}
+
+void DatabaseTest::queryPlans()
+{
+	QFETCH(bool, converted);
+	QFETCH(QString, statement);
+	QFETCH(QString, index);
+
+	if (converted)
+		createV12Database();
+
+	Database database;
+	database.openDatabase();
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY2(query.exec(QStringLiteral("EXPLAIN QUERY PLAN ") + statement),
+	         qPrintable(query.lastError().text()));
+
+	QStringList details;
+	while (query.next())
+		details << query.value(QStringLiteral("detail")).toString();
+
+	const auto plan = details.join(QLatin1Char('\n'));
+	QVERIFY2(!details.isEmpty(), "Empty query plan");
+	for (const auto &detail : qAsConst(details))
+		QVERIFY2(!detail.startsWith(QStringLiteral("SCAN")), qPrintable(plan));
+	QVERIFY2(plan.contains(index), qPrintable(plan));
+}
+
+void DatabaseTest::conversion()
+{
+	createV12Database();
+
+	// enough messages to convert the tables in several chunks
+	constexpr int messageCount = 25000;
+	{
+		auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("v12"));
+		db.setDatabaseName(m_databaseFilePath);
+		QVERIFY(db.open());
+
+		QSqlQuery query(db);
+		QVERIFY2(query.exec(QStringLiteral("WITH RECURSIVE n(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM n WHERE i < %1) "
+		                                   "INSERT INTO Messages (author, recipient, timestamp, message, id, type, deliveryState) "
+		                                   "SELECT 'alice@kaidan.im', 'bob@kaidan.im', '2021-01-02T12:00:00Z', 'Message ' || i, "
+		                                   "'generated-id-' || i, 0, 2 FROM n").arg(messageCount)),
+		         qPrintable(query.lastError().text()));
+
+		db.close();
+	}
+	QSqlDatabase::removeDatabase(QStringLiteral("v12"));
+
+	Database database;
+	database.openDatabase();
+
+	// the old tables have been dropped and replaced through all versions
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT version FROM " DB_TABLE_INFO)));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), 18);
+
+	const QStringList tables = QSqlDatabase::database(DB_CONNECTION).tables();
+	QVERIFY(!tables.contains(QStringLiteral("Messages_new")));
+	QVERIFY(!tables.contains(DB_TABLE_CONVERSION));
+
+	// one of the original messages is a duplicate
+	QVERIFY(query.exec(QStringLiteral("SELECT COUNT(*) FROM " DB_TABLE_MESSAGES)));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), messageCount + 2);
+
+	QVERIFY(query.exec(QStringLiteral("SELECT COUNT(*) FROM " DB_TABLE_MESSAGES_FTS " WHERE " DB_TABLE_MESSAGES_FTS " MATCH 'message'")));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), messageCount);
+}
+
+void DatabaseTest::conversionFromV1()
+{
+	createV1Database();
+
+	Database database;
+	database.openDatabase();
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT version, rosterVersion FROM " DB_TABLE_INFO)));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), 18);
+	QVERIFY(query.value(1).isNull());
+	QVERIFY(!query.next());
+
+	QVERIFY(query.exec(QStringLiteral("SELECT jid, subscription FROM " DB_TABLE_ROSTER)));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toString(), QStringLiteral("bob@kaidan.im"));
+	QVERIFY(!query.next());
+
+	QVERIFY(query.exec(QStringLiteral("SELECT id FROM " DB_TABLE_MESSAGES)));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toString(), QStringLiteral("message-id"));
+	QVERIFY(!query.next());
+}
+
+void DatabaseTest::rosterPrimaryKey()
+{
+	createV12Database();
+
+	Database database;
+	database.openDatabase();
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT COUNT(*) FROM " DB_TABLE_ROSTER " WHERE jid = 'bob@kaidan.im'")));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), 1);
+
+	QVERIFY(!query.exec(QStringLiteral("INSERT INTO " DB_TABLE_ROSTER " (jid, lastExchanged) VALUES ('bob@kaidan.im', '')")));
+}
+
+void DatabaseTest::timestampConversion()
+{
+	createV12Database();
+
+	Database database;
+	database.openDatabase();
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT timestamp, typeof(timestamp) FROM " DB_TABLE_MESSAGES " WHERE id = 'message-id'")));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(1).toString(), QStringLiteral("integer"));
+	QCOMPARE(query.value(0).toLongLong(), QDateTime(QDate(2021, 1, 1), QTime(12, 0), Qt::UTC).toMSecsSinceEpoch());
+}
+
+void DatabaseTest::fullTextIndex()
+{
+	createV12Database();
+
+	Database database;
+	database.openDatabase();
+
+	// the existing message is indexed by the conversion
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT m.id FROM " DB_TABLE_MESSAGES_FTS " "
+	                                  "JOIN " DB_TABLE_MESSAGES " m ON m.rowid = " DB_TABLE_MESSAGES_FTS ".rowid "
+	                                  "WHERE " DB_TABLE_MESSAGES_FTS " MATCH '\"hel\"*'")));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toString(), QStringLiteral("message-id"));
+	QVERIFY(!query.next());
+}
+
+void DatabaseTest::mediaTable()
+{
+	createV12Database();
+
+	Database database;
+	database.openDatabase();
+
+	// only the message with media has been moved to the media table
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT m.id, mm.mediaUrl FROM " DB_TABLE_MESSAGE_MEDIA " mm "
+	                                  "JOIN " DB_TABLE_MESSAGES " m ON m.rowid = mm.messageRowId")));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toString(), QStringLiteral("media-message-id"));
+	QCOMPARE(query.value(1).toString(), QStringLiteral("https://kaidan.im/image.png"));
+	QVERIFY(!query.next());
+
+	QVERIFY(!QSqlDatabase::database(DB_CONNECTION).record(DB_TABLE_MESSAGES).contains(QStringLiteral("mediaUrl")));
+}
+
+void DatabaseTest::uniqueMessages()
+{
+	createV12Database();
+
+	Database database;
+	database.openDatabase();
+
+	// the duplicate has been removed by the conversion
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("SELECT COUNT(*) FROM " DB_TABLE_MESSAGES " WHERE id = 'message-id'")));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), 1);
+
+	QVERIFY(!query.exec(QStringLiteral("INSERT INTO " DB_TABLE_MESSAGES " (author, recipient, message, id) "
+	                                   "VALUES ('alice@kaidan.im', 'bob@kaidan.im', 'Hello', 'message-id')")));
+
+	// messages without IDs are not unique
+	for (int i = 0; i < 2; i++) {
+		QVERIFY2(query.exec(QStringLiteral("INSERT INTO " DB_TABLE_MESSAGES " (author, recipient, message, id) "
+		                                   "VALUES ('alice@kaidan.im', 'bob@kaidan.im', 'Hello', ' ')")),
+		         qPrintable(query.lastError().text()));
+	}
+}
+
+void DatabaseTest::maintenance()
+{
+	createV12Database();
+
+	Database database;
+	database.openDatabase();
+
+	// converted databases are switched to incremental vacuum
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	QVERIFY(query.exec(QStringLiteral("PRAGMA auto_vacuum")));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), 2);
+
+	// the archive is attached and empty
+	QVERIFY(query.exec(QStringLiteral("SELECT COUNT(*) FROM " DB_ARCHIVE "." DB_TABLE_MESSAGES)));
+	QVERIFY(query.next());
+	QCOMPARE(query.value(0).toInt(), 0);
+}
+
+void DatabaseTest::queryStatistics()
+{
+	Utils::setQueryStatisticsEnabled(true);
+
+	Database database;
+	database.openDatabase();
+
+	const QString statement = QStringLiteral("INSERT INTO " DB_TABLE_ROSTER " (jid, name, lastExchanged) VALUES (?, ?, '')");
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	for (int i = 0; i < 3; i++)
+		Utils::execQuery(query, statement, QVector<QVariant>() << QStringLiteral("contact%1@kaidan.im").arg(i) << QStringLiteral("Contact"));
+
+	Utils::setQueryStatisticsEnabled(false);
+
+	const auto statistics = Utils::queryStatistics();
+	const auto itr = std::find_if(statistics.cbegin(), statistics.cend(), [&statement](const Utils::QueryStatistics &statementStatistics) {
+		return statementStatistics.statement == statement;
+	});
+	QVERIFY(itr != statistics.cend());
+	QCOMPARE(itr->executionCount, quint64(3));
+	QCOMPARE(itr->rowCount, quint64(3));
+	QCOMPARE(std::accumulate(itr->latencyHistogram.cbegin(), itr->latencyHistogram.cend(), quint64(0)), quint64(3));
+	QVERIFY(itr->latencyPercentile(0.5) <= itr->maxTime);
+	QVERIFY(Utils::queryStatisticsReport().contains(statement));
+}
+
+void DatabaseTest::nestedPreparedQueries()
+{
+	Database database;
+	database.openDatabase();
+
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	for (int i = 0; i < 3; i++)
+		Utils::execQuery(query, QStringLiteral("INSERT INTO " DB_TABLE_ROSTER " (jid, name, lastExchanged) VALUES (?, 'Contact', '')"),
+		                 QVector<QVariant>() << QStringLiteral("contact%1@kaidan.im").arg(i));
+
+	// preparing the same statement while its results are read must not reset
+	// the outer query
+	const QString statement = QStringLiteral("SELECT jid FROM " DB_TABLE_ROSTER " ORDER BY jid");
+	QSqlQuery outerQuery(QSqlDatabase::database(DB_CONNECTION));
+	Utils::execQuery(outerQuery, statement);
+
+	QStringList jids;
+	while (outerQuery.next()) {
+		jids << outerQuery.value(0).toString();
+
+		QSqlQuery innerQuery(QSqlDatabase::database(DB_CONNECTION));
+		Utils::execQuery(innerQuery, statement);
+		QVERIFY(innerQuery.next());
+		QCOMPARE(innerQuery.value(0).toString(), QStringLiteral("contact0@kaidan.im"));
+	}
+
+	QCOMPARE(jids, QStringList({ QStringLiteral("contact0@kaidan.im"), QStringLiteral("contact1@kaidan.im"), QStringLiteral("contact2@kaidan.im") }));
+}
+
+void DatabaseTest::removeDatabaseFile()
+{
+	QFile::remove(m_databaseFilePath);
+	QFile::remove(QFileInfo(m_databaseFilePath).absoluteDir().absoluteFilePath(DB_ARCHIVE_FILENAME));
+}
+
+/**
+ * Creates a database with the schema of version 12 (Kaidan v0.7), including a
+ * duplicate roster item.
+ */
+/**
+ * Creates a database with the schema of Kaidan v0.2, which has no dbinfo table.
+ */
+void DatabaseTest::createV1Database()
+{
+	removeDatabaseFile();
+	QDir().mkpath(QFileInfo(m_databaseFilePath).absolutePath());
+
+	{
+		auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("v1"));
+		db.setDatabaseName(m_databaseFilePath);
+		QVERIFY(db.open());
+
+		const QStringList statements = {
+			QStringLiteral("CREATE TABLE 'Roster' ('jid' TEXT NOT NULL, 'name' TEXT NOT NULL, "
+			               "'lastExchanged' TEXT NOT NULL, 'unreadMessages' INTEGER, "
+			               "'lastMessage' TEXT, 'lastOnline' TEXT, 'activity' TEXT, "
+			               "'status' TEXT, 'mood' TEXT)"),
+			QStringLiteral("CREATE TABLE 'Messages' ('author' TEXT NOT NULL, 'author_resource' TEXT, "
+			               "'recipient' TEXT NOT NULL, 'recipient_resource' TEXT, "
+			               "'timestamp' TEXT NOT NULL, 'message' TEXT, 'id' TEXT NOT NULL, "
+			               "'isSent' BOOL, 'isDelivered' BOOL)"),
+			QStringLiteral("INSERT INTO Roster (jid, name, lastExchanged, unreadMessages, lastMessage) "
+			               "VALUES ('bob@kaidan.im', 'Bob', '', 0, '')"),
+			QStringLiteral("INSERT INTO Messages (author, recipient, timestamp, message, id, isSent, isDelivered) "
+			               "VALUES ('alice@kaidan.im', 'bob@kaidan.im', '2017-01-01T12:00:00Z', 'Hello', 'message-id', 1, 1)"),
+		};
+
+		QSqlQuery query(db);
+		for (const auto &statement : statements)
+			QVERIFY2(query.exec(statement), qPrintable(query.lastError().text()));
+
+		db.close();
+	}
+	QSqlDatabase::removeDatabase(QStringLiteral("v1"));
+}
+
+void DatabaseTest::createV12Database()
+{
+	removeDatabaseFile();
+	QDir().mkpath(QFileInfo(m_databaseFilePath).absolutePath());
+
+	{
+		auto db = QSqlDatabase::addDatabase(QStringLiteral("QSQLITE"), QStringLiteral("v12"));
+		db.setDatabaseName(m_databaseFilePath);
+		QVERIFY(db.open());
+
+		const QStringList statements = {
+			QStringLiteral("CREATE TABLE 'dbinfo' ('version' INTEGER NOT NULL)"),
+			QStringLiteral("INSERT INTO dbinfo (version) VALUES (12)"),
+			QStringLiteral("CREATE TABLE 'Roster' ('jid' TEXT NOT NULL, 'name' TEXT, "
+			               "'lastExchanged' TEXT NOT NULL, 'unreadMessages' INTEGER, "
+			               "'lastMessage' TEXT NOT NULL)"),
+			QStringLiteral("INSERT INTO Roster VALUES ('bob@kaidan.im', 'Bob', '', 0, '')"),
+			QStringLiteral("INSERT INTO Roster VALUES ('bob@kaidan.im', 'Bob', '', 2, '')"),
+			QStringLiteral("CREATE TABLE 'Messages' ('author' TEXT NOT NULL, 'author_resource' TEXT, "
+			               "'recipient' TEXT NOT NULL, 'recipient_resource' TEXT, 'timestamp' TEXT, "
+			               "'message' TEXT, 'id' TEXT NOT NULL, 'isSent' BOOL, 'isDelivered' BOOL, "
+			               "'type' INTEGER, 'mediaUrl' TEXT, 'mediaSize' INTEGER, "
+			               "'mediaContentType' TEXT, 'mediaLastModified' INTEGER, "
+			               "'mediaLocation' TEXT, 'mediaThumb' BLOB, 'mediaHashes' TEXT, "
+			               "'edited' BOOL, 'isSpoiler' BOOL, 'spoilerHint' TEXT, "
+			               "'deliveryState' INTEGER, 'errorText' TEXT, 'replaceId' TEXT)"),
+			QStringLiteral("INSERT INTO Messages (author, recipient, timestamp, message, id, type, deliveryState) "
+			               "VALUES ('alice@kaidan.im', 'bob@kaidan.im', '2021-01-01T12:00:00Z', 'Hello', 'message-id', 0, 2)"),
+			// duplicate, e.g., received via Message Carbons
+			QStringLiteral("INSERT INTO Messages (author, recipient, timestamp, message, id, type, deliveryState) "
+			               "VALUES ('alice@kaidan.im', 'bob@kaidan.im', '2021-01-01T12:00:00Z', 'Hello', 'message-id', 0, 2)"),
+			QStringLiteral("INSERT INTO Messages (author, recipient, timestamp, message, id, type, deliveryState, mediaUrl) "
+			               "VALUES ('bob@kaidan.im', 'alice@kaidan.im', '2021-01-01T12:01:00Z', '', 'media-message-id', 2, 2, "
+			               "'https://kaidan.im/image.png')"),
+		};
+
+		QSqlQuery query(db);
+		for (const auto &statement : statements)
+			QVERIFY2(query.exec(statement), qPrintable(query.lastError().text()));
+
+		db.close();
+	}
+	QSqlDatabase::removeDatabase(QStringLiteral("v12"));
+}
+
+QTEST_GUILESS_MAIN(DatabaseTest)
+#include "DatabaseTest.moc"
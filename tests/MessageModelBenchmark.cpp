@@ -0,0 +1,127 @@
+// SPDX-FileCopyrightText: 2021 Kaidan developers and contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <QtTest>
+
+#include "../src/Message.h"
+#include "../src/MessageModel.h"
+#include "../src/MessageRow.h"
+
+constexpr int MESSAGE_COUNT = 10000;
+
+/**
+ * Measures the time the roles of the MessageModel need to be read for all
+ * messages of a chat, as done by the views while scrolling.
+ */
+class MessageModelBenchmark : public QObject
+{
+	Q_OBJECT
+
+private:
+	Q_SLOT void initTestCase();
+	Q_SLOT void dataFromMessages();
+	Q_SLOT void dataFromRows();
+
+	/**
+	 * Returns the value of a role as MessageModel::data() did before the rows
+	 * were introduced, i.e., by copying the message.
+	 */
+	static QVariant messageData(const QVector<Message> &messages, int row, int role);
+
+	QVector<Message> m_messages;
+	QVector<MessageRow> m_rows;
+	QVector<int> m_roles;
+};
+
+void MessageModelBenchmark::initTestCase()
+{
+	const auto stamp = QDateTime::currentDateTimeUtc();
+
+	m_messages.reserve(MESSAGE_COUNT);
+	m_rows.reserve(MESSAGE_COUNT);
+	for (int i = 0; i < MESSAGE_COUNT; i++) {
+		Message msg;
+		msg.setRowId(i + 1);
+		msg.setId(QStringLiteral("message-%1").arg(i));
+		msg.setFrom(i % 2 ? QStringLiteral("alice@kaidan.im") : QStringLiteral("bob@kaidan.im"));
+		msg.setTo(i % 2 ? QStringLiteral("bob@kaidan.im") : QStringLiteral("alice@kaidan.im"));
+		msg.setSentByMe(i % 2);
+		msg.setStamp(stamp.addSecs(-i * 60));
+		msg.setBody(QStringLiteral("Message number %1 of the conversation").arg(i));
+		msg.setMediaType(Enums::MessageType::MessageText);
+		msg.setDeliveryState(Enums::DeliveryState::Delivered);
+
+		m_messages << msg;
+		m_rows << MessageRow(msg);
+	}
+
+	for (int role = MessageModel::Timestamp; role <= MessageModel::ErrorText; role++)
+		m_roles << role;
+}
+
+void MessageModelBenchmark::dataFromMessages()
+{
+	QBENCHMARK {
+		for (int row = 0; row < m_messages.size(); row++) {
+			for (const int role : qAsConst(m_roles))
+				QVERIFY(messageData(m_messages, row, role).isValid() || role == MessageModel::MediaThumb);
+		}
+	}
+}
+
+void MessageModelBenchmark::dataFromRows()
+{
+	QBENCHMARK {
+		for (int row = 0; row < m_rows.size(); row++) {
+			for (const int role : qAsConst(m_roles))
+				QVERIFY(m_rows.at(row).data(role).isValid() || role == MessageModel::MediaThumb);
+		}
+	}
+}
+
+QVariant MessageModelBenchmark::messageData(const QVector<Message> &messages, int row, int role)
+{
+	Message msg = messages.at(row);
+
+	switch (role) {
+	case MessageModel::Timestamp:
+		return msg.stamp();
+	case MessageModel::Id:
+		return msg.id();
+	case MessageModel::Sender:
+		return msg.from();
+	case MessageModel::Recipient:
+		return msg.to();
+	case MessageModel::Body:
+		return msg.body();
+	case MessageModel::SentByMe:
+		return msg.sentByMe();
+	case MessageModel::MediaType:
+		return QVariant::fromValue(msg.mediaType());
+	case MessageModel::IsEdited:
+		return msg.isEdited();
+	case MessageModel::DeliveryState:
+		return QVariant::fromValue(msg.deliveryState());
+	case MessageModel::MediaUrl:
+		return msg.outOfBandUrl();
+	case MessageModel::MediaLocation:
+		return msg.mediaLocation();
+	case MessageModel::MediaContentType:
+		return msg.mediaContentType();
+	case MessageModel::MediaSize:
+		return msg.mediaSize();
+	case MessageModel::MediaLastModified:
+		return msg.mediaLastModified();
+	case MessageModel::IsSpoiler:
+		return msg.isSpoiler();
+	case MessageModel::SpoilerHint:
+		return msg.spoilerHint();
+	case MessageModel::ErrorText:
+		return msg.errorText();
+	}
+	return {};
+}
+
+QTEST_GUILESS_MAIN(MessageModelBenchmark)
+#include "MessageModelBenchmark.moc"
@@ -0,0 +1,143 @@
+// SPDX-FileCopyrightText: 2021 Kaidan developers and contributors
+//
+// SPDX-License-Identifier: GPL-3.0-or-later
+
+#include <QtTest>
+
+#include <QDir>
+#include <QSqlDatabase>
+#include <QSqlQuery>
+#include <QStandardPaths>
+
+#include "../src/Database.h"
+#include "../src/Globals.h"
+#include "../src/RosterDb.h"
+#include "../src/RosterItem.h"
+
+constexpr int ROSTER_ITEM_COUNT = 10000;
+// defines that every Nth item is removed, renamed or added by a replacement
+constexpr int CHANGED_ITEM_INTERVAL = 10;
+
+/**
+ * Measures the time RosterDb::replaceItems() needs to replace a large roster
+ * by one in which some items are removed, renamed or added, as done after
+ * logging in.
+ */
+class RosterDbBenchmark : public QObject
+{
+	Q_OBJECT
+
+private:
+	Q_SLOT void initTestCase();
+	Q_SLOT void cleanupTestCase();
+	Q_SLOT void replaceItems();
+
+	void removeDatabaseFile();
+
+	/**
+	 * Creates a roster of ROSTER_ITEM_COUNT items.
+	 *
+	 * @param changed whether some items are removed, renamed or added compared
+	 * to the unchanged roster
+	 */
+	static QHash<QString, RosterItem> createItems(bool changed);
+
+	/**
+	 * Returns the names of the items stored in the database by their JIDs.
+	 */
+	static QHash<QString, QString> storedItemNames();
+
+	QString m_databaseFilePath;
+};
+
+void RosterDbBenchmark::initTestCase()
+{
+	QStandardPaths::setTestModeEnabled(true);
+
+	const QDir writeDir = QStandardPaths::writableLocation(QStandardPaths::AppDataLocation);
+	m_databaseFilePath = writeDir.absoluteFilePath(DB_FILENAME);
+	removeDatabaseFile();
+}
+
+void RosterDbBenchmark::cleanupTestCase()
+{
+	QSqlDatabase::removeDatabase(DB_CONNECTION);
+	removeDatabaseFile();
+}
+
+void RosterDbBenchmark::replaceItems()
+{
+	const auto items = createItems(false);
+	const auto changedItems = createItems(true);
+
+	Database database;
+	database.openDatabase();
+	RosterDb rosterDb(&database);
+
+	rosterDb.replaceItems(items);
+	QCOMPARE(storedItemNames().size(), items.size());
+
+	bool changed = false;
+	QBENCHMARK {
+		changed = !changed;
+		rosterDb.replaceItems(changed ? changedItems : items);
+	}
+
+	// the database must contain exactly the items of the last replacement
+	const auto &expectedItems = changed ? changedItems : items;
+	const auto storedItems = storedItemNames();
+	QCOMPARE(storedItems.size(), expectedItems.size());
+	for (const auto &item : expectedItems)
+		QCOMPARE(storedItems.value(item.jid()), item.name());
+}
+
+void RosterDbBenchmark::removeDatabaseFile()
+{
+	QFile::remove(m_databaseFilePath);
+	QFile::remove(m_databaseFilePath + QStringLiteral("-wal"));
+	QFile::remove(m_databaseFilePath + QStringLiteral("-shm"));
+	QFile::remove(QFileInfo(m_databaseFilePath).absoluteDir().absoluteFilePath(DB_ARCHIVE_FILENAME));
+}
+
+QHash<QString, RosterItem> RosterDbBenchmark::createItems(bool changed)
+{
+	QHash<QString, RosterItem> items;
+	items.reserve(ROSTER_ITEM_COUNT);
+
+	for (int i = 0; i < ROSTER_ITEM_COUNT; i++) {
+		RosterItem item;
+		item.setJid(QStringLiteral("contact%1@kaidan.im").arg(i));
+		item.setName(QStringLiteral("Contact %1").arg(i));
+
+		if (changed) {
+			switch (i % CHANGED_ITEM_INTERVAL) {
+			case 0:
+				// removed and replaced by a new item
+				item.setJid(QStringLiteral("new-contact%1@kaidan.im").arg(i));
+				break;
+			case 1:
+				item.setName(QStringLiteral("Renamed contact %1").arg(i));
+				break;
+			}
+		}
+
+		items.insert(item.jid(), item);
+	}
+
+	return items;
+}
+
+QHash<QString, QString> RosterDbBenchmark::storedItemNames()
+{
+	QHash<QString, QString> names;
+	QSqlQuery query(QSqlDatabase::database(DB_CONNECTION));
+	if (!query.exec(QStringLiteral("SELECT jid, name FROM " DB_TABLE_ROSTER)))
+		return names;
+
+	while (query.next())
+		names.insert(query.value(0).toString(), query.value(1).toString());
+	return names;
+}
+
+QTEST_GUILESS_MAIN(RosterDbBenchmark)
+#include "RosterDbBenchmark.moc"